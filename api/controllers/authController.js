@@ -119,6 +119,62 @@ const getChallenge = async (req, res) => {
   }
 };
 
+// Counter authentication: the card signs 'C' || counter || nonce || timestamp,
+// the tag keeps challenge signatures from passing as counter signatures
+const COUNTER_AUTH_TAG = 0x43;
+const COUNTER_AUTH_NONCE_SIZE = 24;
+const COUNTER_AUTH_MAX_SKEW = 300;
+
+const sendCardToken = (res, card) => {
+  const token = jwt.sign(
+    {
+      cardId: card._id,
+      userId: card.user_id._id,
+      username: card.user_id.username,
+      role: 'user',
+      type: 'card'
+    },
+    JWT_SECRET,
+    { expiresIn: '1h' }
+  );
+
+  res.json({
+    token,
+    card_id: card._id,
+    user_id: card.user_id._id,
+    username: card.user_id.username,
+    expires_in: 3600
+  });
+};
+
+// Checks that the card can authenticate, sends the error otherwise
+const checkAuthCard = (res, card) => {
+  if (!card) {
+    res.status(401).json({ error: 'Invalid card' });
+    return false;
+  }
+
+  if (card.status !== 'active') {
+    res.status(403).json({ error: 'Card is not active' });
+    return false;
+  }
+
+  if (!card.secret_key) {
+    res.status(403).json({ error: 'Card has no secret key registered' });
+    return false;
+  }
+
+  if (!card.user_id) {
+    res.status(403).json({
+      error: 'Card not assigned to user',
+      code: 'CARD_UNASSIGNED'
+    });
+    return false;
+  }
+
+  return true;
+};
+
 const cardAuth = async (req, res) => {
   try {
     const { card_id, signature, challenge } = req.body;
@@ -131,23 +187,8 @@ const cardAuth = async (req, res) => {
 
     const card = await Card.findById(card_id).populate('user_id');
 
-    if (!card) {
-      return res.status(401).json({ error: 'Invalid card' });
-    }
-
-    if (card.status !== 'active') {
-      return res.status(403).json({ error: 'Card is not active' });
-    }
-
-    if (!card.secret_key) {
-      return res.status(403).json({ error: 'Card has no secret key registered' });
-    }
-
-    if (!card.user_id) {
-      return res.status(403).json({
-        error: 'Card not assigned to user',
-        code: 'CARD_UNASSIGNED'
-      });
+    if (!checkAuthCard(res, card)) {
+      return;
     }
 
     const challengeDoc = await Challenge.findOne({ challenge, card_id });
@@ -174,27 +215,75 @@ const cardAuth = async (req, res) => {
       return res.status(401).json({ error: 'Invalid signature' });
     }
 
-    const token = jwt.sign(
-      {
-        cardId: card._id,
-        userId: card.user_id._id,
-        username: card.user_id.username,
-        role: 'user',
-        type: 'card'
-      },
-      JWT_SECRET,
-      { expiresIn: '1h' }
+    sendCardToken(res, card);
+  } catch (error) {
+    console.error('Card auth error:', error);
+    res.status(500).json({ error: 'Internal server error' });
+  }
+};
+
+// One request, no challenge: the card signed its incremented counter with a
+// terminal nonce and timestamp, the counter must be above the last one seen
+const cardCounterAuth = async (req, res) => {
+  try {
+    const { card_id, counter, nonce, timestamp, signature } = req.body;
+
+    if (!card_id || counter === undefined || !nonce || timestamp === undefined || !signature) {
+      return res.status(400).json({
+        error: 'card_id, counter, nonce, timestamp, and signature are required'
+      });
+    }
+
+    if (!Number.isInteger(counter) || counter < 1 || counter > 0xFFFFFFFF ||
+        !Number.isInteger(timestamp) || timestamp < 0 || timestamp > 0xFFFFFFFF) {
+      return res.status(400).json({ error: 'Invalid counter or timestamp' });
+    }
+
+    if (Math.abs(Date.now() / 1000 - timestamp) > COUNTER_AUTH_MAX_SKEW) {
+      return res.status(401).json({ error: 'Timestamp out of range' });
+    }
+
+    const card = await Card.findById(card_id).populate('user_id');
+
+    if (!checkAuthCard(res, card)) {
+      return;
+    }
+
+    const secretKeyBuffer = Buffer.from(card.secret_key, 'hex');
+    const nonceBuffer = Buffer.from(nonce, 'hex');
+    const signatureBuffer = Buffer.from(signature, 'base64');
+
+    if (secretKeyBuffer.length !== 32 || nonceBuffer.length !== COUNTER_AUTH_NONCE_SIZE || signatureBuffer.length !== 32) {
+      return res.status(401).json({ error: 'Invalid signature format' });
+    }
+
+    const message = Buffer.alloc(1 + 4 + COUNTER_AUTH_NONCE_SIZE + 4);
+    message.writeUInt8(COUNTER_AUTH_TAG, 0);
+    message.writeUInt32BE(counter, 1);
+    nonceBuffer.copy(message, 5);
+    message.writeUInt32BE(timestamp, 5 + COUNTER_AUTH_NONCE_SIZE);
+
+    const hmac = crypto.createHmac('sha256', secretKeyBuffer);
+    hmac.update(message);
+    const expectedSignature = hmac.digest();
+
+    if (!crypto.timingSafeEqual(signatureBuffer, expectedSignature)) {
+      return res.status(401).json({ error: 'Invalid signature' });
+    }
+
+    // Conditional update: a replayed or concurrent counter matches nothing
+    const updated = await Card.updateOne(
+      { _id: card._id, auth_counter: { $lt: counter } },
+      { $set: { auth_counter: counter } }
     );
 
-    res.json({
-      token,
-      card_id: card._id,
-      user_id: card.user_id._id,
-      username: card.user_id.username,
-      expires_in: 3600
-    });
+    if (updated.modifiedCount !== 1) {
+      return res.status(401).json({ error: 'Counter already used' });
+    }
+
+    sendCardToken(res, card);
   } catch (error) {
-    console.error('Card auth error:', error);
+    console.error('Card counter auth error:', error);
     res.status(500).json({ error: 'Internal server error' });
   }
 };
@@ -203,5 +292,6 @@ module.exports = {
   login,
   register,
   getChallenge,
-  cardAuth
+  cardAuth,
+  cardCounterAuth
 };
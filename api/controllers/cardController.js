@@ -1,4 +1,17 @@
+const crypto = require('crypto');
 const Card = require('../models/Card');
+const Transaction = require('../models/Transaction');
+const Voucher = require('../models/Voucher');
+const { calculateAvailableBalance } = require('./userController');
+
+// Most a card can spend offline per voucher, in cents
+const OFFLINE_LIMIT = parseInt(process.env.OFFLINE_LIMIT) || 2000;
+
+// Card history ring (APPEND_HISTORY): entries and counterparty name size
+const HISTORY_ENTRIES = 16;
+const HISTORY_NAME_SIZE = 12;
+// Indexes are 4 bytes on the card, with room left for new ones
+const HISTORY_INDEX_MAX = 0xFFFF0000;
 
 const getAllCards = async (req, res) => {
   try {
@@ -103,9 +116,10 @@ const assignCard = async (req, res) => {
       return res.status(400).json({ error: 'user_id must be a string' });
     }
 
+    // The history indexes go on, from the new user's transactions
     const card = await Card.findByIdAndUpdate(
       req.params.card_id,
-      { user_id: req.body.user_id },
+      { user_id: req.body.user_id, history_entries: [] },
       { new: true, runValidators: true }
     ).populate('user_id', 'name');
 
@@ -122,7 +136,7 @@ const unassignCard = async (req, res) => {
   try {
     const card = await Card.findByIdAndUpdate(
       req.params.card_id,
-      { user_id: null },
+      { user_id: null, history_entries: [] },
       { new: true }
     );
 
@@ -147,6 +161,183 @@ const deleteCard = async (req, res) => {
   }
 };
 
+// Offline budget for the card, signed with its key: epoch (4 bytes) and
+// amount (4 bytes) big-endian, then HMAC('V' || epoch || amount). Only the
+// card itself, through its own token, gets one.
+//
+// The amount is held on the owner's balance until the voucher is closed
+// (see uploadOfflineReceipts). The card may still spend every voucher it
+// has not replaced yet, so holds add up: the latest voucher is sent again
+// as long as no receipt of it is settled (unless it was empty), instead of
+// holding a new one at every session.
+const issueVoucher = async (req, res) => {
+  try {
+    if (!req.user || req.user.type !== 'card' || req.user.cardId !== req.params.card_id) {
+      return res.status(403).json({ error: 'Card token required' });
+    }
+
+    const filter = { _id: req.params.card_id, status: 'active', secret_key: { $ne: null } };
+    let card = await Card.findOne(filter);
+
+    if (!card || !card.user_id) {
+      return res.status(404).json({ error: 'Card not found' });
+    }
+
+    let voucher = await Voucher.findOne({ card_id: card._id }).sort({ epoch: -1 });
+
+    if (!voucher || !voucher.open || voucher.spent > 0 || voucher.amount === 0 ||
+        !voucher.user_id.equals(card.user_id)) {
+      card = await Card.findOneAndUpdate(filter, { $inc: { offline_epoch: 1 } }, { new: true });
+      if (!card || !card.user_id) {
+        return res.status(404).json({ error: 'Card not found' });
+      }
+
+      const available = await calculateAvailableBalance(card.user_id);
+
+      voucher = await Voucher.create({
+        card_id: card._id,
+        user_id: card.user_id,
+        epoch: card.offline_epoch,
+        amount: Math.max(0, Math.min(OFFLINE_LIMIT, Math.floor(available)))
+      });
+    }
+
+    const message = Buffer.alloc(9);
+    message.write('V', 0);
+    message.writeUInt32BE(voucher.epoch, 1);
+    message.writeUInt32BE(voucher.amount, 5);
+
+    const hmac = crypto.createHmac('sha256', Buffer.from(card.secret_key, 'hex'));
+    hmac.update(message);
+
+    res.json({
+      epoch: voucher.epoch,
+      amount: voucher.amount,
+      voucher: Buffer.concat([message.subarray(1), hmac.digest()]).toString('hex')
+    });
+  } catch (error) {
+    res.status(400).json({ error: error.message });
+  }
+};
+
+// Counterparty name cut to the card field, on a UTF-8 character boundary
+const historyName = (name) => {
+  const buffer = Buffer.from(name || '', 'utf8');
+  let len = Math.min(buffer.length, HISTORY_NAME_SIZE);
+
+  while (len > 0 && len < buffer.length && (buffer[len] & 0xC0) === 0x80) {
+    len--;
+  }
+  return buffer.subarray(0, len);
+};
+
+// Gives the next history indexes of the card to the transactions of its user
+// newer than the last one indexed (the newest HISTORY_ENTRIES at first),
+// oldest first. A card never indexed here starts above ?after, so that the
+// entries it got from an older server stay behind the new ones. Returns the
+// last HISTORY_ENTRIES indexed.
+const indexCardHistory = async (card, after) => {
+  const last = card.history_entries[card.history_entries.length - 1];
+  const query = {
+    $or: [
+      { source_user_id: card.user_id },
+      { destination_user_id: card.user_id }
+    ]
+  };
+
+  if (last) {
+    query._id = { $gt: last.transaction_id };
+  }
+
+  const newer = await Transaction.find(query, '_id')
+    .sort({ _id: -1 })
+    .limit(HISTORY_ENTRIES)
+    .lean();
+
+  if (newer.length === 0) {
+    return card.history_entries;
+  }
+
+  const start = card.history_sequence || after;
+  const added = newer.reverse().map((t, i) => ({ index: start + i + 1, transaction_id: t._id }));
+
+  // Conditional update: with a concurrent request, the indexes it gave win
+  const updated = await Card.findOneAndUpdate(
+    { _id: card._id, history_sequence: card.history_sequence },
+    {
+      $set: { history_sequence: start + added.length },
+      $push: { history_entries: { $each: added, $slice: -HISTORY_ENTRIES } }
+    },
+    { new: true }
+  );
+
+  return (updated || await Card.findById(card._id)).history_entries;
+};
+
+// Newest transactions of the card's user with an index above ?after, oldest
+// first, as signed entries for APPEND_HISTORY: index, amount (signed cents,
+// negative when paid), date (Unix seconds), all 4 bytes big-endian, name
+// (12 bytes), then HMAC('H' || those 24 bytes). The index comes from the
+// card's own sequence (indexCardHistory), so it only grows for the card.
+const getHistory = async (req, res) => {
+  try {
+    if (!req.user || req.user.type !== 'card' || req.user.cardId !== req.params.card_id) {
+      return res.status(403).json({ error: 'Card token required' });
+    }
+
+    const after = Math.min(Math.max(0, parseInt(req.query.after) || 0), HISTORY_INDEX_MAX);
+    const card = await Card.findById(req.params.card_id);
+
+    if (!card || !card.secret_key || !card.user_id) {
+      return res.status(404).json({ error: 'Card not found' });
+    }
+
+    const userId = card.user_id.toString();
+    const wanted = (await indexCardHistory(card, after)).filter(({ index }) => index > after);
+
+    if (wanted.length === 0) {
+      return res.json({ entries: [] });
+    }
+
+    const transactions = new Map(
+      (await Transaction.find({ _id: { $in: wanted.map((h) => h.transaction_id) } })
+        .populate('source_user_id', 'name')
+        .populate('destination_user_id', 'name')
+        .lean()).map((t) => [t._id.toString(), t])
+    );
+    const key = Buffer.from(card.secret_key, 'hex');
+
+    const entries = wanted
+      .map(({ index, transaction_id }) => ({ t: transactions.get(transaction_id.toString()), index }))
+      .filter(({ t }) => t)
+      .map(({ t, index }) => {
+        const paid = t.source_user_id?._id.toString() === userId;
+        const received = t.destination_user_id?._id.toString() === userId;
+        const amount = paid === received ? 0 : (paid ? -t.operation : t.operation);
+        const counterparty = paid ? t.destination_user_id : t.source_user_id;
+
+        const message = Buffer.alloc(1 + 12 + HISTORY_NAME_SIZE);
+        message.write('H', 0);
+        message.writeUInt32BE(index, 1);
+        message.writeInt32BE(Math.round(amount), 5);
+        message.writeUInt32BE(Math.floor(new Date(t.date).getTime() / 1000), 9);
+        historyName(counterparty?.name).copy(message, 13);
+
+        const hmac = crypto.createHmac('sha256', key);
+        hmac.update(message);
+
+        return {
+          index,
+          entry: Buffer.concat([message.subarray(1), hmac.digest()]).toString('hex')
+        };
+      });
+
+    res.json({ entries });
+  } catch (error) {
+    res.status(400).json({ error: error.message });
+  }
+};
+
 module.exports = {
   getAllCards,
   getCardByCardId,
@@ -154,5 +345,7 @@ module.exports = {
   updateCard,
   assignCard,
   unassignCard,
-  deleteCard
+  deleteCard,
+  issueVoucher,
+  getHistory
 };
@@ -1,6 +1,16 @@
 const Transaction = require('../models/Transaction');
 const Card = require('../models/Card');
-const { calculateUserBalance } = require('./userController');
+const User = require('../models/User');
+const Voucher = require('../models/Voucher');
+const crypto = require('crypto');
+const mongoose = require('mongoose');
+const { calculateAvailableBalance } = require('./userController');
+
+// Offline receipt signed by the card: 'R', epoch, sequence and amount (4 bytes
+// each, big-endian), payee user id (12 bytes), Unix timestamp (4 bytes), then
+// the HMAC of those 29 bytes
+const RECEIPT_SIZE = 29;
+const OFFLINE_UPLOAD_MAX = 500;
 
 const formatTransaction = (t) => ({
   _id: t._id,
@@ -132,7 +142,8 @@ const createTransaction = async (req, res) => {
     }
 
     if (!infinite_funds) {
-      const currentBalance = await calculateUserBalance(source_user_id);
+      // Money held for offline payments cannot be spent twice
+      const currentBalance = await calculateAvailableBalance(source_user_id);
       const newBalance = currentBalance - operation;
 
       if (newBalance < 0) {
@@ -187,8 +198,171 @@ const updateTransactionComment = async (req, res) => {
   }
 };
 
+// Parses and checks one uploaded receipt, returns the transaction to insert
+// or the reason it is refused. The payer is the owner of the card when the
+// voucher was issued (vouchers by epoch), even if the card changed hands
+// since.
+const parseReceipt = (card, key, vouchers, receipt) => {
+  const buffer = typeof receipt === 'string' && /^[0-9a-fA-F]+$/.test(receipt)
+    ? Buffer.from(receipt, 'hex')
+    : Buffer.alloc(0);
+
+  if (buffer.length !== RECEIPT_SIZE + 32 || buffer[0] !== 'R'.charCodeAt(0)) {
+    return { error: 'Invalid receipt format' };
+  }
+
+  const message = buffer.subarray(0, RECEIPT_SIZE);
+  const hmac = crypto.createHmac('sha256', key);
+  hmac.update(message);
+
+  if (!crypto.timingSafeEqual(buffer.subarray(RECEIPT_SIZE), hmac.digest())) {
+    return { error: 'Invalid signature' };
+  }
+
+  const epoch = message.readUInt32BE(1);
+  const sequence = message.readUInt32BE(5);
+
+  const voucher = vouchers.get(epoch);
+
+  if (!voucher) {
+    return { sequence, error: 'Unknown voucher epoch' };
+  }
+
+  return {
+    sequence,
+    transaction: {
+      source_user_id: voucher.user_id,
+      destination_user_id: new mongoose.Types.ObjectId(message.subarray(13, 25).toString('hex')),
+      operation: message.readUInt32BE(9),
+      source_card_id: card._id,
+      date: new Date(message.readUInt32BE(25) * 1000),
+      offline_epoch: epoch,
+      offline_sequence: sequence
+    }
+  };
+};
+
+// A receipt of a newer voucher shows that the card replaced the older ones,
+// which it cannot spend any more. Receipt numbers go on from one voucher to
+// the next, so an older voucher has no receipt left to come once every
+// number before that receipt is settled: it is then closed, releasing what
+// it still held.
+const closeReplacedVouchers = async (cardId) => {
+  const vouchers = await Voucher.find({ card_id: cardId, open: true }).sort({ epoch: 1 });
+
+  for (const voucher of vouchers) {
+    const newer = await Transaction.findOne(
+      { source_card_id: cardId, offline_epoch: { $gt: voucher.epoch } },
+      'offline_sequence'
+    ).sort({ offline_sequence: 1 }).lean();
+
+    if (!newer) {
+      return;
+    }
+
+    const settledBefore = await Transaction.countDocuments({
+      source_card_id: cardId,
+      offline_sequence: { $lt: newer.offline_sequence }
+    });
+
+    if (settledBefore !== newer.offline_sequence - 1) {
+      return;
+    }
+
+    await Voucher.updateOne({ _id: voucher._id }, { $set: { open: false } });
+  }
+};
+
+// Settles receipts of offline payments queued by a terminal, all in one
+// insert. The card signature is the authorization, so any authenticated
+// client may upload them; a receipt already settled is reported as such.
+const uploadOfflineReceipts = async (req, res) => {
+  try {
+    const { card_id, receipts } = req.body;
+
+    if (!card_id || !Array.isArray(receipts) || receipts.length === 0) {
+      return res.status(400).json({ error: 'card_id and receipts are required' });
+    }
+
+    if (receipts.length > OFFLINE_UPLOAD_MAX) {
+      return res.status(400).json({ error: `At most ${OFFLINE_UPLOAD_MAX} receipts per upload` });
+    }
+
+    if (!req.user) {
+      return res.status(401).json({ error: 'Authentication required' });
+    }
+
+    const card = await Card.findById(card_id);
+    if (!card || !card.secret_key) {
+      return res.status(404).json({ error: 'Card not found' });
+    }
+
+    const vouchers = new Map(
+      (await Voucher.find({ card_id: card._id }, 'epoch user_id').lean()).map((v) => [v.epoch, v])
+    );
+    const key = Buffer.from(card.secret_key, 'hex');
+    const results = receipts.map((receipt) => parseReceipt(card, key, vouchers, receipt));
+
+    // The card signs any 12 bytes as payee: only existing users are paid
+    const payees = [...new Set(results.filter((r) => r.transaction)
+      .map((r) => r.transaction.destination_user_id.toString()))];
+    const users = new Set(
+      (await User.find({ _id: { $in: payees } }, '_id').lean()).map((u) => u._id.toString())
+    );
+    results.forEach((r) => {
+      if (r.transaction && !users.has(r.transaction.destination_user_id.toString())) {
+        delete r.transaction;
+        r.error = 'Unknown payee';
+      }
+    });
+
+    const pending = results.filter((r) => r.transaction);
+
+    // Unordered: a duplicate does not stop the receipts after it
+    let failed = new Map();
+    try {
+      await Transaction.insertMany(pending.map((r) => r.transaction), { ordered: false });
+    } catch (error) {
+      if (!error.writeErrors) {
+        throw error;
+      }
+      failed = new Map(error.writeErrors.map((e) => [e.index, e.code]));
+    }
+
+    const spent = new Map();
+    pending.forEach((r, i) => {
+      if (!failed.has(i)) {
+        r.status = 'settled';
+        spent.set(r.transaction.offline_epoch, (spent.get(r.transaction.offline_epoch) || 0) + r.transaction.operation);
+      } else if (failed.get(i) === 11000) {
+        r.status = 'duplicate';
+      } else {
+        r.error = 'Not settled';
+      }
+    });
+
+    // The balance now counts these receipts, their vouchers hold that less
+    await Promise.all([...spent].map(([epoch, amount]) =>
+      Voucher.updateOne({ card_id: card._id, epoch }, { $inc: { spent: amount } })
+    ));
+    await closeReplacedVouchers(card._id);
+
+    res.json({
+      results: results.map((r) => ({
+        sequence: r.sequence ?? null,
+        status: r.status || 'rejected',
+        error: r.error
+      }))
+    });
+  } catch (error) {
+    console.error('Offline receipts error:', error);
+    res.status(500).json({ error: 'Internal server error' });
+  }
+};
+
 module.exports = {
   getTransactions,
   createTransaction,
-  updateTransactionComment
+  updateTransactionComment,
+  uploadOfflineReceipts
 };
@@ -1,6 +1,7 @@
 const User = require('../models/User');
 const Card = require('../models/Card');
 const Transaction = require('../models/Transaction');
+const Voucher = require('../models/Voucher');
 
 const login = async (req, res) => {
   try {
@@ -186,6 +187,24 @@ const calculateUserBalance = async (userId) => {
   return balance;
 };
 
+// Part of the balance the user's cards may still spend offline: open
+// vouchers less their settled receipts, which the balance already counts
+const calculateHeldAmount = async (userId) => {
+  const vouchers = await Voucher.find({ user_id: userId, open: true }, 'amount spent').lean();
+
+  return vouchers.reduce((sum, v) => sum + Math.max(0, v.amount - v.spent), 0);
+};
+
+// What the user can still spend online or hand out in a new voucher
+const calculateAvailableBalance = async (userId) => {
+  const [balance, held] = await Promise.all([
+    calculateUserBalance(userId),
+    calculateHeldAmount(userId)
+  ]);
+
+  return balance - held;
+};
+
 const getUserBalance = async (req, res) => {
   try {
     const userId = req.params.id;
@@ -201,9 +220,12 @@ const getUserBalance = async (req, res) => {
       return res.status(404).json({ error: 'User not found' });
     }
 
-    const balance = await calculateUserBalance(userId);
+    const [balance, available] = await Promise.all([
+      calculateUserBalance(userId),
+      calculateAvailableBalance(userId)
+    ]);
 
-    res.json({ balance });
+    res.json({ balance, available });
   } catch (error) {
     res.status(400).json({ error: error.message });
   }
@@ -285,5 +307,6 @@ module.exports = {
   getUserBalance,
   updatePassword,
   adminResetPassword,
-  calculateUserBalance
+  calculateUserBalance,
+  calculateAvailableBalance
 };
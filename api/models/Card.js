@@ -24,7 +24,32 @@ const cardSchema = new mongoose.Schema({
     unique: true,
     sparse: true,
     default: null
-  }
+  },
+  // Last counter accepted by POST /auth/card/counter, only goes up
+  auth_counter: {
+    type: Number,
+    default: 0
+  },
+  // Epoch of the last offline voucher issued, the card only loads newer ones
+  offline_epoch: {
+    type: Number,
+    default: 0
+  },
+  // Last history index given to a transaction for this card, only goes up
+  // (the card only appends newer ones), even when the card changes hands
+  history_sequence: {
+    type: Number,
+    default: 0
+  },
+  // Last transactions indexed for the card, oldest first
+  history_entries: [{
+    _id: false,
+    index: Number,
+    transaction_id: {
+      type: mongoose.Schema.Types.ObjectId,
+      ref: 'Transaction'
+    }
+  }]
 }, {
   timestamps: true
 });
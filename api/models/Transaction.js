@@ -28,6 +28,16 @@ const transactionSchema = new mongoose.Schema({
   comment: {
     type: String,
     default: ''
+  },
+  // Voucher epoch and receipt number of a payment made offline with the
+  // card, null otherwise
+  offline_epoch: {
+    type: Number,
+    default: null
+  },
+  offline_sequence: {
+    type: Number,
+    default: null
   }
 }, {
   timestamps: true
@@ -37,5 +47,10 @@ const transactionSchema = new mongoose.Schema({
 transactionSchema.index({ date: -1 });
 transactionSchema.index({ source_user_id: 1, date: -1 });
 transactionSchema.index({ destination_user_id: 1, date: -1 });
+// A receipt is only settled once, however many times it is uploaded
+transactionSchema.index(
+  { source_card_id: 1, offline_sequence: 1 },
+  { unique: true, partialFilterExpression: { offline_sequence: { $type: 'number' } } }
+);
 
 module.exports = mongoose.model('Transaction', transactionSchema);
@@ -0,0 +1,44 @@
+const mongoose = require('mongoose');
+
+// Offline voucher issued to a card. While open, its amount less the receipts
+// already settled is held on the balance of the user who owned the card when
+// it was issued, who also pays its receipts.
+const voucherSchema = new mongoose.Schema({
+  card_id: {
+    type: mongoose.Schema.Types.ObjectId,
+    ref: 'Card',
+    required: true
+  },
+  user_id: {
+    type: mongoose.Schema.Types.ObjectId,
+    ref: 'User',
+    required: true
+  },
+  epoch: {
+    type: Number,
+    required: true
+  },
+  amount: {
+    type: Number,
+    required: true,
+    min: [0, 'Voucher amount must be positive']
+  },
+  // Sum of the settled receipts of this voucher, in cents
+  spent: {
+    type: Number,
+    default: 0
+  },
+  // Closed once the card is known to have moved to a newer voucher and every
+  // receipt of this one is settled
+  open: {
+    type: Boolean,
+    default: true
+  }
+}, {
+  timestamps: true
+});
+
+voucherSchema.index({ card_id: 1, epoch: 1 }, { unique: true });
+voucherSchema.index({ user_id: 1, open: 1 });
+
+module.exports = mongoose.model('Voucher', voucherSchema);
@@ -10,4 +10,6 @@ router.get('/challenge', authController.getChallenge);
 
 router.post('/card', authController.cardAuth);
 
+router.post('/card/counter', authController.cardCounterAuth);
+
 module.exports = router;
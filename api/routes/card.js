@@ -8,6 +8,8 @@ router.post('/', verifyJWT, cardController.createCard);
 router.get('/:card_id', verifyJWT, cardController.getCardByCardId);
 router.patch('/:card_id', verifyJWT, cardController.updateCard);
 router.post('/:card_id/assign', verifyJWT, cardController.assignCard);
+router.post('/:card_id/voucher', verifyJWT, cardController.issueVoucher);
+router.get('/:card_id/history', verifyJWT, cardController.getHistory);
 router.delete('/:card_id/assign', verifyJWT, cardController.unassignCard);
 router.delete('/:card_id', verifyJWT, cardController.deleteCard);
 
@@ -5,6 +5,7 @@ const { verifyJWT } = require('../middleware/auth');
 
 router.get('/', verifyJWT, transactionController.getTransactions);
 router.post('/', verifyJWT, transactionController.createTransaction);
+router.post('/offline', verifyJWT, transactionController.uploadOfflineReceipts);
 router.patch('/:transactionId/comment', verifyJWT, transactionController.updateTransactionComment);
 
 module.exports = router;
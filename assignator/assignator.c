@@ -8,13 +8,16 @@
 
 int main(int argc, char *argv[])
 {
-    BYTE current_card_id[SIZE_CARD_ID];
-    BYTE version;
+    CARD_INFO info;
+    uint8_t firmware_key[SIZE_FIRMWARE_KEY];
     int i;
+    int ret;
 
-    if (argc != 2) {
-        printf("Usage: %s <CARD_ID>\n", argv[0]);
+    if (argc != 3) {
+        printf("Usage: %s <CARD_ID> <firmware_key_file>\n", argv[0]);
         printf("  CARD_ID must be exactly %d characters\n", SIZE_CARD_ID);
+        printf("  firmware_key_file holds the %d hex digits of the key that signs\n", 2 * SIZE_FIRMWARE_KEY);
+        printf("  firmware updates (see updater), - for stdin\n");
         return 1;
     }
 
@@ -24,6 +27,11 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (!read_key_file(argv[2], firmware_key)) {
+        printf("Error: cannot read %d hex digits of firmware key from %s\n", 2 * SIZE_FIRMWARE_KEY, argv[2]);
+        return 1;
+    }
+
     printf("Initializing card reader...\n");
     if (!init_reader()) {
         printf("Error: Failed to initialize reader\n");
@@ -38,30 +46,21 @@ int main(int argc, char *argv[])
     }
 
     printf("Reading current card data...\n");
-    if (!read_data(current_card_id, &version)) {
+    if (!read_card_info(&info)) {
         printf("Error: Failed to read card data\n");
         disconnect_card();
         cleanup_card();
         return 1;
     }
 
-    printf("Card version: %d\n", version);
+    printf("Card version: %d\n", info.version);
     printf("Current card ID: ");
     for (i = 0; i < SIZE_CARD_ID; i++) {
-        printf("%c", current_card_id[i]);
+        printf("%c", info.card_id[i]);
     }
     printf("\n");
 
-    // Check if card is already assigned (not all zeros)
-    int is_zero = 1;
-    for (i = 0; i < SIZE_CARD_ID; i++) {
-        if (current_card_id[i] != 0x00) {
-            is_zero = 0;
-            break;
-        }
-    }
-
-    if (!is_zero) {
+    if (info.assigned) {
         printf("Warning: Card appears to already have an ID\n");
         printf("Attempting to assign anyway...\n");
     } else {
@@ -112,6 +111,18 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    // Accepted by the card only while it is unassigned
+    printf("Writing firmware key to card...\n");
+    ret = write_firmware_key(firmware_key);
+    if (ret < 0) {
+        printf("Warning: Card already has a firmware key, kept\n");
+    } else if (!ret) {
+        printf("Error: Failed to write firmware key to card\n");
+        disconnect_card();
+        cleanup_card();
+        return 1;
+    }
+
     if (!assign_card(argv[1], puk)) {
         printf("Error: Failed to assign card\n");
         disconnect_card();
@@ -141,7 +152,7 @@ int main(int argc, char *argv[])
     }
 
     printf("Verifying assignment...\n");
-    if (!read_data(current_card_id, &version)) {
+    if (!read_card_info(&info)) {
         printf("Error: Failed to verify assignment\n");
         disconnect_card();
         cleanup_card();
@@ -150,7 +161,7 @@ int main(int argc, char *argv[])
 
     printf("Card ID verified: ");
     for (i = 0; i < SIZE_CARD_ID; i++) {
-        printf("%c", current_card_id[i]);
+        printf("%c", info.card_id[i]);
     }
     printf("\n");
 
@@ -61,41 +61,9 @@ int reconnect_card()
     return (rv == SCARD_S_SUCCESS);
 }
 
-int read_data(BYTE *card_id, BYTE *version)
+int read_card_info(CARD_INFO *info)
 {
-    LONG rv;
-    BYTE cmd_card_id[] = {0x80, 0x01, 0x00, 0x00, SIZE_CARD_ID};
-    BYTE cmd_version[] = {0x80, 0x02, 0x00, 0x00, 0x01};
-    BYTE response[258];
-    DWORD responseLen;
-    SCARD_IO_REQUEST pioSendPci;
-
-    pioSendPci.dwProtocol = dwActiveProtocol;
-    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
-
-    responseLen = sizeof(response);
-    rv = SCardTransmit(hCard, &pioSendPci, cmd_card_id, sizeof(cmd_card_id),
-                      NULL, response, &responseLen);
-    if (rv != SCARD_S_SUCCESS || responseLen < SIZE_CARD_ID + 2) {
-        return 0;
-    }
-    if (response[responseLen - 2] != 0x90 || response[responseLen - 1] != 0x00) {
-        return 0;
-    }
-    memcpy(card_id, response, SIZE_CARD_ID);
-
-    responseLen = sizeof(response);
-    rv = SCardTransmit(hCard, &pioSendPci, cmd_version, sizeof(cmd_version),
-                      NULL, response, &responseLen);
-    if (rv != SCARD_S_SUCCESS || responseLen < 3) {
-        return 0;
-    }
-    if (response[responseLen - 2] != 0x90 || response[responseLen - 1] != 0x00) {
-        return 0;
-    }
-    *version = response[0];
-
-    return 1;
+    return card_info_read(hCard, dwActiveProtocol, info);
 }
 
 int assign_card(const char *card_id, const char *puk)
@@ -176,6 +144,138 @@ int write_private_key(const unsigned char *private_key_der, size_t key_len)
     return 1;
 }
 
+// Returns 1 once the card holds the key, -1 if it already had one (kept,
+// the card writes it once), 0 on other errors
+int write_firmware_key(const BYTE *key)
+{
+    LONG rv;
+    BYTE cmd[5 + SIZE_FIRMWARE_KEY] = {0x80, 0x1B, 0x00, 0x00, SIZE_FIRMWARE_KEY};
+    BYTE response[258];
+    DWORD responseLen = sizeof(response);
+    SCARD_IO_REQUEST pioSendPci;
+
+    pioSendPci.dwProtocol = dwActiveProtocol;
+    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
+
+    memcpy(cmd + 5, key, SIZE_FIRMWARE_KEY);
+
+    rv = SCardTransmit(hCard, &pioSendPci, cmd, sizeof(cmd), NULL, response, &responseLen);
+    if (rv != SCARD_S_SUCCESS || responseLen < 2) {
+        return 0;
+    }
+
+    if (response[responseLen - 2] == 0x90 && response[responseLen - 1] == 0x00) {
+        return 1;
+    }
+    if (response[responseLen - 2] == 0x69 && response[responseLen - 1] == 0x89) {
+        return -1;
+    }
+    return 0;
+}
+
+int read_key_file(const char *path, uint8_t *key)
+{
+    FILE *f;
+    char hex[2 * SIZE_FIRMWARE_KEY + 2];
+    int i;
+    unsigned int b;
+
+    f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    if (!fgets(hex, sizeof(hex), f)) {
+        hex[0] = '\0';
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+
+    if (strcspn(hex, "\r\n") != 2 * SIZE_FIRMWARE_KEY) {
+        return 0;
+    }
+    for (i = 0; i < SIZE_FIRMWARE_KEY; i++) {
+        if (sscanf(hex + 2 * i, "%2x", &b) != 1) {
+            return 0;
+        }
+        key[i] = b;
+    }
+    return 1;
+}
+
+int load_firmware_page(uint8_t page, const BYTE *data)
+{
+    LONG rv;
+    BYTE cmd[5 + SIZE_FIRMWARE_PAGE] = {0x80, 0x19, 0x00, 0x00, SIZE_FIRMWARE_PAGE};
+    BYTE response[258];
+    DWORD responseLen = sizeof(response);
+    SCARD_IO_REQUEST pioSendPci;
+
+    pioSendPci.dwProtocol = dwActiveProtocol;
+    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
+
+    cmd[2] = page;
+    memcpy(cmd + 5, data, SIZE_FIRMWARE_PAGE);
+
+    rv = SCardTransmit(hCard, &pioSendPci, cmd, sizeof(cmd), NULL, response, &responseLen);
+    if (rv != SCARD_S_SUCCESS || responseLen < 2) {
+        return 0;
+    }
+
+    return response[responseLen - 2] == 0x90 && response[responseLen - 1] == 0x00;
+}
+
+// Returns 1 once the card will copy the staged image at its next reset,
+// -1 if it refused the MAC or the version, 0 on other errors
+int install_firmware(uint8_t version, uint8_t pages, const BYTE *mac)
+{
+    LONG rv;
+    BYTE cmd[5 + 2 + SIZE_HMAC_SIGNATURE] = {0x80, 0x1A, 0x00, 0x00, 2 + SIZE_HMAC_SIGNATURE};
+    BYTE response[258];
+    DWORD responseLen = sizeof(response);
+    SCARD_IO_REQUEST pioSendPci;
+
+    pioSendPci.dwProtocol = dwActiveProtocol;
+    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
+
+    cmd[5] = version;
+    cmd[6] = pages;
+    memcpy(cmd + 7, mac, SIZE_HMAC_SIGNATURE);
+
+    rv = SCardTransmit(hCard, &pioSendPci, cmd, sizeof(cmd), NULL, response, &responseLen);
+    if (rv != SCARD_S_SUCCESS || responseLen < 2) {
+        return 0;
+    }
+
+    if (response[responseLen - 2] == 0x90 && response[responseLen - 1] == 0x00) {
+        return 1;
+    }
+    if (response[responseLen - 2] == 0x69 && response[responseLen - 1] == 0x88) {
+        return -1;
+    }
+    return 0;
+}
+
+// Powers the card off and on again. Fails while the card gives no ATR,
+// as when its boot section is copying an update.
+int reset_card()
+{
+    LONG rv;
+
+    if (hCard) {
+        rv = SCardReconnect(hCard, SCARD_SHARE_SHARED,
+                            SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1,
+                            SCARD_UNPOWER_CARD, &dwActiveProtocol);
+        if (rv == SCARD_S_SUCCESS) {
+            return 1;
+        }
+        SCardDisconnect(hCard, SCARD_UNPOWER_CARD);
+        hCard = 0;
+    }
+
+    return connect_card();
+}
+
 void disconnect_card()
 {
     if (hCard) {
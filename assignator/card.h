@@ -11,17 +11,31 @@
 #include <pcsclite.h>
 #include <winscard.h>
 #endif
+#include "card_info.h"
 
-#define SIZE_CARD_ID 24
 #define SIZE_PUK 4
-#define SIZE_PRIVATE_KEY_CHUNK 64
+#define SIZE_PRIVATE_KEY_CHUNK 32
+
+// Firmware update: image staged page by page, then signed with the
+// firmware key, written once by the assignator (see card_software/boot.h)
+#define SIZE_FIRMWARE_PAGE 128
+#define MAX_FIRMWARE_PAGES 126
+#define SIZE_HMAC_SIGNATURE 32
+#define SIZE_FIRMWARE_KEY 32
 
 int init_reader();
 int connect_card();
 int reconnect_card();
-int read_data(BYTE *card_id, BYTE *version);
+int read_card_info(CARD_INFO *info);
 int assign_card(const char *card_id, const char *puk);
 int write_private_key(const unsigned char *private_key_der, size_t key_len);
+int write_firmware_key(const BYTE *key);
+// Reads the firmware key as 64 hex digits from path, or stdin for "-", so
+// that it never shows in the process list
+int read_key_file(const char *path, uint8_t *key);
+int load_firmware_page(uint8_t page, const BYTE *data);
+int install_firmware(uint8_t version, uint8_t pages, const BYTE *mac);
+int reset_card();
 void disconnect_card();
 void cleanup_card();
 
@@ -0,0 +1,159 @@
+// In-field firmware update of an assigned card: stages the image with
+// LOAD_FIRMWARE, signs it with the firmware key for INSTALL_FIRMWARE, then resets
+// the card until the new version answers. The boot section copies the
+// image while the card stays mute, a few pages per reset.
+//
+// Usage: updater <card.bin> <version> <firmware key file>
+// card.bin is built by "make firmware" in card_software, the version must
+// be the CARD_VERSION it was built with. The key file holds the 64 hex
+// digits given to the assignator, "-" reads them from stdin.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "card.h"
+#include "hmac_sha256.h"
+#include "sha256.h"
+
+#define FIRMWARE_TAG 'F'
+// Each reset copies at least one page
+#define MAX_RESETS (2 * MAX_FIRMWARE_PAGES)
+#define RESET_DELAY_US 100000
+
+static BYTE image[MAX_FIRMWARE_PAGES * SIZE_FIRMWARE_PAGE];
+
+// Reads the image padded with 0xFF to whole pages, returns the page count
+static int read_image(const char *path)
+{
+    FILE *f;
+    size_t len;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    memset(image, 0xFF, sizeof(image));
+    len = fread(image, 1, sizeof(image), f);
+    if (fgetc(f) != EOF) {
+        len = 0;
+    }
+    fclose(f);
+
+    return (len + SIZE_FIRMWARE_PAGE - 1) / SIZE_FIRMWARE_PAGE;
+}
+
+// HMAC of 'F' || version || pages || SHA-256 of the pages, as checked by the card
+static void sign_image(const uint8_t *key, uint8_t version, uint8_t pages, uint8_t *mac)
+{
+    SHA256_CTX ctx;
+    uint8_t msg[3 + SHA256_BLOCK_SIZE];
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, image, (size_t)pages * SIZE_FIRMWARE_PAGE);
+    msg[0] = FIRMWARE_TAG;
+    msg[1] = version;
+    msg[2] = pages;
+    sha256_final(&ctx, msg + 3);
+
+    hmac_sha256(key, SIZE_FIRMWARE_KEY, msg, sizeof(msg), mac);
+}
+
+int main(int argc, char *argv[])
+{
+    CARD_INFO info;
+    uint8_t key[SIZE_FIRMWARE_KEY];
+    uint8_t mac[SIZE_HMAC_SIGNATURE];
+    int version;
+    int pages;
+    int page;
+    int attempt;
+    int ret;
+
+    if (argc != 4) {
+        printf("Usage: %s <card.bin> <version> <firmware_key_file>\n", argv[0]);
+        printf("  firmware_key_file holds the %d hex digits of the firmware key, - for stdin\n", 2 * SIZE_FIRMWARE_KEY);
+        return 1;
+    }
+
+    version = atoi(argv[2]);
+    if (version < 1 || version > 255) {
+        printf("Error: version must be between 1 and 255\n");
+        return 1;
+    }
+
+    if (!read_key_file(argv[3], key)) {
+        printf("Error: cannot read %d hex digits of firmware key from %s\n", 2 * SIZE_FIRMWARE_KEY, argv[3]);
+        return 1;
+    }
+
+    pages = read_image(argv[1]);
+    if (pages == 0) {
+        printf("Error: cannot read %s, or larger than %d bytes\n", argv[1], (int)sizeof(image));
+        return 1;
+    }
+
+    printf("Initializing card reader...\n");
+    if (!init_reader()) {
+        printf("Error: Failed to initialize reader\n");
+        return 1;
+    }
+
+    printf("Connecting to card...\n");
+    if (!connect_card()) {
+        printf("Error: Failed to connect to card\n");
+        cleanup_card();
+        return 1;
+    }
+
+    if (!read_card_info(&info)) {
+        printf("Error: Failed to read card data\n");
+        disconnect_card();
+        cleanup_card();
+        return 1;
+    }
+
+    printf("Card version: %d\n", info.version);
+    if (info.version >= version) {
+        printf("Error: card already runs version %d\n", info.version);
+        disconnect_card();
+        cleanup_card();
+        return 1;
+    }
+
+    printf("Loading %d pages...\n", pages);
+    for (page = 0; page < pages; page++) {
+        if (!load_firmware_page(page, image + page * SIZE_FIRMWARE_PAGE)) {
+            printf("Error: Failed to load page %d\n", page);
+            disconnect_card();
+            cleanup_card();
+            return 1;
+        }
+    }
+
+    sign_image(key, version, pages, mac);
+    ret = install_firmware(version, pages, mac);
+    if (ret != 1) {
+        printf(ret < 0 ? "Error: card refused the image (wrong key or version)\n"
+                       : "Error: Failed to install firmware\n");
+        disconnect_card();
+        cleanup_card();
+        return 1;
+    }
+
+    printf("Installing version %d...\n", version);
+    for (attempt = 0; attempt < MAX_RESETS; attempt++) {
+        usleep(RESET_DELAY_US);
+        if (reset_card() && read_card_info(&info) && info.version == version) {
+            printf("Card updated to version %d\n", version);
+            disconnect_card();
+            cleanup_card();
+            return 0;
+        }
+    }
+
+    printf("Error: card did not come back with version %d\n", version);
+    disconnect_card();
+    cleanup_card();
+    return 1;
+}
@@ -0,0 +1,198 @@
+// Cycle benchmark of the card HMAC, run under simavr with "make bench".
+// Built once with the C compression function and once with
+// sha256_transform.s; both runs must print the same digests. The
+// fixed-size entry points are checked against the generic path.
+// Results go out on USART0, which simavr echoes to the console.
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <stdint.h>
+#include "hmac_sha256.h"
+
+#ifdef SHA256_ASM
+#define TRANSFORM_NAME "asm"
+#else
+#define TRANSFORM_NAME "c"
+#endif
+
+#define SIZE_CHALLENGE 32
+#define SIZE_SECRET_KEY 32
+
+// HMAC-SHA256(key = 00..1f, msg = a0..bf), same shape as SIGN_CHALLENGE
+static const uint8_t expected_signature[HMAC_SHA256_DIGEST_SIZE] = {
+    0x0c, 0x95, 0xbd, 0x8b, 0xdd, 0x96, 0x00, 0x4e, 0xc3, 0xf8, 0x4f, 0x7b, 0xcc, 0x95, 0x26, 0xee,
+    0x33, 0x49, 0x19, 0x25, 0xda, 0xe7, 0x78, 0xd3, 0x2b, 0x6b, 0x81, 0xa4, 0x2c, 0x38, 0xfe, 0x93
+};
+
+uint8_t key[SIZE_SECRET_KEY];
+uint8_t challenge[SIZE_CHALLENGE];
+uint8_t signature[HMAC_SHA256_DIGEST_SIZE];
+uint8_t generic[HMAC_SHA256_DIGEST_SIZE];
+HMAC_SHA256_MIDSTATE midstate;
+
+volatile uint16_t timer1_overflows;
+
+ISR(TIMER1_OVF_vect)
+{
+    timer1_overflows++;
+}
+
+static void uart_putc(char c)
+{
+    while (!(UCSR0A & (1 << UDRE0)));
+    UDR0 = c;
+}
+
+static void uart_puts(const char *s)
+{
+    while (*s) {
+        uart_putc(*s++);
+    }
+}
+
+static void uart_putu32(uint32_t v)
+{
+    char buf[11];
+    uint8_t i = 0;
+
+    do {
+        buf[i++] = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+    while (i) {
+        uart_putc(buf[--i]);
+    }
+}
+
+static void uart_puthex(const uint8_t *b, uint8_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    uint8_t i;
+
+    for (i = 0; i < n; i++) {
+        uart_putc(hex[b[i] >> 4]);
+        uart_putc(hex[b[i] & 0x0f]);
+    }
+}
+
+// Timer1 runs on the CPU clock, overflows extend it to 32 bits
+static void timer_start(void)
+{
+    TCCR1B = 0;
+    TCNT1 = 0;
+    timer1_overflows = 0;
+    TIFR1 = 1 << TOV1;
+    TCCR1B = 1 << CS10;
+}
+
+static uint32_t timer_stop(void)
+{
+    uint16_t low;
+    uint16_t high;
+
+    cli();
+    TCCR1B = 0;
+    low = TCNT1;
+    high = timer1_overflows;
+    if (TIFR1 & (1 << TOV1)) {
+        high++;
+        TIFR1 = 1 << TOV1;
+    }
+    sei();
+
+    return ((uint32_t)high << 16) | low;
+}
+
+static void report(const char *name, uint32_t cycles)
+{
+    uart_puts(name);
+    uart_puts(" [" TRANSFORM_NAME "]: ");
+    uart_putu32(cycles);
+    uart_puts(" cycles, ");
+    uart_putu32(cycles / (F_CPU / 1000000UL));
+    uart_puts(" us\n");
+}
+
+static void check_against(const char *name, const uint8_t *expected)
+{
+    uint8_t i;
+    uint8_t match = 1;
+
+    for (i = 0; i < HMAC_SHA256_DIGEST_SIZE; i++) {
+        if (signature[i] != expected[i]) {
+            match = 0;
+        }
+    }
+
+    uart_puts(name);
+    uart_puts(match ? " digest ok: " : " digest MISMATCH: ");
+    uart_puthex(signature, HMAC_SHA256_DIGEST_SIZE);
+    uart_putc('\n');
+}
+
+static void check(const char *name)
+{
+    check_against(name, expected_signature);
+}
+
+int main(void)
+{
+    uint8_t i;
+    uint32_t cycles;
+
+    UBRR0 = 0;
+    UCSR0B = 1 << TXEN0;
+    TIMSK1 = 1 << TOIE1;
+    sei();
+
+    for (i = 0; i < SIZE_SECRET_KEY; i++) {
+        key[i] = i;
+    }
+    for (i = 0; i < SIZE_CHALLENGE; i++) {
+        challenge[i] = 0xa0 + i;
+    }
+
+    timer_start();
+    hmac_sha256(key, SIZE_SECRET_KEY, challenge, SIZE_CHALLENGE, signature);
+    cycles = timer_stop();
+    report("hmac_sha256", cycles);
+    check("hmac_sha256");
+
+    timer_start();
+    hmac_sha256_midstate(key, SIZE_SECRET_KEY, &midstate);
+    cycles = timer_stop();
+    report("hmac_sha256_midstate", cycles);
+
+    timer_start();
+    hmac_sha256_from_midstate(&midstate, challenge, SIZE_CHALLENGE, signature);
+    cycles = timer_stop();
+    report("hmac_sha256_from_midstate", cycles);
+    check("hmac_sha256_from_midstate");
+
+    timer_start();
+    hmac_sha256_from_midstate_32(&midstate, challenge, signature);
+    cycles = timer_stop();
+    report("hmac_sha256_from_midstate_32", cycles);
+    check("hmac_sha256_from_midstate_32");
+
+    // PIN/PUK hash shape: 4-byte message
+    hmac_sha256(key, SIZE_SECRET_KEY, challenge, 4, generic);
+    timer_start();
+    hmac_sha256_from_midstate(&midstate, challenge, 4, signature);
+    cycles = timer_stop();
+    report("hmac_sha256_from_midstate (4 bytes)", cycles);
+    check_against("hmac_sha256_from_midstate (4 bytes)", generic);
+
+    timer_start();
+    hmac_sha256_from_midstate_4(&midstate, challenge, signature);
+    cycles = timer_stop();
+    report("hmac_sha256_from_midstate_4", cycles);
+    check_against("hmac_sha256_from_midstate_4", generic);
+
+    // Sleeping with interrupts off ends the simavr run
+    cli();
+    sleep_enable();
+    sleep_cpu();
+    return 0;
+}
@@ -0,0 +1,93 @@
+// Boot section, built on its own as boot.elf at BOOT_START (see makefile)
+// and flashed once with the first firmware. It never changes in the field,
+// so it does as little as possible: it programs pages. Images are received
+// and verified by the firmware (LOAD_FIRMWARE and INSTALL_FIRMWARE in
+// card.c), which cannot program flash itself.
+//
+// - boot_write_page() is called by the firmware to program the staging
+//   area, the only part of flash it accepts to write.
+// - At reset, if the EEPROM update record is pending, the staged pages are
+//   copied over the firmware. The next page is saved in EEPROM after each
+//   one: a reader that gets no ATR cuts the power after a few tens of
+//   milliseconds, and the copy resumes at the next reset. The record is
+//   cleared after the last page, then the new firmware starts.
+//
+// Built without the C runtime: no initialized data, r1 is cleared here.
+
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "boot.h"
+
+void boot_start(void) __attribute__((noreturn, used));
+void boot_write_page(uint16_t addr, const uint8_t *data) __attribute__((used));
+
+// Jump table at BOOT_START, where BOOTRST sends the reset
+__attribute__((naked, used, section(".vectors")))
+void boot_vectors(void)
+{
+    asm volatile("rjmp boot_start\n\t"
+                 "rjmp boot_write_page");
+}
+
+// Erases and programs one page from RAM, with interrupts off: the
+// interrupt vectors are in the section being programmed
+static void program_page(uint16_t addr, const uint8_t *data)
+{
+    uint8_t i;
+
+    eeprom_busy_wait();
+    boot_page_erase(addr);
+    boot_spm_busy_wait();
+    for (i = 0; i < BOOT_PAGE_SIZE; i += 2) {
+        boot_page_fill(addr + i, data[i] | ((uint16_t)data[i + 1] << 8));
+    }
+    boot_page_write(addr);
+    boot_spm_busy_wait();
+    boot_rww_enable();
+}
+
+void boot_write_page(uint16_t addr, const uint8_t *data)
+{
+    uint8_t sreg;
+
+    if (addr < BOOT_STAGING_ADDR || addr >= BOOT_START || (addr & (BOOT_PAGE_SIZE - 1))) {
+        return;
+    }
+
+    sreg = SREG;
+    cli();
+    program_page(addr, data);
+    SREG = sreg;
+}
+
+void boot_start(void)
+{
+    uint8_t page[BOOT_PAGE_SIZE];
+    uint8_t next;
+    uint8_t pages;
+    uint8_t i;
+    uint16_t addr;
+
+    asm volatile("clr __zero_reg__");
+
+    if (eeprom_read_byte((const uint8_t *)BOOT_EE_MARK_ADDR) == BOOT_PENDING) {
+        pages = eeprom_read_byte((const uint8_t *)BOOT_EE_PAGES_ADDR);
+        next = eeprom_read_byte((const uint8_t *)BOOT_EE_NEXT_ADDR);
+
+        for (; next < pages && next < BOOT_MAX_PAGES; next++) {
+            addr = (uint16_t)next * BOOT_PAGE_SIZE;
+            for (i = 0; i < BOOT_PAGE_SIZE; i++) {
+                page[i] = pgm_read_byte(BOOT_STAGING_ADDR + addr + i);
+            }
+            program_page(addr, page);
+            eeprom_update_byte((uint8_t *)BOOT_EE_NEXT_ADDR, next + 1);
+        }
+        eeprom_update_byte((uint8_t *)BOOT_EE_MARK_ADDR, 0xFF);
+    }
+
+    asm volatile("jmp 0");
+    __builtin_unreachable();
+}
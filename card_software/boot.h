@@ -0,0 +1,28 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+// Flash layout for in-field updates (see boot.c). The application section
+// is split in two halves: the running firmware at 0 and the staging area
+// where LOAD_FIRMWARE writes the next image. The boot section at the top
+// of flash copies a verified image over the firmware at reset.
+
+#include <avr/io.h>
+
+#define BOOT_PAGE_SIZE 128
+#define BOOT_START 0x7E00               // 256-word boot section (BOOTSZ=11)
+#define BOOT_STAGING_ADDR 0x3F00
+#define BOOT_MAX_IMAGE BOOT_STAGING_ADDR
+#define BOOT_MAX_PAGES (BOOT_MAX_IMAGE / BOOT_PAGE_SIZE)
+
+// Jump table at BOOT_START: reset entry, then boot_write_page()
+#define BOOT_WRITE_PAGE_ADDR (BOOT_START + 2)
+
+// Update record in the last EEPROM bytes, outside the card layout: the
+// mark is set once the staged image is verified, the next page to copy
+// lets the boot section resume after a power loss
+#define BOOT_EE_NEXT_ADDR (E2END - 2)
+#define BOOT_EE_PAGES_ADDR (E2END - 1)
+#define BOOT_EE_MARK_ADDR E2END
+#define BOOT_PENDING 0xA5
+
+#endif
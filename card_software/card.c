@@ -1,28 +1,86 @@
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <stdint.h>
-#include <avr/eeprom.h>
 #include <avr/pgmspace.h>
+#include <stddef.h>
 #include <string.h>
 #include "hmac_sha256.h"
+#include "sha256.h"
+#include "ee.h"
+#include "boot.h"
+#include "flash.h"
 
 extern void sendbytet0(uint8_t b);
 extern uint8_t recbytet0(void);
+extern void unrecbytet0(uint8_t b);
+extern void set_etu(uint8_t di);
+extern void io_init(void);
+extern volatile uint16_t io_rx_parity_errors;
+extern volatile uint16_t io_tx_repeats;
+
+#ifdef T1_PROTOCOL
+#include "t1.h"
+#define ATR_PROTOCOL 1
+#else
+#define ATR_PROTOCOL 0
+#endif
 
 uint8_t cla, ins, p1, p2, p3;
 uint8_t sw1, sw2;
 uint8_t pin_verified = 0;
 
+// Command and response bytes, through the T=1 block layer when built with
+// T1=1. ATR and PPS always use the character functions directly.
+static inline void sendbyte(uint8_t b)
+{
+#ifdef T1_PROTOCOL
+    t1_sendbyte(b);
+#else
+    sendbytet0(b);
+#endif
+}
+
+static inline uint8_t recbyte(void)
+{
+#ifdef T1_PROTOCOL
+    return t1_recbyte();
+#else
+    return recbytet0();
+#endif
+}
+
+void send_status()
+{
+#ifdef T1_PROTOCOL
+    t1_send_status(sw1, sw2);
+#else
+    sendbytet0(sw1);
+    sendbytet0(sw2);
+#endif
+}
+
 #define SIZE_ATR 8
+// TA1: Fi=372, Di up to 4 (0x01 would keep the default 9600 bps)
+#define ATR_TA1 0x03
+#define MAX_DI_INDEX (ATR_TA1 & 0x0F)
 const char atr_str[SIZE_ATR] PROGMEM = "cashless";
 
 #define CARD_VERSION 201
 #define SIZE_CARD_ID 24
 #define SIZE_PIN 4
 #define SIZE_PUK 4
-#define SIZE_PRIVATE_KEY_CHUNK 64
 #define SIZE_CHALLENGE 32
 #define SIZE_SECRET_KEY 32
 #define SIZE_HMAC_SIGNATURE 32
+// SIGN_BATCH: P1 challenges in, their MACs out through GET RESPONSE, both
+// within the 255-byte T=0 limit
+#define MAX_BATCH 7
+// GET_CARD_INFO response: format, version, flags, PIN and PUK attempts, card ID
+#define CARD_INFO_FORMAT 1
+#define SIZE_CARD_INFO (5 + SIZE_CARD_ID)
+#define CARD_INFO_ASSIGNED 0x01
+#define CARD_INFO_PIN_DEFINED 0x02
 #define EEPROM_PIN_ADDR 0
 #define EEPROM_CARD_ID_ADDR 4
 #define EEPROM_ASSIGNED_FLAG_ADDR 28
@@ -31,29 +89,247 @@ const char atr_str[SIZE_ATR] PROGMEM = "cashless";
 #define EEPROM_PUK_ADDR 31
 #define EEPROM_PRIVATE_KEY_SIZE_ADDR 35
 #define EEPROM_PRIVATE_KEY_DATA_ADDR 37
+#define EEPROM_PRIVATE_KEY_MIDSTATE_ADDR 69
+#define EEPROM_CARD_ID_MIDSTATE_ADDR 133
+#define EEPROM_AUTH_COUNTER_ADDR EE_JOURNAL_END
 #define MAX_PIN_ATTEMPTS 3
 #define MAX_PUK_ATTEMPTS 3
+// COUNTER_AUTHENTICATE: signs 'C' || counter || nonce || timestamp, 33
+// bytes. The tag keeps the challenge commands (32 bytes, any content) from
+// signing a counter message.
+#define COUNTER_TAG 'C'
+#define SIZE_AUTH_COUNTER 4
+#define SIZE_TERMINAL_NONCE 24
+#define SIZE_TIMESTAMP 4
+#define SIZE_COUNTER_MESSAGE (1 + SIZE_AUTH_COUNTER + SIZE_TERMINAL_NONCE + SIZE_TIMESTAMP)
+// Offline payments: server voucher (epoch, amount, HMAC) in, debit receipts
+// ('R', epoch, sequence, amount, payee, timestamp) signed out. Both MAC
+// messages differ in length from the 32-byte challenge, so AUTHENTICATE
+// cannot be used to forge them.
+#define EEPROM_OFFLINE_ADDR (EEPROM_AUTH_COUNTER_ADDR + SIZE_AUTH_COUNTER)
+#define VOUCHER_TAG 'V'
+#define RECEIPT_TAG 'R'
+#define SIZE_VOUCHER_MESSAGE 9
+#define SIZE_VOUCHER (SIZE_VOUCHER_MESSAGE - 1 + SIZE_HMAC_SIGNATURE)
+#define SIZE_PAYEE 12
+#define SIZE_RECEIPT (13 + SIZE_PAYEE + SIZE_TIMESTAMP)
+#define SIZE_DEBIT (SIZE_PIN + 4 + SIZE_PAYEE + SIZE_TIMESTAMP)
+#define SIZE_OFFLINE_INFO 12
+#define SIZE_OFFLINE_STATE 12
+// Transaction history: ring of the last HISTORY_ENTRIES entries appended by
+// the server, each one index, amount (signed, cents), date (Unix seconds),
+// all 32-bit big-endian, and the counterparty name. Entry i goes to slot
+// i % HISTORY_ENTRIES, its index stored complemented so that an erased
+// slot is empty. The MAC covers 'H' || entry, 25 bytes.
+#define EEPROM_HISTORY_ADDR (EEPROM_OFFLINE_ADDR + SIZE_OFFLINE_STATE)
+#define HISTORY_ENTRIES 16
+#define HISTORY_TAG 'H'
+#define SIZE_HISTORY_NAME 12
+#define SIZE_HISTORY_ENTRY (12 + SIZE_HISTORY_NAME)
+#define SIZE_HISTORY_APPEND (SIZE_HISTORY_ENTRY + SIZE_HMAC_SIGNATURE)
+#define HISTORY_PAGE_ENTRIES 8
+// Firmware update: LOAD_FIRMWARE stages one flash page per command, then
+// INSTALL_FIRMWARE checks the HMAC of 'F' || version || pages || SHA-256 of
+// the staged pages, 35 bytes, and hands the image to the boot section
+// (boot.c), which copies it at the next reset
+#define FIRMWARE_TAG 'F'
+#define SIZE_FIRMWARE_MESSAGE (3 + SHA256_BLOCK_SIZE)
+#define SIZE_INSTALL (2 + SIZE_HMAC_SIGNATURE)
+// Images are signed with their own key, not the payment key: its midstates
+// follow the history ring, then its mark (0xFF = no key, like the assigned
+// flag). WRITE_FIRMWARE_KEY sets it once.
+#define EEPROM_FIRMWARE_MIDSTATE_ADDR (EEPROM_HISTORY_ADDR + HISTORY_ENTRIES * SIZE_HISTORY_ENTRY)
+#define EEPROM_FIRMWARE_KEY_MARK_ADDR (EEPROM_FIRMWARE_MIDSTATE_ADDR + sizeof(HMAC_SHA256_MIDSTATE))
+// T=0 NULL procedure byte every FIRMWARE_NULL_PAGES pages hashed, so that
+// the reader keeps waiting
+#define FIRMWARE_NULL_PAGES 8
+// GET_STATS response: format, timer divider, command counts by INS (GET
+// RESPONSE in slot 0), parity errors received and sent, error status words,
+// last HMAC and last EEPROM write in timer ticks, counters 16-bit and
+// timings 32-bit big-endian. The format changes with the layout (format 1
+// had 0x12 INS slots, format 2 16-bit timings).
+#define CARD_STATS_FORMAT 3
+#define STATS_INS_SLOTS 0x20
+#define SIZE_CARD_STATS (2 + 2 * STATS_INS_SLOTS + 6 + 8)
+// Timer1 runs on the CPU clock divided by 64 (8 us at 8 MHz) and wraps
+// every 0.5 s: its overflows are counted for the upper 16 bits
+#define STATS_TIMER_DIVIDER 64
+#define STATS_TIMER_CS ((1 << CS11) | (1 << CS10))
+
+// RAM copy of EEPROM 0x00-0x24, same layout, read once at reset. Write
+// paths change fields here and commit them all with save_state().
+typedef struct {
+    uint8_t pin_hash[SIZE_PIN];
+    uint8_t card_id[SIZE_CARD_ID];
+    uint8_t assigned_flag;
+    uint8_t pin_attempts;
+    uint8_t puk_attempts;
+    uint8_t puk_hash[SIZE_PUK];
+    uint8_t key_size[2];            // big-endian
+} CARD_STATE;
+
+_Static_assert(offsetof(CARD_STATE, assigned_flag) == EEPROM_ASSIGNED_FLAG_ADDR, "CARD_STATE must mirror EEPROM");
+_Static_assert(sizeof(CARD_STATE) == EEPROM_PRIVATE_KEY_DATA_ADDR, "CARD_STATE must mirror EEPROM");
+_Static_assert(sizeof(CARD_STATE) <= EE_JOURNAL_MAX, "CARD_STATE must fit in the EEPROM journal");
+_Static_assert(EEPROM_PRIVATE_KEY_DATA_ADDR + SIZE_SECRET_KEY == EEPROM_PRIVATE_KEY_MIDSTATE_ADDR, "The key area holds one key, the midstates follow");
+_Static_assert(EEPROM_CARD_ID_MIDSTATE_ADDR + sizeof(HMAC_SHA256_MIDSTATE) <= EE_JOURNAL_ADDR, "EEPROM journal overlaps the midstates");
+_Static_assert(SIZE_RECEIPT < SIZE_CHALLENGE, "Receipts are built in challenge_buffer and must not be challenge-sized");
+_Static_assert(1 + SIZE_HISTORY_ENTRY < SIZE_CHALLENGE, "History entries are checked in challenge_buffer and must not be challenge-sized");
+_Static_assert(SIZE_HISTORY_ENTRY <= EE_JOURNAL_MAX, "History entries are written through the EEPROM journal");
+_Static_assert(EEPROM_FIRMWARE_KEY_MARK_ADDR < BOOT_EE_NEXT_ADDR, "Firmware key overlaps the boot update record");
+
+CARD_STATE state;
+// Key for PIN/PUK hashing, loaded at reset
+HMAC_SHA256_MIDSTATE card_id_midstate;
+// Signing key, loaded only once the PIN or PUK is verified
+HMAC_SHA256_MIDSTATE key_midstate;
+// COUNTER_AUTHENTICATE counter, big-endian and complemented like in EEPROM
+uint8_t auth_counter[SIZE_AUTH_COUNTER];
+
+// Offline payment state at EEPROM_OFFLINE_ADDR, big-endian fields stored
+// complemented like the counter: an erased EEPROM has no voucher
+typedef struct {
+    uint8_t epoch[4];               // epoch of the last voucher loaded
+    uint8_t remaining[4];           // amount left to spend in that epoch
+    uint8_t sequence[4];            // last receipt number, never reset
+} OFFLINE_STATE;
+
+OFFLINE_STATE offline;
+_Static_assert(sizeof(OFFLINE_STATE) == SIZE_OFFLINE_STATE, "OFFLINE_STATE must match its EEPROM size");
+
+// Index of the newest history entry, 0 if the ring is empty
+uint32_t history_last = 0;
+
+// Diagnostics returned by GET_STATS, in RAM only: they restart at every
+// reset. The I/O and EEPROM ones are kept by io.c and ee.c.
+typedef struct {
+    uint16_t ins_count[STATS_INS_SLOTS];
+    uint16_t error_sw;
+    uint32_t hmac_ticks;
+} CARD_STATS;
+
+CARD_STATS stats;
+// Timer1 overflows since reset
+volatile uint16_t stats_timer_overflows = 0;
+
+ISR(TIMER1_OVF_vect)
+{
+    stats_timer_overflows++;
+}
+
+// Timer1 ticks since reset. TCNT1 is read with interrupts off: its high byte
+// goes through the TEMP register, which the EE_READY interrupt also uses. An
+// overflow not counted yet (flag still set) belongs to a low TCNT1.
+uint32_t stats_ticks(void)
+{
+    uint16_t high;
+    uint16_t low;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        low = TCNT1;
+        high = stats_timer_overflows;
+        if ((TIFR1 & (1 << TOV1)) && low < 0x8000) {
+            high++;
+        }
+    }
+    return ((uint32_t)high << 16) | low;
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint16_t history_slot_addr(uint32_t index)
+{
+    return EEPROM_HISTORY_ADDR + (uint16_t)(index % HISTORY_ENTRIES) * SIZE_HISTORY_ENTRY;
+}
+
+// Only the indexes are read, the entries stay in EEPROM until READ_HISTORY
+static void load_history(void)
+{
+    uint8_t index[4];
+    uint32_t i;
+    int slot;
+
+    for (slot = 0; slot < HISTORY_ENTRIES; slot++) {
+        ee_read(index, EEPROM_HISTORY_ADDR + slot * SIZE_HISTORY_ENTRY, sizeof(index));
+        i = ~get_u32(index);
+        if (i > history_last) {
+            history_last = i;
+        }
+    }
+}
+
+void load_state()
+{
+    ee_init();
+    ee_read(&state, 0, sizeof(state));
+    ee_read(&card_id_midstate, EEPROM_CARD_ID_MIDSTATE_ADDR, sizeof(card_id_midstate));
+    ee_read(auth_counter, EEPROM_AUTH_COUNTER_ADDR, sizeof(auth_counter));
+    ee_read(&offline, EEPROM_OFFLINE_ADDR, sizeof(offline));
+    load_history();
+}
+
+// Queues the changed fields of state as one atomic EEPROM update: after a
+// power loss the card comes back with either all of them or none. The
+// write goes on in the background, call ee_sync() if it must be done
+// before the status word.
+void save_state()
+{
+    ee_commit(0, &state, sizeof(state));
+}
+
+void set_pin_verified()
+{
+    pin_verified = 1;
+    ee_read(&key_midstate, EEPROM_PRIVATE_KEY_MIDSTATE_ADDR, sizeof(key_midstate));
+}
 
 void atr()
 {
     int i;
+    uint8_t b;
+    uint8_t tck;
     sendbytet0(0x3b);
     uint8_t n = 0xF0 + SIZE_ATR + 1;
     sendbytet0(n);
-    sendbytet0(0x01);
+    sendbytet0(ATR_TA1);
     sendbytet0(0x05);
     sendbytet0(0x05);
+#ifdef T1_PROTOCOL
+    sendbytet0(0x81);       // TD1: TD2 follows, T=1
+    sendbytet0(0x31);       // TD2: TA3 and TB3 follow, T=1
+    sendbytet0(T1_IFSC);    // TA3: IFSC
+    sendbytet0(0x45);       // TB3: BWI=4, CWI=5
+    tck = n ^ ATR_TA1 ^ 0x05 ^ 0x05 ^ 0x81 ^ 0x31 ^ T1_IFSC ^ 0x45;
+#else
     sendbytet0(0x00);
+    tck = 0;
+#endif
     sendbytet0(0x00);
     for (i = 0; i < SIZE_ATR; i++) {
-        sendbytet0(pgm_read_byte(atr_str + i));
+        b = pgm_read_byte(atr_str + i);
+        tck ^= b;
+        sendbytet0(b);
     }
+#ifdef T1_PROTOCOL
+    // TCK, required as soon as a protocol other than T=0 is indicated
+    sendbytet0(tck);
+#endif
 }
 
 void read_card_id()
 {
     int i;
-    uint8_t is_assigned;
 
     if (p3 != SIZE_CARD_ID) {
         sw1 = 0x6c;
@@ -61,18 +337,15 @@ void read_card_id()
         return;
     }
 
-    sendbytet0(ins);
+    sendbyte(ins);
 
-    is_assigned = eeprom_read_byte((uint8_t*)EEPROM_ASSIGNED_FLAG_ADDR);
-
-    if (is_assigned != 0xFF) {
+    if (state.assigned_flag != 0xFF) {
         for (i = 0; i < SIZE_CARD_ID; i++) {
-            uint8_t byte = eeprom_read_byte((uint8_t*)(EEPROM_CARD_ID_ADDR + i));
-            sendbytet0(byte);
+            sendbyte(state.card_id[i]);
         }
     } else {
         for (i = 0; i < SIZE_CARD_ID; i++) {
-            sendbytet0(0x00);
+            sendbyte(0x00);
         }
     }
 
@@ -86,28 +359,30 @@ void read_version()
         sw2 = 1;
         return;
     }
-    sendbytet0(ins);
-    sendbytet0(CARD_VERSION);
+    sendbyte(ins);
+    sendbyte(CARD_VERSION);
     sw1 = 0x90;
 }
 
 uint8_t pin_buffer[SIZE_PIN];
 uint8_t puk_buffer[SIZE_PUK];
-uint8_t challenge_buffer[SIZE_CHALLENGE];
-uint8_t secret_key_buffer[SIZE_SECRET_KEY];
+// One byte more than a challenge for the COUNTER_AUTHENTICATE message
+uint8_t challenge_buffer[SIZE_COUNTER_MESSAGE];
 uint8_t signature_buffer[SIZE_HMAC_SIGNATURE];
 
-void hash_pin_puk(const uint8_t *data, uint8_t data_len, uint8_t *output_4bytes)
+_Static_assert(SIZE_PIN == 4 && SIZE_PUK == 4, "hash_pin_puk() hashes 4-byte messages");
+_Static_assert(SIZE_CHALLENGE == 32, "compute_signature() signs 32-byte messages");
+
+void hash_pin_puk(const uint8_t *data, uint8_t *output_4bytes)
 {
     int i;
-    uint8_t card_id[SIZE_CARD_ID];
     uint8_t hash[SIZE_HMAC_SIGNATURE];
 
-    for (i = 0; i < SIZE_CARD_ID; i++) {
-        card_id[i] = eeprom_read_byte((uint8_t*)(EEPROM_CARD_ID_ADDR + i));
-    }
+    uint32_t start = stats_ticks();
 
-    hmac_sha256(card_id, SIZE_CARD_ID, data, data_len, hash);
+    // Keyed by the card ID, whose pads were compressed once in assign_card()
+    hmac_sha256_from_midstate_4(&card_id_midstate, data, hash);
+    stats.hmac_ticks = stats_ticks() - start;
 
     for (i = 0; i < 4; i++) {
         output_4bytes[i] = hash[i];
@@ -117,7 +392,6 @@ void hash_pin_puk(const uint8_t *data, uint8_t data_len, uint8_t *output_4bytes)
 void write_pin_only()
 {
     int i;
-    uint8_t hashed_pin[SIZE_PIN];
 
     if (p3 != SIZE_PIN) {
         sw1 = 0x6c;
@@ -125,21 +399,16 @@ void write_pin_only()
         return;
     }
 
-    sendbytet0(ins);
+    sendbyte(ins);
     for (i = 0; i < SIZE_PIN; i++) {
-        pin_buffer[i] = recbytet0();
+        pin_buffer[i] = recbyte();
     }
 
-    hash_pin_puk(pin_buffer, SIZE_PIN, hashed_pin);
+    hash_pin_puk(pin_buffer, state.pin_hash);
+    state.pin_attempts = MAX_PIN_ATTEMPTS;
+    state.puk_attempts = MAX_PUK_ATTEMPTS;
 
-    for (i = 0; i < SIZE_PIN; i++) {
-        eeprom_update_byte((uint8_t*)(EEPROM_PIN_ADDR + i), hashed_pin[i]);
-    }
-
-    eeprom_update_byte((uint8_t*)EEPROM_PIN_ATTEMPTS_ADDR, MAX_PIN_ATTEMPTS);
-    eeprom_update_byte((uint8_t*)EEPROM_PUK_ATTEMPTS_ADDR, MAX_PUK_ATTEMPTS);
-
-    eeprom_busy_wait();
+    save_state();
 
     sw1 = 0x90;
 }
@@ -147,8 +416,6 @@ void write_pin_only()
 void write_pin()
 {
     int i;
-    uint8_t hashed_pin[SIZE_PIN];
-    uint8_t hashed_puk[SIZE_PUK];
 
     if (p3 != SIZE_PIN + SIZE_PUK) {
         sw1 = 0x6c;
@@ -156,89 +423,88 @@ void write_pin()
         return;
     }
 
-    sendbytet0(ins);
+    sendbyte(ins);
     for (i = 0; i < SIZE_PIN; i++) {
-        pin_buffer[i] = recbytet0();
-    }
-    for (i = 0; i < SIZE_PUK; i++) {
-        puk_buffer[i] = recbytet0();
+        pin_buffer[i] = recbyte();
     }
 
-    hash_pin_puk(pin_buffer, SIZE_PIN, hashed_pin);
-    hash_pin_puk(puk_buffer, SIZE_PUK, hashed_puk);
+    // The PUK keeps arriving in the receive buffer while the PIN is hashed
+    hash_pin_puk(pin_buffer, state.pin_hash);
 
-    for (i = 0; i < SIZE_PIN; i++) {
-        eeprom_update_byte((uint8_t*)(EEPROM_PIN_ADDR + i), hashed_pin[i]);
-    }
     for (i = 0; i < SIZE_PUK; i++) {
-        eeprom_update_byte((uint8_t*)(EEPROM_PUK_ADDR + i), hashed_puk[i]);
+        puk_buffer[i] = recbyte();
     }
 
-    eeprom_update_byte((uint8_t*)EEPROM_PIN_ATTEMPTS_ADDR, MAX_PIN_ATTEMPTS);
-    eeprom_update_byte((uint8_t*)EEPROM_PUK_ATTEMPTS_ADDR, MAX_PUK_ATTEMPTS);
+    hash_pin_puk(puk_buffer, state.puk_hash);
+    state.pin_attempts = MAX_PIN_ATTEMPTS;
+    state.puk_attempts = MAX_PUK_ATTEMPTS;
 
-    eeprom_busy_wait();
+    save_state();
 
     sw1 = 0x90;
 }
 
-void verify_pin()
+// Checks pin_buffer against the stored PIN hash, updates the attempt
+// counter and the status word, returns 1 if the PIN matched
+uint8_t check_pin()
 {
     int i;
-    uint8_t pin_attempts;
-    uint8_t stored_pin_hash;
     uint8_t hashed_pin[SIZE_PIN];
     uint8_t match = 1;
 
+    hash_pin_puk(pin_buffer, hashed_pin);
+
+    for (i = 0; i < SIZE_PIN; i++) {
+        if (hashed_pin[i] != state.pin_hash[i]) {
+            match = 0;
+        }
+    }
+
+    if (match) {
+        set_pin_verified();
+        state.pin_attempts = MAX_PIN_ATTEMPTS;
+        save_state();
+        sw1 = 0x90;
+    } else {
+        // The failed attempt is stored before the status word reveals it
+        state.pin_attempts--;
+        save_state();
+        ee_sync();
+        sw1 = 0x63;
+        sw2 = 0xC0 | state.pin_attempts;
+    }
+
+    return match;
+}
+
+void verify_pin()
+{
+    int i;
+
     if (p3 != SIZE_PIN) {
         sw1 = 0x6c;
         sw2 = SIZE_PIN;
         return;
     }
 
-    pin_attempts = eeprom_read_byte((uint8_t*)EEPROM_PIN_ATTEMPTS_ADDR);
-
-    if (pin_attempts == 0) {
+    if (state.pin_attempts == 0) {
         sw1 = 0x69;
         sw2 = 0x83;
         return;
     }
 
-    sendbytet0(ins);
-    for (i = 0; i < SIZE_PIN; i++) {
-        pin_buffer[i] = recbytet0();
-    }
-
-    hash_pin_puk(pin_buffer, SIZE_PIN, hashed_pin);
-
+    sendbyte(ins);
     for (i = 0; i < SIZE_PIN; i++) {
-        stored_pin_hash = eeprom_read_byte((uint8_t*)(EEPROM_PIN_ADDR + i));
-        if (hashed_pin[i] != stored_pin_hash) {
-            match = 0;
-        }
+        pin_buffer[i] = recbyte();
     }
 
-    if (match) {
-        pin_verified = 1;
-        eeprom_update_byte((uint8_t*)EEPROM_PIN_ATTEMPTS_ADDR, MAX_PIN_ATTEMPTS);
-        eeprom_busy_wait();
-        sw1 = 0x90;
-    } else {
-        pin_attempts--;
-        eeprom_update_byte((uint8_t*)EEPROM_PIN_ATTEMPTS_ADDR, pin_attempts);
-        eeprom_busy_wait();
-        sw1 = 0x63;
-        sw2 = 0xC0 | pin_attempts;
-    }
+    check_pin();
 }
 
 void verify_puk()
 {
     int i;
-    uint8_t puk_attempts;
-    uint8_t stored_puk_hash;
     uint8_t hashed_puk[SIZE_PUK];
-    uint8_t hashed_pin[SIZE_PIN];
     uint8_t match = 1;
 
     if (p3 != SIZE_PUK + SIZE_PIN) {
@@ -247,47 +513,43 @@ void verify_puk()
         return;
     }
 
-    puk_attempts = eeprom_read_byte((uint8_t*)EEPROM_PUK_ATTEMPTS_ADDR);
-
-    if (puk_attempts == 0) {
+    if (state.puk_attempts == 0) {
         sw1 = 0x69;
         sw2 = 0x84;
         return;
     }
 
-    sendbytet0(ins);
+    sendbyte(ins);
     for (i = 0; i < SIZE_PUK; i++) {
-        puk_buffer[i] = recbytet0();
+        puk_buffer[i] = recbyte();
     }
+
+    // The new PIN keeps arriving in the receive buffer while the PUK is hashed
+    hash_pin_puk(puk_buffer, hashed_puk);
+
     for (i = 0; i < SIZE_PIN; i++) {
-        pin_buffer[i] = recbytet0();
+        pin_buffer[i] = recbyte();
     }
 
-    hash_pin_puk(puk_buffer, SIZE_PUK, hashed_puk);
-
     for (i = 0; i < SIZE_PUK; i++) {
-        stored_puk_hash = eeprom_read_byte((uint8_t*)(EEPROM_PUK_ADDR + i));
-        if (hashed_puk[i] != stored_puk_hash) {
+        if (hashed_puk[i] != state.puk_hash[i]) {
             match = 0;
         }
     }
 
     if (match) {
-        pin_verified = 1;
-        hash_pin_puk(pin_buffer, SIZE_PIN, hashed_pin);
-        for (i = 0; i < SIZE_PIN; i++) {
-            eeprom_update_byte((uint8_t*)(EEPROM_PIN_ADDR + i), hashed_pin[i]);
-        }
-        eeprom_update_byte((uint8_t*)EEPROM_PIN_ATTEMPTS_ADDR, MAX_PIN_ATTEMPTS);
-        eeprom_update_byte((uint8_t*)EEPROM_PUK_ATTEMPTS_ADDR, MAX_PUK_ATTEMPTS);
-        eeprom_busy_wait();
+        set_pin_verified();
+        hash_pin_puk(pin_buffer, state.pin_hash);
+        state.pin_attempts = MAX_PIN_ATTEMPTS;
+        state.puk_attempts = MAX_PUK_ATTEMPTS;
+        save_state();
         sw1 = 0x90;
     } else {
-        puk_attempts--;
-        eeprom_update_byte((uint8_t*)EEPROM_PUK_ATTEMPTS_ADDR, puk_attempts);
-        eeprom_busy_wait();
+        state.puk_attempts--;
+        save_state();
+        ee_sync();
         sw1 = 0x63;
-        sw2 = 0xC0 | puk_attempts;
+        sw2 = 0xC0 | state.puk_attempts;
     }
 }
 
@@ -299,52 +561,119 @@ void get_remaining_attempts()
         return;
     }
 
-    sendbytet0(ins);
-    sendbytet0(eeprom_read_byte((uint8_t*)EEPROM_PIN_ATTEMPTS_ADDR));
-    sendbytet0(eeprom_read_byte((uint8_t*)EEPROM_PUK_ATTEMPTS_ADDR));
+    sendbyte(ins);
+    sendbyte(state.pin_attempts);
+    sendbyte(state.puk_attempts);
     sw1 = 0x90;
 }
 
-void is_pin_defined()
+uint8_t pin_defined()
 {
     int i;
-    uint8_t pin_byte;
-    uint8_t all_ff = 1;
 
+    for (i = 0; i < SIZE_PIN; i++) {
+        if (state.pin_hash[i] != 0xFF) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void is_pin_defined()
+{
     if (p3 != 1) {
         sw1 = 0x6c;
         sw2 = 1;
         return;
     }
 
-    sendbytet0(ins);
+    sendbyte(ins);
+    sendbyte(pin_defined());
 
-    for (i = 0; i < SIZE_PIN; i++) {
-        pin_byte = eeprom_read_byte((uint8_t*)(EEPROM_PIN_ADDR + i));
+    sw1 = 0x90;
+}
 
-        if (pin_byte != 0xFF) {
-            all_ff = 0;
-            break;
-        }
+// Everything the host needs when a card is inserted, in one response
+void get_card_info()
+{
+    int i;
+    uint8_t assigned = state.assigned_flag != 0xFF;
+
+    if (p3 != SIZE_CARD_INFO) {
+        sw1 = 0x6c;
+        sw2 = SIZE_CARD_INFO;
+        return;
     }
 
-    if (all_ff) {
-        sendbytet0(0x00);
-    } else {
-        sendbytet0(0x01);
+    sendbyte(ins);
+    sendbyte(CARD_INFO_FORMAT);
+    sendbyte(CARD_VERSION);
+    sendbyte((assigned ? CARD_INFO_ASSIGNED : 0) | (pin_defined() ? CARD_INFO_PIN_DEFINED : 0));
+    sendbyte(state.pin_attempts);
+    sendbyte(state.puk_attempts);
+
+    for (i = 0; i < SIZE_CARD_ID; i++) {
+        sendbyte(assigned ? state.card_id[i] : 0x00);
+    }
+
+    sw1 = 0x90;
+}
+
+static void send_u16(uint16_t v)
+{
+    sendbyte((uint8_t)(v >> 8));
+    sendbyte((uint8_t)v);
+}
+
+static void send_u32(uint32_t v)
+{
+    send_u16((uint16_t)(v >> 16));
+    send_u16((uint16_t)v);
+}
+
+// Counters since the last reset, for the terminal logs
+void get_stats()
+{
+    int i;
+    uint16_t rx_parity_errors;
+    uint16_t tx_repeats;
+    uint32_t eeprom_ticks;
+
+    if (p3 != SIZE_CARD_STATS) {
+        sw1 = 0x6c;
+        sw2 = SIZE_CARD_STATS;
+        return;
     }
 
+    // Written by the interrupts, read in one go
+    cli();
+    rx_parity_errors = io_rx_parity_errors;
+    tx_repeats = io_tx_repeats;
+    eeprom_ticks = ee_last_write_ticks;
+    sei();
+
+    sendbyte(ins);
+    sendbyte(CARD_STATS_FORMAT);
+    sendbyte(STATS_TIMER_DIVIDER);
+    for (i = 0; i < STATS_INS_SLOTS; i++) {
+        send_u16(stats.ins_count[i]);
+    }
+    send_u16(rx_parity_errors);
+    send_u16(tx_repeats);
+    send_u16(stats.error_sw);
+    send_u32(stats.hmac_ticks);
+    send_u32(eeprom_ticks);
+
     sw1 = 0x90;
 }
 
-uint8_t card_id_buffer[SIZE_CARD_ID];
 #define private_key_chunk_buffer signature_buffer
 
 void assign_card()
 {
     int i;
-    uint8_t is_assigned;
-    uint8_t hashed_puk[SIZE_PUK];
+    uint32_t start;
 
     if (p3 != SIZE_CARD_ID + SIZE_PUK) {
         sw1 = 0x6c;
@@ -352,37 +681,35 @@ void assign_card()
         return;
     }
 
-    is_assigned = eeprom_read_byte((uint8_t*)EEPROM_ASSIGNED_FLAG_ADDR);
-
-    if (is_assigned != 0xFF) {
+    if (state.assigned_flag != 0xFF) {
         sw1 = 0x6a;
         sw2 = 0x81;
         return;
     }
 
-    sendbytet0(ins);
-    for (i = 0; i < SIZE_CARD_ID; i++) {
-        card_id_buffer[i] = recbytet0();
-    }
-    for (i = 0; i < SIZE_PUK; i++) {
-        puk_buffer[i] = recbytet0();
-    }
-
+    sendbyte(ins);
     for (i = 0; i < SIZE_CARD_ID; i++) {
-        eeprom_update_byte((uint8_t*)(EEPROM_CARD_ID_ADDR + i), card_id_buffer[i]);
+        state.card_id[i] = recbyte();
     }
 
-    hash_pin_puk(puk_buffer, SIZE_PUK, hashed_puk);
+    // The PUK keeps arriving in the receive buffer while the midstates are
+    // computed. They are written before the state commit that marks the card
+    // as assigned.
+    start = stats_ticks();
+    hmac_sha256_midstate(state.card_id, SIZE_CARD_ID, &card_id_midstate);
+    stats.hmac_ticks = stats_ticks() - start;
+    ee_write(EEPROM_CARD_ID_MIDSTATE_ADDR, &card_id_midstate, sizeof(card_id_midstate));
 
     for (i = 0; i < SIZE_PUK; i++) {
-        eeprom_update_byte((uint8_t*)(EEPROM_PUK_ADDR + i), hashed_puk[i]);
+        puk_buffer[i] = recbyte();
     }
 
-    eeprom_update_byte((uint8_t*)EEPROM_PIN_ATTEMPTS_ADDR, MAX_PIN_ATTEMPTS);
-    eeprom_update_byte((uint8_t*)EEPROM_PUK_ATTEMPTS_ADDR, MAX_PUK_ATTEMPTS);
-    eeprom_update_byte((uint8_t*)EEPROM_ASSIGNED_FLAG_ADDR, 0x00);
+    hash_pin_puk(puk_buffer, state.puk_hash);
+    state.pin_attempts = MAX_PIN_ATTEMPTS;
+    state.puk_attempts = MAX_PUK_ATTEMPTS;
+    state.assigned_flag = 0x00;
 
-    eeprom_busy_wait();
+    save_state();
 
     sw1 = 0x90;
 }
@@ -391,46 +718,97 @@ void write_private_key_chunk()
 {
     int i;
     uint8_t chunk_index;
-    uint16_t offset;
+    uint16_t offset = EEPROM_PRIVATE_KEY_DATA_ADDR;
+    uint16_t total_size;
 
-    if (p3 < 1 || p3 > SIZE_PRIVATE_KEY_CHUNK + 1) {
+    // The key area ends where its midstates start, and the chunk buffer
+    // is signature_buffer: one chunk of SIZE_SECRET_KEY bytes at most
+    if (p3 < 1 || p3 > SIZE_SECRET_KEY + 1) {
         sw1 = 0x6c;
-        sw2 = SIZE_PRIVATE_KEY_CHUNK + 1;
+        sw2 = SIZE_SECRET_KEY + 1;
         return;
     }
 
-    sendbytet0(ins);
-    chunk_index = recbytet0();
+    // The previous chunk may still be written from the buffer
+    ee_sync();
+
+    sendbyte(ins);
+    chunk_index = recbyte();
+    for (i = 0; i < p3 - 1; i++) {
+        private_key_chunk_buffer[i] = recbyte();
+    }
 
-    if (chunk_index > 30) {
+    // Any later chunk would overwrite the midstates
+    if (chunk_index > 0) {
         sw1 = 0x6a;
         sw2 = 0x84;
         return;
     }
 
-    for (i = 0; i < p3 - 1; i++) {
-        private_key_chunk_buffer[i] = recbytet0();
+    ee_write(offset, private_key_chunk_buffer, p3 - 1);
+    total_size = (uint16_t)(p3 - 1);
+
+    // Key is complete: store its pad midstates for sign_challenge().
+    // sign_challenge() still needs a verified PIN to use them.
+    if (total_size == SIZE_SECRET_KEY) {
+        uint32_t start = stats_ticks();
+
+        hmac_sha256_midstate(private_key_chunk_buffer, SIZE_SECRET_KEY, &key_midstate);
+        stats.hmac_ticks = stats_ticks() - start;
+        ee_write(EEPROM_PRIVATE_KEY_MIDSTATE_ADDR, &key_midstate, sizeof(key_midstate));
     }
 
-    offset = EEPROM_PRIVATE_KEY_DATA_ADDR + ((uint16_t)chunk_index * (uint16_t)SIZE_PRIVATE_KEY_CHUNK);
+    // Committed after the key and midstates, which are written first
+    state.key_size[0] = (uint8_t)(total_size >> 8);
+    state.key_size[1] = (uint8_t)(total_size & 0xFF);
+    save_state();
+
+    sw1 = 0x90;
+}
+
+static const uint8_t firmware_key_mark = 0x00;
+
+// The firmware signing key, SIZE_SECRET_KEY bytes, is written once and
+// only before ASSIGN_CARD, at personalisation: whoever sets it can install
+// any image. Only its midstates are stored, then the mark. Both are
+// written before the status word, the midstates are on the stack.
+void write_firmware_key()
+{
+    int i;
+    uint8_t mark;
+    uint32_t start;
+    HMAC_SHA256_MIDSTATE midstate;
+
+    if (p3 != SIZE_SECRET_KEY) {
+        sw1 = 0x6c;
+        sw2 = SIZE_SECRET_KEY;
+        return;
+    }
 
-    if (offset < EEPROM_PRIVATE_KEY_DATA_ADDR) {
+    if (state.assigned_flag != 0xFF) {
         sw1 = 0x6a;
-        sw2 = 0x82;
+        sw2 = 0x81;
         return;
     }
 
-    for (i = 0; i < p3 - 1; i++) {
-        eeprom_update_byte((uint8_t*)(offset + i), private_key_chunk_buffer[i]);
+    ee_read(&mark, EEPROM_FIRMWARE_KEY_MARK_ADDR, 1);
+    if (mark != 0xFF) {
+        sw1 = 0x69;
+        sw2 = 0x89;
+        return;
     }
 
-    if (chunk_index == 0) {
-        uint16_t total_size = (uint16_t)(p3 - 1);
-        eeprom_update_byte((uint8_t*)EEPROM_PRIVATE_KEY_SIZE_ADDR, (uint8_t)(total_size >> 8));
-        eeprom_update_byte((uint8_t*)(EEPROM_PRIVATE_KEY_SIZE_ADDR + 1), (uint8_t)(total_size & 0xFF));
+    sendbyte(ins);
+    for (i = 0; i < SIZE_SECRET_KEY; i++) {
+        private_key_chunk_buffer[i] = recbyte();
     }
 
-    eeprom_busy_wait();
+    start = stats_ticks();
+    hmac_sha256_midstate(private_key_chunk_buffer, SIZE_SECRET_KEY, &midstate);
+    stats.hmac_ticks = stats_ticks() - start;
+    ee_write(EEPROM_FIRMWARE_MIDSTATE_ADDR, &midstate, sizeof(midstate));
+    ee_write(EEPROM_FIRMWARE_KEY_MARK_ADDR, &firmware_key_mark, 1);
+    ee_sync();
 
     sw1 = 0x90;
 }
@@ -459,14 +837,62 @@ void set_challenge()
         return;
     }
 
-    sendbytet0(ins);
+    sendbyte(ins);
     for (i = 0; i < SIZE_CHALLENGE; i++) {
-        challenge_buffer[i] = recbytet0();
+        challenge_buffer[i] = recbyte();
     }
 
     sw1 = 0x90;
 }
 
+// Returns 0 and sets the status word if no complete key is stored
+uint8_t check_key(void)
+{
+    uint16_t key_size = ((uint16_t)state.key_size[0] << 8) | (uint16_t)state.key_size[1];
+
+    if (key_size != SIZE_SECRET_KEY) {
+        sw1 = 0x6a;
+        sw2 = 0x88;
+        return 0;
+    }
+    return 1;
+}
+
+// HMAC of challenge_buffer into signature_buffer, which must not be the
+// source of a pending EEPROM write
+void hmac_challenge(void)
+{
+    uint32_t start = stats_ticks();
+
+    hmac_sha256_from_midstate_32(&key_midstate, challenge_buffer, signature_buffer);
+    stats.hmac_ticks = stats_ticks() - start;
+}
+
+// HMAC of the first len bytes of challenge_buffer into signature_buffer,
+// same constraint as hmac_challenge()
+void hmac_message(uint8_t len)
+{
+    uint32_t start = stats_ticks();
+
+    hmac_sha256_from_midstate(&key_midstate, challenge_buffer, len, signature_buffer);
+    stats.hmac_ticks = stats_ticks() - start;
+}
+
+// HMAC of challenge_buffer into signature_buffer, returns 0 and sets the
+// status word if no complete key is stored
+uint8_t compute_signature(void)
+{
+    if (!check_key()) {
+        return 0;
+    }
+
+    // signature_buffer is also the key chunk buffer, maybe still being written
+    ee_sync();
+    hmac_challenge();
+
+    return 1;
+}
+
 void sign_challenge()
 {
     int i;
@@ -481,31 +907,651 @@ void sign_challenge()
         return;
     }
 
-    uint16_t key_size = ((uint16_t)eeprom_read_byte((uint8_t*)EEPROM_PRIVATE_KEY_SIZE_ADDR) << 8) |
-                        (uint16_t)eeprom_read_byte((uint8_t*)(EEPROM_PRIVATE_KEY_SIZE_ADDR + 1));
+    if (!compute_signature()) {
+        return;
+    }
+
+    sendbyte(ins);
+    for (i = 0; i < SIZE_HMAC_SIGNATURE; i++) {
+        sendbyte(signature_buffer[i]);
+    }
 
-    if (key_size != SIZE_SECRET_KEY) {
+    sw1 = 0x90;
+}
+
+// Bytes waiting for GET RESPONSE, reset by any other command: the
+// response_prefix first bytes of challenge_buffer, then response_data
+// (signature_buffer unless SIGN_BATCH)
+uint8_t response_len = 0;
+uint8_t response_prefix = 0;
+const uint8_t *response_data = signature_buffer;
+uint8_t batch_buffer[MAX_BATCH * SIZE_HMAC_SIGNATURE];
+_Static_assert(BOOT_PAGE_SIZE <= sizeof(batch_buffer), "LOAD_FIRMWARE receives a page in batch_buffer");
+_Static_assert(SIZE_FIRMWARE_MESSAGE <= sizeof(batch_buffer), "INSTALL_FIRMWARE builds its message in batch_buffer");
+_Static_assert(BOOT_MAX_PAGES <= 0xFF, "Page numbers are one byte");
+
+// VERIFY_PIN + SET_CHALLENGE + SIGN_CHALLENGE in one command: PIN then
+// challenge in, signature out through 61 20 and GET RESPONSE
+void authenticate()
+{
+    int i;
+    uint8_t pin_ok;
+
+    if (p3 != SIZE_PIN + SIZE_CHALLENGE) {
+        sw1 = 0x6c;
+        sw2 = SIZE_PIN + SIZE_CHALLENGE;
+        return;
+    }
+
+    if (state.pin_attempts == 0) {
+        sw1 = 0x69;
+        sw2 = 0x83;
+        return;
+    }
+
+    sendbyte(ins);
+    for (i = 0; i < SIZE_PIN; i++) {
+        pin_buffer[i] = recbyte();
+    }
+
+    // The challenge keeps arriving in the receive buffer while the PIN is checked
+    pin_ok = check_pin();
+
+    for (i = 0; i < SIZE_CHALLENGE; i++) {
+        challenge_buffer[i] = recbyte();
+    }
+
+    if (!pin_ok) {
+        return;
+    }
+
+    if (!compute_signature()) {
+        return;
+    }
+
+    response_len = SIZE_HMAC_SIGNATURE;
+    response_prefix = 0;
+    sw1 = 0x61;
+    sw2 = SIZE_HMAC_SIGNATURE;
+}
+
+// PIN, terminal nonce and timestamp in. The authentication counter is
+// incremented and HMAC(key, 'C' || counter || nonce || timestamp) is
+// returned with the counter through 61 24 and GET RESPONSE. The server only has to check
+// that the counter went up, no challenge is needed.
+void counter_authenticate()
+{
+    int i;
+    uint8_t pin_ok;
+
+    if (p3 != SIZE_PIN + SIZE_TERMINAL_NONCE + SIZE_TIMESTAMP) {
+        sw1 = 0x6c;
+        sw2 = SIZE_PIN + SIZE_TERMINAL_NONCE + SIZE_TIMESTAMP;
+        return;
+    }
+
+    if (state.pin_attempts == 0) {
+        sw1 = 0x69;
+        sw2 = 0x83;
+        return;
+    }
+
+    sendbyte(ins);
+    for (i = 0; i < SIZE_PIN; i++) {
+        pin_buffer[i] = recbyte();
+    }
+
+    // Nonce and timestamp keep arriving while the PIN is checked, they go
+    // after the tag and counter in the signed message
+    pin_ok = check_pin();
+
+    for (i = 1 + SIZE_AUTH_COUNTER; i < SIZE_COUNTER_MESSAGE; i++) {
+        challenge_buffer[i] = recbyte();
+    }
+
+    if (!pin_ok || !check_key()) {
+        return;
+    }
+
+    // Stored complemented, so that an erased EEPROM starts at 0
+    for (i = 0; i < SIZE_AUTH_COUNTER && auth_counter[i] == 0x00; i++);
+    if (i == SIZE_AUTH_COUNTER) {
+        sw1 = 0x69;
+        sw2 = 0x86;
+        return;
+    }
+    for (i = SIZE_AUTH_COUNTER - 1; auth_counter[i]-- == 0x00; i--);
+
+    // Nothing else is written from signature_buffer once the queue is empty,
+    // so the counter commit runs during the HMAC. It is done before the
+    // status word: a signature never goes out with a counter that a power
+    // loss could hand out again.
+    ee_sync();
+    ee_commit(EEPROM_AUTH_COUNTER_ADDR, auth_counter, SIZE_AUTH_COUNTER);
+
+    challenge_buffer[0] = COUNTER_TAG;
+    for (i = 0; i < SIZE_AUTH_COUNTER; i++) {
+        challenge_buffer[1 + i] = ~auth_counter[i];
+    }
+    hmac_message(SIZE_COUNTER_MESSAGE);
+    ee_sync();
+
+    // The response starts with the counter, without the tag
+    for (i = 0; i < SIZE_AUTH_COUNTER; i++) {
+        challenge_buffer[i] = ~auth_counter[i];
+    }
+
+    response_len = SIZE_AUTH_COUNTER + SIZE_HMAC_SIGNATURE;
+    response_prefix = SIZE_AUTH_COUNTER;
+    sw1 = 0x61;
+    sw2 = response_len;
+}
+
+// Epoch (4) and amount (4) signed by the server, then the HMAC of
+// 'V' || epoch || amount. A voucher with a newer epoch replaces the offline
+// budget, the receipt sequence goes on.
+void load_voucher()
+{
+    int i;
+    uint8_t mac[SIZE_HMAC_SIGNATURE];
+    uint8_t diff = 0;
+    uint32_t epoch;
+
+    if (!check_pin_verified()) {
+        return;
+    }
+
+    if (p3 != SIZE_VOUCHER) {
+        sw1 = 0x6c;
+        sw2 = SIZE_VOUCHER;
+        return;
+    }
+
+    if (!check_key()) {
+        return;
+    }
+
+    sendbyte(ins);
+    challenge_buffer[0] = VOUCHER_TAG;
+    for (i = 1; i < SIZE_VOUCHER_MESSAGE; i++) {
+        challenge_buffer[i] = recbyte();
+    }
+    for (i = 0; i < SIZE_HMAC_SIGNATURE; i++) {
+        mac[i] = recbyte();
+    }
+
+    // signature_buffer is also the key chunk buffer, maybe still being written
+    ee_sync();
+    hmac_message(SIZE_VOUCHER_MESSAGE);
+    for (i = 0; i < SIZE_HMAC_SIGNATURE; i++) {
+        diff |= mac[i] ^ signature_buffer[i];
+    }
+
+    epoch = get_u32(challenge_buffer + 1);
+    if (diff != 0 || epoch <= ~get_u32(offline.epoch)) {
+        sw1 = 0x69;
+        sw2 = 0x88;
+        return;
+    }
+
+    put_u32(offline.epoch, ~epoch);
+    put_u32(offline.remaining, ~get_u32(challenge_buffer + 5));
+    ee_commit(EEPROM_OFFLINE_ADDR, &offline, sizeof(offline));
+
+    sw1 = 0x90;
+}
+
+// PIN, amount, payee and timestamp in. The amount comes off the offline
+// budget and the signed receipt goes out through 61 3D and GET RESPONSE:
+// the 29-byte message the terminal uploads, then its HMAC.
+void offline_debit()
+{
+    int i;
+    uint8_t pin_ok;
+    uint32_t amount;
+    uint32_t remaining;
+    uint32_t sequence;
+
+    if (p3 != SIZE_DEBIT) {
+        sw1 = 0x6c;
+        sw2 = SIZE_DEBIT;
+        return;
+    }
+
+    if (state.pin_attempts == 0) {
+        sw1 = 0x69;
+        sw2 = 0x83;
+        return;
+    }
+
+    sendbyte(ins);
+    for (i = 0; i < SIZE_PIN; i++) {
+        pin_buffer[i] = recbyte();
+    }
+
+    // Amount, payee and timestamp go straight to their place in the receipt
+    pin_ok = check_pin();
+
+    for (i = 9; i < SIZE_RECEIPT; i++) {
+        challenge_buffer[i] = recbyte();
+    }
+
+    if (!pin_ok || !check_key()) {
+        return;
+    }
+
+    amount = get_u32(challenge_buffer + 9);
+    remaining = ~get_u32(offline.remaining);
+    sequence = ~get_u32(offline.sequence);
+    if (amount == 0) {
         sw1 = 0x6a;
+        sw2 = 0x80;
+        return;
+    }
+    if (amount > remaining) {
+        sw1 = 0x69;
+        sw2 = 0x87;
+        return;
+    }
+    if (sequence == 0xFFFFFFFF) {
+        sw1 = 0x69;
+        sw2 = 0x86;
+        return;
+    }
+
+    // Committed before the receipt goes out, like the authentication counter
+    sequence++;
+    put_u32(offline.remaining, ~(remaining - amount));
+    put_u32(offline.sequence, ~sequence);
+    ee_commit(EEPROM_OFFLINE_ADDR, &offline, sizeof(offline));
+
+    challenge_buffer[0] = RECEIPT_TAG;
+    put_u32(challenge_buffer + 1, ~get_u32(offline.epoch));
+    put_u32(challenge_buffer + 5, sequence);
+    hmac_message(SIZE_RECEIPT);
+    ee_sync();
+
+    response_len = SIZE_RECEIPT + SIZE_HMAC_SIGNATURE;
+    response_prefix = SIZE_RECEIPT;
+    sw1 = 0x61;
+    sw2 = response_len;
+}
+
+// Epoch, amount left and last receipt number, 32-bit big-endian
+void get_offline_info()
+{
+    int i;
+    uint8_t info[SIZE_OFFLINE_INFO];
+
+    if (p3 != SIZE_OFFLINE_INFO) {
+        sw1 = 0x6c;
+        sw2 = SIZE_OFFLINE_INFO;
+        return;
+    }
+
+    put_u32(info, ~get_u32(offline.epoch));
+    put_u32(info + 4, ~get_u32(offline.remaining));
+    put_u32(info + 8, ~get_u32(offline.sequence));
+
+    sendbyte(ins);
+    for (i = 0; i < SIZE_OFFLINE_INFO; i++) {
+        sendbyte(info[i]);
+    }
+
+    sw1 = 0x90;
+}
+
+// History entry and its server HMAC in (requires PIN verification, the
+// key is needed). Entries older than the newest one stored are refused, so
+// the ring cannot be rolled back.
+void append_history()
+{
+    int i;
+    uint8_t mac[SIZE_HMAC_SIGNATURE];
+    uint8_t diff = 0;
+    uint32_t index;
+
+    if (!check_pin_verified()) {
+        return;
+    }
+
+    if (p3 != SIZE_HISTORY_APPEND) {
+        sw1 = 0x6c;
+        sw2 = SIZE_HISTORY_APPEND;
+        return;
+    }
+
+    if (!check_key()) {
+        return;
+    }
+
+    sendbyte(ins);
+    challenge_buffer[0] = HISTORY_TAG;
+    for (i = 1; i <= SIZE_HISTORY_ENTRY; i++) {
+        challenge_buffer[i] = recbyte();
+    }
+    for (i = 0; i < SIZE_HMAC_SIGNATURE; i++) {
+        mac[i] = recbyte();
+    }
+
+    // signature_buffer is also the key chunk buffer, maybe still being written
+    ee_sync();
+    hmac_message(1 + SIZE_HISTORY_ENTRY);
+    for (i = 0; i < SIZE_HMAC_SIGNATURE; i++) {
+        diff |= mac[i] ^ signature_buffer[i];
+    }
+
+    index = get_u32(challenge_buffer + 1);
+    if (diff != 0 || index <= history_last) {
+        sw1 = 0x69;
         sw2 = 0x88;
         return;
     }
 
-    for (i = 0; i < SIZE_SECRET_KEY; i++) {
-        secret_key_buffer[i] = eeprom_read_byte((uint8_t*)(EEPROM_PRIVATE_KEY_DATA_ADDR + i));
+    // One entry per commit: a power loss leaves the old entry or the new one
+    put_u32(challenge_buffer + 1, ~index);
+    ee_commit(history_slot_addr(index), challenge_buffer + 1, SIZE_HISTORY_ENTRY);
+    history_last = index;
+
+    sw1 = 0x90;
+}
+
+// Entries newest first, skipping P1 of them, P3 / SIZE_HISTORY_ENTRY at most
+// HISTORY_PAGE_ENTRIES per command. Slots past the oldest entry come out as
+// zeros (index 0).
+void read_history()
+{
+    int i;
+    uint8_t n;
+    uint8_t k;
+    uint8_t entry[SIZE_HISTORY_ENTRY];
+    uint32_t index;
+
+    if (!check_pin_verified()) {
+        return;
+    }
+
+    if (p1 >= HISTORY_ENTRIES) {
+        sw1 = 0x6b;
+        return;
+    }
+
+    n = HISTORY_ENTRIES - p1;
+    if (n > HISTORY_PAGE_ENTRIES) {
+        n = HISTORY_PAGE_ENTRIES;
+    }
+    if (p3 == 0 || p3 % SIZE_HISTORY_ENTRY != 0 || p3 > n * SIZE_HISTORY_ENTRY) {
+        sw1 = 0x6c;
+        sw2 = n * SIZE_HISTORY_ENTRY;
+        return;
+    }
+    n = p3 / SIZE_HISTORY_ENTRY;
+
+    sendbyte(ins);
+    for (k = 0; k < n; k++) {
+        index = history_last - p1 - k;
+        memset(entry, 0, sizeof(entry));
+        if (history_last >= (uint32_t)p1 + k + 1) {
+            ee_read(entry, history_slot_addr(index), sizeof(entry));
+            // The slot may still hold an older entry if indexes were skipped
+            if (~get_u32(entry) != index) {
+                memset(entry, 0, sizeof(entry));
+            } else {
+                put_u32(entry, index);
+            }
+        }
+        for (i = 0; i < SIZE_HISTORY_ENTRY; i++) {
+            sendbyte(entry[i]);
+        }
     }
 
-    hmac_sha256(secret_key_buffer, SIZE_SECRET_KEY, challenge_buffer, SIZE_CHALLENGE, signature_buffer);
+    sw1 = 0x90;
+}
+
+// SIGN_CHALLENGE for P1 challenges in one command, with the key loaded
+// once. Each challenge is signed while the next one is arriving, the MACs
+// come out concatenated through 61 xx and GET RESPONSE.
+void sign_batch()
+{
+    int i;
+    uint8_t k;
+    uint32_t start;
 
-    sendbytet0(ins);
+    if (!check_pin_verified()) {
+        return;
+    }
+
+    if (p1 == 0 || p1 > MAX_BATCH) {
+        sw1 = 0x6b;
+        return;
+    }
+
+    if (p3 != p1 * SIZE_CHALLENGE) {
+        sw1 = 0x6c;
+        sw2 = p1 * SIZE_CHALLENGE;
+        return;
+    }
+
+    if (!check_key()) {
+        return;
+    }
+
+    sendbyte(ins);
+    start = stats_ticks();
+    for (k = 0; k < p1; k++) {
+        for (i = 0; i < SIZE_CHALLENGE; i++) {
+            challenge_buffer[i] = recbyte();
+        }
+        hmac_sha256_from_midstate_32(&key_midstate, challenge_buffer, batch_buffer + k * SIZE_HMAC_SIGNATURE);
+    }
+    stats.hmac_ticks = (stats_ticks() - start) / p1;
+
+    response_len = p1 * SIZE_HMAC_SIGNATURE;
+    response_prefix = 0;
+    response_data = batch_buffer;
+    sw1 = 0x61;
+    sw2 = response_len;
+}
+
+static const uint8_t boot_mark_clear = 0xFF;
+// Update record for the boot section, written in address order: the mark
+// comes last
+static uint8_t boot_record[3];
+
+// P1 is the page number in the staging area, the page (BOOT_PAGE_SIZE
+// bytes) is the command data. A pending install is cancelled first, its
+// image is about to change.
+void load_firmware()
+{
+    int i;
+
+    if (p1 >= BOOT_MAX_PAGES) {
+        sw1 = 0x6b;
+        return;
+    }
+
+    if (p3 != BOOT_PAGE_SIZE) {
+        sw1 = 0x6c;
+        sw2 = BOOT_PAGE_SIZE;
+        return;
+    }
+
+    ee_write(BOOT_EE_MARK_ADDR, &boot_mark_clear, 1);
+
+    sendbyte(ins);
+    for (i = 0; i < BOOT_PAGE_SIZE; i++) {
+        batch_buffer[i] = recbyte();
+    }
+
+    // No EEPROM write while the boot section programs flash
+    ee_sync();
+    flash_write_staging(BOOT_STAGING_ADDR + (uint16_t)p1 * BOOT_PAGE_SIZE, batch_buffer);
+
+    sw1 = 0x90;
+}
+
+// Version (1) and page count (1) of the staged image, then the HMAC of
+// 'F' || version || pages || SHA-256 of the pages, under the firmware key.
+// The key midstate is read here, the PIN is not needed. The image must be
+// newer than this firmware.
+void install_firmware()
+{
+    int i;
+    uint8_t mac[SIZE_HMAC_SIGNATURE];
+    uint8_t diff = 0;
+    uint8_t mark;
+    uint8_t version;
+    uint8_t pages;
+    uint16_t addr;
+    uint16_t size;
+    SHA256_CTX ctx;
+    HMAC_SHA256_MIDSTATE midstate;
+
+    if (p3 != SIZE_INSTALL) {
+        sw1 = 0x6c;
+        sw2 = SIZE_INSTALL;
+        return;
+    }
+
+    ee_read(&mark, EEPROM_FIRMWARE_KEY_MARK_ADDR, 1);
+    if (mark != firmware_key_mark) {
+        sw1 = 0x6a;
+        sw2 = 0x88;
+        return;
+    }
+
+    sendbyte(ins);
+    version = recbyte();
+    pages = recbyte();
     for (i = 0; i < SIZE_HMAC_SIGNATURE; i++) {
-        sendbytet0(signature_buffer[i]);
+        mac[i] = recbyte();
     }
 
+    if (pages == 0 || pages > BOOT_MAX_PAGES) {
+        sw1 = 0x6a;
+        sw2 = 0x80;
+        return;
+    }
+
+    size = (uint16_t)pages * BOOT_PAGE_SIZE;
+    sha256_init(&ctx);
+    for (addr = 0; addr < size; addr += SIZE_CHALLENGE) {
+        for (i = 0; i < SIZE_CHALLENGE; i++) {
+            challenge_buffer[i] = flash_read_staging(BOOT_STAGING_ADDR + addr + i);
+        }
+        sha256_update(&ctx, challenge_buffer, SIZE_CHALLENGE);
+#ifndef T1_PROTOCOL
+        if ((addr + SIZE_CHALLENGE) % (FIRMWARE_NULL_PAGES * BOOT_PAGE_SIZE) == 0) {
+            sendbytet0(0x60);
+        }
+#endif
+    }
+
+    batch_buffer[0] = FIRMWARE_TAG;
+    batch_buffer[1] = version;
+    batch_buffer[2] = pages;
+    sha256_final(&ctx, batch_buffer + 3);
+
+    // signature_buffer is also the key chunk buffer, maybe still being written
+    ee_read(&midstate, EEPROM_FIRMWARE_MIDSTATE_ADDR, sizeof(midstate));
+    hmac_sha256_from_midstate(&midstate, batch_buffer, SIZE_FIRMWARE_MESSAGE, signature_buffer);
+    for (i = 0; i < SIZE_HMAC_SIGNATURE; i++) {
+        diff |= mac[i] ^ signature_buffer[i];
+    }
+
+    if (diff != 0 || version <= CARD_VERSION) {
+        sw1 = 0x69;
+        sw2 = 0x88;
+        return;
+    }
+
+    boot_record[0] = 0;
+    boot_record[1] = pages;
+    boot_record[2] = BOOT_PENDING;
+    ee_write(BOOT_EE_NEXT_ADDR, boot_record, sizeof(boot_record));
+    ee_sync();
+
+    sw1 = 0x90;
+}
+
+void get_response()
+{
+    int i;
+
+    if (response_len == 0) {
+        sw1 = 0x69;
+        sw2 = 0x85;
+        return;
+    }
+
+    if (p3 != response_len) {
+        sw1 = 0x6c;
+        sw2 = response_len;
+        return;
+    }
+
+    sendbyte(ins);
+    for (i = 0; i < response_prefix; i++) {
+        sendbyte(challenge_buffer[i]);
+    }
+    for (i = response_prefix; i < response_len; i++) {
+        sendbyte(response_data[i - response_prefix]);
+    }
+    response_len = 0;
+
     sw1 = 0x90;
 }
 
+// PPS exchange (ISO 7816-3), only valid as the first exchange after the ATR.
+// PPSS 0xFF has already been read. Fi=372 with Di 1, 2 or 4 is accepted,
+// any other request is answered without PPS1 and keeps the default speed.
+void pps()
+{
+    uint8_t pps0;
+    uint8_t pps1 = 0x11;
+    uint8_t pck;
+    uint8_t di_index;
+
+    pps0 = recbytet0();
+    pck = 0xFF ^ pps0;
+    if (pps0 & 0x10) {
+        pps1 = recbytet0();
+        pck ^= pps1;
+    }
+    if (pps0 & 0x20) {
+        pck ^= recbytet0();
+    }
+    if (pps0 & 0x40) {
+        pck ^= recbytet0();
+    }
+    pck ^= recbytet0();
+
+    // Bad checksum or protocol not offered in the ATR: no answer, the reader resets the card
+    if (pck != 0 || (pps0 & 0x0F) != ATR_PROTOCOL) {
+        return;
+    }
+
+    di_index = pps1 & 0x0F;
+    if ((pps1 >> 4) > 1 || di_index < 1 || di_index > MAX_DI_INDEX) {
+        sendbytet0(0xFF);
+        sendbytet0(ATR_PROTOCOL);
+        sendbytet0(0xFF ^ ATR_PROTOCOL);
+        return;
+    }
+
+    sendbytet0(0xFF);
+    sendbytet0(0x10 | ATR_PROTOCOL);
+    sendbytet0(pps1);
+    sendbytet0(0xFF ^ 0x10 ^ ATR_PROTOCOL ^ pps1);
+
+    // New speed starts with the next character
+    set_etu(1 << (di_index - 1));
+}
+
 int main(void)
 {
+    uint8_t b;
+
     ACSR = 0x80;
     PRR = 0x87;
     PORTB = 0xff;
@@ -515,19 +1561,53 @@ int main(void)
     DDRD = 0x00;
     PORTD = 0xff;
     ASSR = (1 << EXCLK) + (1 << AS2);
+    TCCR1A = 0;
+    TCCR1B = STATS_TIMER_CS;
+    TIMSK1 = 1 << TOIE1;
+    io_init();
+    load_state();
 
     atr();
     sw2 = 0;
 
+    // PPSS can only be the first character after the ATR, anything else
+    // starts the first command
+    b = recbytet0();
+    if (b == 0xFF) {
+        pps();
+    } else {
+        unrecbytet0(b);
+    }
+
     for (;;) {
-        cla = recbytet0();
-        ins = recbytet0();
-        p1 = recbytet0();
-        p2 = recbytet0();
-        p3 = recbytet0();
+        cla = recbyte();
+        ins = recbyte();
+        p1 = recbyte();
+        p2 = recbyte();
+        p3 = recbyte();
         sw2 = 0;
 
+        if (ins != 0xC0) {
+            response_len = 0;
+            response_data = signature_buffer;
+        }
+
+        if (ins < STATS_INS_SLOTS) {
+            stats.ins_count[ins]++;
+        } else if (ins == 0xC0) {
+            stats.ins_count[0]++;
+        }
+
         switch (cla) {
+        case 0x00:
+            switch (ins) {
+            case 0xC0:
+                get_response();
+                break;
+            default:
+                sw1 = 0x6d;
+            }
+            break;
         case 0x80:
             switch (ins) {
             case 0x01:
@@ -566,6 +1646,48 @@ int main(void)
             case 0x0E:
                 is_pin_defined();
                 break;
+            case 0x0F:
+                authenticate();
+                break;
+            case 0x10:
+                get_card_info();
+                break;
+            case 0x11:
+                get_stats();
+                break;
+            case 0x12:
+                counter_authenticate();
+                break;
+            case 0x13:
+                load_voucher();
+                break;
+            case 0x14:
+                offline_debit();
+                break;
+            case 0x15:
+                get_offline_info();
+                break;
+            case 0x16:
+                append_history();
+                break;
+            case 0x17:
+                read_history();
+                break;
+            case 0x18:
+                sign_batch();
+                break;
+            case 0x19:
+                load_firmware();
+                break;
+            case 0x1A:
+                install_firmware();
+                break;
+            case 0x1B:
+                write_firmware_key();
+                break;
+            case 0xC0:
+                get_response();
+                break;
             default:
                 sw1 = 0x6d;
             }
@@ -573,8 +1695,11 @@ int main(void)
         default:
             sw1 = 0x6e;
         }
-        sendbytet0(sw1);
-        sendbytet0(sw2);
+
+        if (sw1 != 0x90 && sw1 != 0x61) {
+            stats.error_sw++;
+        }
+        send_status();
     }
     return 0;
 }
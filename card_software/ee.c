@@ -0,0 +1,195 @@
+// EEPROM write engine. Writes are queued as spans of RAM and written by the
+// EE_READY interrupt in the background, so a handler can send its status
+// word while the EEPROM is still being programmed (about 3.4 ms per byte).
+//
+// - Only bytes that differ from the EEPROM are written, and a byte whose
+//   change only clears bits (or only sets them, to 0xFF) uses the write-only
+//   (erase-only) mode, about 1.8 ms instead of 3.4 ms. The ATmega328p has no
+//   EEPROM page buffer, so bytes are simply written in address order.
+// - The source of a span is read when its bytes are written: it must not
+//   change before ee_sync().
+// - ee_commit() replaces a small region atomically: the new bytes are written
+//   to the journal first, then the journal is marked pending, then the region
+//   is written and the mark is cleared. A power loss at any point leaves
+//   either the old or the new contents once ee_init() has replayed a pending
+//   journal at reset.
+// - Spans are written in the order they were queued.
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <string.h>
+#include "ee.h"
+
+// Journal layout: mark, region address (2), region length, region bytes
+#define JOURNAL_MARK_ADDR EE_JOURNAL_ADDR
+#define JOURNAL_HEADER_ADDR (EE_JOURNAL_ADDR + 1)
+#define JOURNAL_HEADER 3
+#define JOURNAL_PENDING 0xA5
+
+#define EE_QUEUE_SIZE 8     // power of 2
+
+typedef struct {
+    uint16_t addr;
+    const uint8_t *src;
+    uint8_t len;
+} EE_SPAN;
+
+static volatile EE_SPAN queue[EE_QUEUE_SIZE];
+static volatile uint8_t queue_head = 0;    // written by ee_write()
+static volatile uint8_t queue_tail = 0;    // written by the interrupt
+
+// Copy of the committed region, prefixed with its journal header
+static uint8_t journal[JOURNAL_HEADER + EE_JOURNAL_MAX];
+static const uint8_t mark_pending = JOURNAL_PENDING;
+static const uint8_t mark_clear = 0xFF;
+
+// Timer1 ticks since reset, with the overflows counted by card.c
+extern uint32_t stats_ticks(void);
+
+// stats_ticks() when the queue last went from empty to busy
+static uint32_t busy_start;
+volatile uint32_t ee_last_write_ticks = 0;
+
+// Checks one byte per interrupt, so that the I/O interrupts wait at most
+// a few tens of cycles behind it
+ISR(EE_READY_vect)
+{
+    volatile EE_SPAN *span;
+    uint8_t old;
+    uint8_t b;
+    uint8_t mode;
+
+    if (queue_tail == queue_head) {
+        EECR &= ~(1 << EERIE);
+        ee_last_write_ticks = stats_ticks() - busy_start;
+        return;
+    }
+
+    span = &queue[queue_tail];
+    EEAR = span->addr;
+    EECR |= 1 << EERE;
+    old = EEDR;
+    b = *span->src;
+
+    span->addr++;
+    span->src++;
+    if (--span->len == 0) {
+        queue_tail = (queue_tail + 1) & (EE_QUEUE_SIZE - 1);
+    }
+
+    if (b == old) {
+        return;
+    }
+
+    if (b == 0xFF) {
+        mode = 1 << EEPM0;      // erase only
+    } else if ((b & ~old) == 0) {
+        mode = 1 << EEPM1;      // write only, clears bits
+    } else {
+        mode = 0;               // erase and write
+    }
+
+    EEDR = b;
+    EECR = mode | (1 << EEMPE) | (1 << EERIE);
+    EECR |= 1 << EEPE;
+}
+
+// Queues len bytes from src to EEPROM address addr
+void ee_write(uint16_t addr, const void *src, uint8_t len)
+{
+    uint8_t next;
+
+    if (len == 0) {
+        return;
+    }
+
+    next = (queue_head + 1) & (EE_QUEUE_SIZE - 1);
+    do; while (next == queue_tail);     // queue full
+
+    queue[queue_head].addr = addr;
+    queue[queue_head].src = src;
+    queue[queue_head].len = len;
+
+    cli();
+    if (!(EECR & (1 << EERIE))) {
+        busy_start = stats_ticks();
+    }
+    queue_head = next;
+    EECR |= 1 << EERIE;
+    sei();
+}
+
+// Returns 1 if the EEPROM already holds the len bytes of src at addr
+static uint8_t ee_equal(uint16_t addr, const uint8_t *src, uint8_t len)
+{
+    while (len--) {
+        if (eeprom_read_byte((const uint8_t *)(uintptr_t)addr++) != *src++) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Queues an atomic update of len bytes at addr (len <= EE_JOURNAL_MAX)
+void ee_commit(uint16_t addr, const void *src, uint8_t len)
+{
+    // Nothing to do if the region is unchanged since the last commit
+    if (journal[0] == (uint8_t)addr && journal[1] == (uint8_t)(addr >> 8) &&
+        journal[2] == len && memcmp(journal + JOURNAL_HEADER, src, len) == 0) {
+        return;
+    }
+
+    // The journal copy of the previous commit may still be in use
+    ee_sync();
+
+    // Nor if the EEPROM holds it already: first commit after a reset, or
+    // another region committed since. The journal is not even marked.
+    if (ee_equal(addr, src, len)) {
+        return;
+    }
+
+    journal[0] = (uint8_t)addr;
+    journal[1] = (uint8_t)(addr >> 8);
+    journal[2] = len;
+    memcpy(journal + JOURNAL_HEADER, src, len);
+
+    ee_write(JOURNAL_HEADER_ADDR, journal, JOURNAL_HEADER + len);
+    ee_write(JOURNAL_MARK_ADDR, &mark_pending, 1);
+    ee_write(addr, journal + JOURNAL_HEADER, len);
+    ee_write(JOURNAL_MARK_ADDR, &mark_clear, 1);
+}
+
+// Waits until every queued byte is written
+void ee_sync(void)
+{
+    do; while (EECR & ((1 << EERIE) | (1 << EEPE)));
+}
+
+void ee_read(void *dst, uint16_t addr, uint8_t len)
+{
+    ee_sync();
+    eeprom_read_block(dst, (const void *)(uintptr_t)addr, len);
+}
+
+// Finishes a commit interrupted by a power loss, before anything reads
+// the EEPROM
+void ee_init(void)
+{
+    uint16_t addr;
+    uint8_t len;
+
+    if (eeprom_read_byte((const uint8_t *)JOURNAL_MARK_ADDR) != JOURNAL_PENDING) {
+        return;
+    }
+
+    eeprom_read_block(journal, (const void *)JOURNAL_HEADER_ADDR, JOURNAL_HEADER);
+    addr = journal[0] | ((uint16_t)journal[1] << 8);
+    len = journal[2];
+
+    if (len <= EE_JOURNAL_MAX) {
+        eeprom_read_block(journal + JOURNAL_HEADER, (const void *)(JOURNAL_HEADER_ADDR + JOURNAL_HEADER), len);
+        eeprom_update_block(journal + JOURNAL_HEADER, (void *)(uintptr_t)addr, len);
+    }
+    eeprom_update_byte((uint8_t *)JOURNAL_MARK_ADDR, 0xFF);
+}
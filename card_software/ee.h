@@ -0,0 +1,20 @@
+#ifndef EE_H
+#define EE_H
+
+#include <stdint.h>
+
+// Journal used by ee_commit(), after the card ID midstates (see card.c)
+#define EE_JOURNAL_ADDR 197
+#define EE_JOURNAL_MAX 40
+#define EE_JOURNAL_END (EE_JOURNAL_ADDR + 4 + EE_JOURNAL_MAX)
+
+// Duration of the last batch of queued writes, in Timer1 ticks (see card.c)
+extern volatile uint32_t ee_last_write_ticks;
+
+void ee_init(void);
+void ee_write(uint16_t addr, const void *src, uint8_t len);
+void ee_commit(uint16_t addr, const void *src, uint8_t len);
+void ee_sync(void);
+void ee_read(void *dst, uint16_t addr, uint8_t len);
+
+#endif
@@ -0,0 +1,21 @@
+// Staging area access from the application (flash.h). The simulator has
+// its own in sim/host_io.c.
+
+#include <avr/pgmspace.h>
+#include "boot.h"
+#include "flash.h"
+
+typedef void (*BOOT_WRITE_PAGE)(uint16_t addr, const uint8_t *data);
+
+// Writes one page of BOOT_PAGE_SIZE bytes at a page-aligned staging
+// address. Interrupts are off until the page is programmed.
+void flash_write_staging(uint16_t addr, const uint8_t *data)
+{
+    // Function pointers hold word addresses
+    ((BOOT_WRITE_PAGE)(BOOT_WRITE_PAGE_ADDR / 2))(addr, data);
+}
+
+uint8_t flash_read_staging(uint16_t addr)
+{
+    return pgm_read_byte(addr);
+}
@@ -0,0 +1,11 @@
+#ifndef FLASH_H
+#define FLASH_H
+
+#include <stdint.h>
+
+// Application side of the staging area (boot.h). The RWW section cannot
+// program itself: pages are written by the boot section.
+void flash_write_staging(uint16_t addr, const uint8_t *data);
+uint8_t flash_read_staging(uint16_t addr);
+
+#endif
@@ -4,43 +4,135 @@
 
 #define SHA256_INTERNAL_BLOCK_SIZE 64
 
-void hmac_sha256(const uint8_t *key, uint8_t key_len,
-                 const uint8_t *msg, uint8_t msg_len,
-                 uint8_t *out)
+// Restart a context from a saved chaining value, as if one block was consumed
+static void sha256_resume(SHA256_CTX *ctx, const uint32_t state[8])
+{
+    memcpy(ctx->state, state, sizeof(ctx->state));
+    ctx->datalen = 0;
+    ctx->bitlen = SHA256_INTERNAL_BLOCK_SIZE * 8;
+}
+
+void hmac_sha256_midstate(const uint8_t *key, uint8_t key_len,
+                          HMAC_SHA256_MIDSTATE *midstate)
 {
     uint8_t i;
-    uint8_t key_block[SHA256_INTERNAL_BLOCK_SIZE];
-    uint8_t o_key_pad[SHA256_INTERNAL_BLOCK_SIZE];
-    uint8_t i_key_pad[SHA256_INTERNAL_BLOCK_SIZE];
     SHA256_CTX ctx;
-    uint8_t inner_hash[HMAC_SHA256_DIGEST_SIZE];
+    // The context block buffer is free while calling sha256_transform()
+    // directly, so the pads are built there in place
+    uint8_t *pad = ctx.data;
 
     // Prepare key block
-    memset(key_block, 0, SHA256_INTERNAL_BLOCK_SIZE);
     if (key_len <= SHA256_INTERNAL_BLOCK_SIZE) {
-        memcpy(key_block, key, key_len);
+        memset(pad, 0, SHA256_INTERNAL_BLOCK_SIZE);
+        memcpy(pad, key, key_len);
     } else {
         // Hash the key if it's longer than block size
         sha256_init(&ctx);
         sha256_update(&ctx, key, key_len);
-        sha256_final(&ctx, key_block);
+        sha256_final(&ctx, pad);
+        memset(pad + HMAC_SHA256_DIGEST_SIZE, 0, SHA256_INTERNAL_BLOCK_SIZE - HMAC_SHA256_DIGEST_SIZE);
     }
 
-    // Create padded keys
+    // Inner midstate: H state after (K ⊕ ipad)
     for (i = 0; i < SHA256_INTERNAL_BLOCK_SIZE; i++) {
-        o_key_pad[i] = key_block[i] ^ 0x5c;
-        i_key_pad[i] = key_block[i] ^ 0x36;
+        pad[i] ^= 0x36;
     }
+    sha256_init(&ctx);
+    sha256_transform(&ctx, pad);
+    memcpy(midstate->inner, ctx.state, sizeof(midstate->inner));
 
-    // Inner hash: H((K ⊕ ipad) || message)
+    // Outer midstate: H state after (K ⊕ opad), turning ipad into opad
+    for (i = 0; i < SHA256_INTERNAL_BLOCK_SIZE; i++) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
     sha256_init(&ctx);
-    sha256_update(&ctx, i_key_pad, SHA256_INTERNAL_BLOCK_SIZE);
+    sha256_transform(&ctx, pad);
+    memcpy(midstate->outer, ctx.state, sizeof(midstate->outer));
+}
+
+void hmac_sha256_from_midstate(const HMAC_SHA256_MIDSTATE *midstate,
+                               const uint8_t *msg, uint8_t msg_len,
+                               uint8_t *out)
+{
+    SHA256_CTX ctx;
+
+    // Inner hash: H((K ⊕ ipad) || message), written straight into the
+    // block buffer where the outer hash expects its input
+    sha256_resume(&ctx, midstate->inner);
     sha256_update(&ctx, msg, msg_len);
-    sha256_final(&ctx, inner_hash);
+    sha256_final(&ctx, ctx.data);
 
     // Outer hash: H((K ⊕ opad) || inner_hash)
-    sha256_init(&ctx);
-    sha256_update(&ctx, o_key_pad, SHA256_INTERNAL_BLOCK_SIZE);
-    sha256_update(&ctx, inner_hash, HMAC_SHA256_DIGEST_SIZE);
+    sha256_resume(&ctx, midstate->outer);
+    ctx.datalen = HMAC_SHA256_DIGEST_SIZE;
     sha256_final(&ctx, out);
 }
+
+// Last block of a hash whose first block was the 64-byte key pad and whose
+// len message bytes (len <= 55, one block) are already in
+// ctx->data: the padding and the bit length of pad || message are written
+// directly, without the sha256_update()/sha256_final() bookkeeping.
+static inline __attribute__((always_inline))
+void sha256_short_final(SHA256_CTX *ctx, const uint32_t state[8], uint8_t len)
+{
+    const uint16_t bitlen = (SHA256_INTERNAL_BLOCK_SIZE + len) * 8;
+
+    memcpy(ctx->state, state, sizeof(ctx->state));
+    ctx->data[len] = 0x80;
+    memset(ctx->data + len + 1, 0, SHA256_INTERNAL_BLOCK_SIZE - 2 - (len + 1));
+    ctx->data[62] = bitlen >> 8;
+    ctx->data[63] = bitlen;
+    sha256_transform(ctx, ctx->data);
+}
+
+// Big-endian digest of ctx->state
+static void sha256_digest(const SHA256_CTX *ctx, uint8_t *out)
+{
+    uint8_t i;
+
+    for (i = 0; i < 8; i++) {
+        out[4 * i] = ctx->state[i] >> 24;
+        out[4 * i + 1] = ctx->state[i] >> 16;
+        out[4 * i + 2] = ctx->state[i] >> 8;
+        out[4 * i + 3] = ctx->state[i];
+    }
+}
+
+// Two compressions, with msg_len a constant in each caller below
+static inline __attribute__((always_inline))
+void hmac_sha256_short(const HMAC_SHA256_MIDSTATE *midstate,
+                       const uint8_t *msg, uint8_t msg_len,
+                       uint8_t *out)
+{
+    SHA256_CTX ctx;
+
+    // Inner hash, left in the block buffer as the outer message
+    memcpy(ctx.data, msg, msg_len);
+    sha256_short_final(&ctx, midstate->inner, msg_len);
+    sha256_digest(&ctx, ctx.data);
+
+    sha256_short_final(&ctx, midstate->outer, HMAC_SHA256_DIGEST_SIZE);
+    sha256_digest(&ctx, out);
+}
+
+void hmac_sha256_from_midstate_32(const HMAC_SHA256_MIDSTATE *midstate,
+                                  const uint8_t *msg, uint8_t *out)
+{
+    hmac_sha256_short(midstate, msg, 32, out);
+}
+
+void hmac_sha256_from_midstate_4(const HMAC_SHA256_MIDSTATE *midstate,
+                                 const uint8_t *msg, uint8_t *out)
+{
+    hmac_sha256_short(midstate, msg, 4, out);
+}
+
+void hmac_sha256(const uint8_t *key, uint8_t key_len,
+                 const uint8_t *msg, uint8_t msg_len,
+                 uint8_t *out)
+{
+    HMAC_SHA256_MIDSTATE midstate;
+
+    hmac_sha256_midstate(key, key_len, &midstate);
+    hmac_sha256_from_midstate(&midstate, msg, msg_len, out);
+}
@@ -5,8 +5,31 @@
 
 #define HMAC_SHA256_DIGEST_SIZE 32
 
+// SHA-256 chaining values after compressing the (K ^ ipad) and (K ^ opad)
+// blocks. They only depend on the key, so they can be computed once and
+// stored, leaving two compressions per MAC for short messages.
+typedef struct {
+    uint32_t inner[8];
+    uint32_t outer[8];
+} HMAC_SHA256_MIDSTATE;
+
 void hmac_sha256(const uint8_t *key, uint8_t key_len,
                  const uint8_t *msg, uint8_t msg_len,
                  uint8_t *out);
 
+void hmac_sha256_midstate(const uint8_t *key, uint8_t key_len,
+                          HMAC_SHA256_MIDSTATE *midstate);
+
+void hmac_sha256_from_midstate(const HMAC_SHA256_MIDSTATE *midstate,
+                               const uint8_t *msg, uint8_t msg_len,
+                               uint8_t *out);
+
+// Same results as hmac_sha256_from_midstate() for the two message sizes the
+// card uses (challenge and PIN/PUK), with the final blocks built directly
+void hmac_sha256_from_midstate_32(const HMAC_SHA256_MIDSTATE *midstate,
+                                  const uint8_t *msg, uint8_t *out);
+
+void hmac_sha256_from_midstate_4(const HMAC_SHA256_MIDSTATE *midstate,
+                                 const uint8_t *msg, uint8_t *out);
+
 #endif
@@ -4,6 +4,36 @@
 // prototype des fonctions définies dans ce fichier :
 // uint8_t recbytet0();		// reçoit un octet t=0
 // void sendbytet0(uint8_t);	// émet un octet t=0
+// void set_etu(uint8_t);	// change la durée d'un etu après un PPS
+// void unrecbytet0(uint8_t);	// remet un octet reçu, rendu par le prochain recbytet0
+// void waitetu(uint8_t);	// attend n etu (temps de garde entre blocs T=1)
+// void io_init();		// démarre TCNT2 et la réception sous interruption
+//
+// io_rx_parity_errors et io_tx_repeats comptent les erreurs de parité en
+// réception et les réémissions demandées par le lecteur (GET_STATS).
+//
+// La réception est faite sous interruption : le front du bit start déclenche
+// l'interruption de changement d'état de la broche (PCINT4), puis chaque bit
+// est lu par l'interruption de comparaison de TCNT2 (OCR2A), par vote sur trois
+// lectures à 1/4, 1/2 et 3/4 du bit comme en réception bloquante.
+// Les octets reçus sont rangés dans un tampon circulaire, recbytet0 ne fait que
+// les retirer : un traitement peut donc commencer pendant que la suite de la
+// commande arrive. Le tampon contient les 255 octets de données d'une commande,
+// et un octet qui n'y trouverait pas de place est refusé comme une erreur de
+// parité (réémis par le lecteur en T=0 ; compté et rendu comme un 0 en T=1,
+// où le bloc est redemandé) plutôt que perdu. L'émission reste en attente active, la réception étant
+// coupée pendant ce temps (liaison half-duplex). Les interruptions sont masquées
+// pendant l'émission d'un octet pour ne pas décaler les bits (l'écriture EEPROM
+// sous interruption reprend entre deux octets).
+//
+// Temps de garde : la carte n'émet pas avant 16 etu après le front du bit start
+// du dernier octet reçu (ISO 7816-3, caractères de sens opposés). Après la
+// parité, l'interruption de comparaison continue de compter jusqu'à ce point
+// et efface rx_guard, que sendbytet0 attend avant d'émettre (T=0 comme T=1).
+//
+// Compilé avec T1_PROTOCOL, la réception ne demande pas de réémission en cas
+// d'erreur de parité (interdit en T=1) mais positionne io_parity_error ; l'octet
+// est rangé quand même, pour que le nombre d'octets du bloc reste juste.
 //
 // Les entrées-sorties sont synchronisées sur l'horloge externe.
 // Ce programme utilise le compteur asynchrone TCNT2 pour fonctionner y compris lorsque 
@@ -16,6 +46,7 @@
 //
 #include <inttypes.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
 
 // un bit tous les 372 clocks -- 1 etu = 372 clock de l'entrée clock externe
 // Un etu (elementary time unit) fait théoriquement 372 coups d'horloge externe, soit
@@ -24,10 +55,197 @@
 // 8 * 46 =  368	cette valeur semble convenir sur tous les lecteurs
 // La fréquence standard des lecteurs est de 3.58 MHz = 104uS pour 372 cycles = 9600 bauds
 // la plupart des lecteurs ont une fréquence plus élevée, de 3,7 à 4,7 MHz.
+// Après un PPS avec Di=2 ou Di=4, un etu ne fait plus que 186 ou 93 clocks, les
+// durées ci-dessous sont alors recalculées par set_etu().
 
 // broche I/O sur le port b
 #define IOPIN	4
 
+// durées en itérations de TCNT2, valeurs pour Di=1 (9600 bauds à 3.58 MHz)
+static uint8_t etu=46;		// 1 etu
+static uint8_t etu2=93;		// 2 etu
+static uint8_t first=40;	// valeur initiale de TCNT2 avant le premier envoi
+static uint8_t half=22;		// attente de 1/2 etu avant réémission
+
+// instants de lecture en réception, comptés depuis le front du bit start,
+// modulo 256 : OCR2A est avancé d'un instant au suivant sans arrêter TCNT2
+static uint8_t rx_sample[9]={58,104,151,197,244,34,81,127,174};	// 1/4 des bits 1 à 9
+static uint8_t rx_quarter=11;		// 1/4 etu entre deux lectures d'un bit
+static uint8_t rx_error_start=255;	// 11 etu : début du signal d'erreur
+static uint8_t rx_error_end=69;		// 12.5 etu : fin du signal d'erreur
+static uint8_t rx_guard_mid=75;		// 12.6 etu : étape du temps de garde (moins de 256 entre deux)
+static uint8_t rx_guard_end=232;	// 16 etu : fin du temps de garde
+
+// tampon circulaire de réception, rempli par l'interruption : une commande
+// entière (P3 <= 255) y tient même si le traitement ne lit rien pendant qu'elle arrive
+#define RX_BUFFER_SIZE 256	// puissance de 2, 256 au plus (index sur 8 bits)
+static volatile uint8_t rx_buffer[RX_BUFFER_SIZE];
+static volatile uint8_t rx_head=0;	// écrit par l'interruption
+static volatile uint8_t rx_tail=0;	// lu par recbytet0
+static uint8_t rx_bit;			// bit en cours : 0-7 données, 8 parité, 9-10 signal d'erreur, 11-12 temps de garde
+static uint8_t rx_byte;
+static uint8_t rx_parity;
+static volatile uint8_t rx_guard=0;	// octet reçu depuis moins de 16 etu : pas d'émission
+
+static uint8_t pushback;	// octet remis par unrecbytet0
+static uint8_t has_pushback=0;
+
+#ifdef T1_PROTOCOL
+volatile uint8_t io_parity_error;	// erreur de parité depuis la dernière remise à 0
+static volatile uint8_t rx_missing=0;	// octets reçus tampon plein, pas encore rendus
+#endif
+
+// compteurs depuis le reset, rendus par GET_STATS
+volatile uint16_t io_rx_parity_errors=0;	// octets reçus avec une erreur de parité
+volatile uint16_t io_tx_repeats=0;		// octets réémis à la demande du lecteur
+
+// change la vitesse de transmission : un etu = 372/di clocks externes
+// les valeurs arrondies par défaut compensent le temps de relance du compteur
+void set_etu(uint8_t di)
+{
+	uint8_t i;
+	uint16_t e=372/di;	// etu en clocks externes
+	etu=e/8;
+	etu2=e*2/8;
+	first=etu-(etu>>3)-1;
+	half=etu/2-1;
+	rx_quarter=e/32;
+	for (i=0;i<9;i++)
+	{
+		rx_sample[i]=(uint8_t)(((4*i+5)*e)/32);
+	}
+	rx_error_start=(uint8_t)(11*e/8);
+	rx_error_end=(uint8_t)(25*e/16);
+	rx_guard_mid=(uint8_t)(101*e/64);
+	rx_guard_end=(uint8_t)(2*e);
+}
+
+// attend le prochain bit start
+static void rx_enable(void)
+{
+	DDRB&=~(1<<IOPIN);	// mode entrée sur pb4
+	PORTB|=(1<<IOPIN);	// pull-up sur IOPIN
+	PCIFR=1<<PCIF0;		// oublier les fronts précédents
+	PCICR|=1<<PCIE0;
+}
+
+static void rx_disable(void)
+{
+	PCICR&=~(1<<PCIE0);
+	TIMSK2=0;
+}
+
+void io_init()
+{
+	PCMSK0=1<<PCINT4;	// PCINT4 = PB4 = IOPIN
+	TCCR2A=0;
+	TCCR2B=2;		// TCNT2 tourne en permanence sur CK/8
+	sei();
+}
+
+// front sur la broche I/O : début du bit start si elle est à 0
+ISR(PCINT0_vect)
+{
+	if (PINB&(1<<IOPIN))
+	{
+		return;
+	}
+	TCNT2=0;
+	TCNT2=0;	// /!\ double initialisation, voir sendbit
+	PCICR&=~(1<<PCIE0);
+	rx_guard=1;
+	rx_bit=0;
+	rx_byte=0;
+	rx_parity=0;
+	OCR2A=rx_sample[0];
+	TIFR2=1<<OCF2A;
+	TIMSK2=1<<OCIE2A;
+}
+
+// comparaison TCNT2 : lecture d'un bit ou signal d'erreur
+ISR(TIMER2_COMPA_vect)
+{
+	uint8_t b;
+
+	if (rx_bit<9)
+	{
+		// vote majoritaire sur trois lectures à 1/4, 1/2 et 3/4 du bit
+		b=(PINB&(1<<IOPIN));
+		do; while ((uint8_t)(TCNT2-OCR2A)<rx_quarter);
+		b+=(PINB&(1<<IOPIN));
+		do; while ((uint8_t)(TCNT2-OCR2A)<2*rx_quarter);
+		b+=(PINB&(1<<IOPIN));
+		b=(b<<(6-IOPIN))&0x80;	// bit reçu en b7
+		rx_parity^=b;
+		if (rx_bit<8)
+		{	// bits de données lsb first
+			rx_byte=(rx_byte>>1)+b;
+			OCR2A=rx_sample[++rx_bit];
+			return;
+		}
+		if (rx_parity)
+		{
+			io_rx_parity_errors++;
+		}
+		b=(rx_head+1)&(RX_BUFFER_SIZE-1);	// prochaine place libre
+#ifdef T1_PROTOCOL
+		// en T=1 l'erreur est seulement notée, le bloc entier sera redemandé,
+		// mais l'octet est toujours compté pour que la lecture du bloc reste
+		// calée sur sa longueur : sans place, il est rendu plus tard par un 0
+		if (rx_parity || b==rx_tail)
+		{
+			io_parity_error=1;
+		}
+		if (b==rx_tail)
+		{
+			rx_missing++;
+		}
+		else
+		{
+			rx_buffer[rx_head]=rx_byte;
+			rx_head=b;
+		}
+#else
+		if (rx_parity || b==rx_tail)
+		{
+			// erreur de parité ou tampon plein : demander une réémission
+			rx_bit=9;
+			OCR2A=rx_error_start;
+			return;
+		}
+		rx_buffer[rx_head]=rx_byte;
+		rx_head=b;
+#endif
+		// le lecteur peut envoyer l'octet suivant, la carte attend le temps de garde
+		rx_bit=11;
+		OCR2A=rx_guard_mid;
+		rx_enable();
+	}
+	else if (rx_bit==9)
+	{	// mettre la ligne à 0 pendant environ 1.5 etu
+		PORTB&=~(1<<IOPIN);	// signal 0
+		DDRB|=(1<<IOPIN);	// sortie
+		rx_bit=10;
+		OCR2A=rx_error_end;
+	}
+	else if (rx_bit==10)
+	{	// fin du signal d'erreur, attendre la réémission
+		rx_bit=12;
+		OCR2A=rx_guard_end;
+		rx_enable();
+	}
+	else if (rx_bit==11)
+	{
+		rx_bit=12;
+		OCR2A=rx_guard_end;
+	}
+	else
+	{	// 16 etu depuis le bit start : la carte peut émettre
+		TIMSK2=0;
+		rx_guard=0;
+	}
+}
+
 // envoi d'un bit sur le lien série
 static void sendbit(uint8_t b)
 {
@@ -35,7 +253,7 @@ static void sendbit(uint8_t b)
 	// calcule la valeur à sortir
 	outB=(b&1)<<IOPIN;
 	// attend la fin de l'envoi de l'octet précédent
-	do; while (TCNT2<46);
+	do; while (TCNT2<etu);
 	// écriture du bit
 	PORTB=outB;	// pendant les 4 clocks dispos de l'horloge externe
 	// relance le compteur
@@ -49,10 +267,15 @@ void sendbytet0(uint8_t b)
 	uint8_t i;	// compteur
 	uint8_t p;	// parité
 	uint8_t b_save;	// valeur sauvegardée en cas d'erreur
+	uint8_t sreg;
 	
 	b_save=b;
+	do; while (rx_guard);	// temps de garde après le dernier octet reçu
+	sreg=SREG;
+	cli();		// pas d'interruption pendant l'émission de l'octet
+	rx_disable();	// pas de réception pendant l'émission
 	TCCR2B=2;	// lance le compteur sur CK/8
-	TCNT2=40;	// initialise TCNT2 pour attente lors du premier envoi
+	TCNT2=first;	// initialise TCNT2 pour attente lors du premier envoi
 reenvoyer:
 	PORTB|=1<<IOPIN;	// affecter la valeur
 	DDRB|=1<<IOPIN;		// avant de positionner le port en sortie
@@ -67,88 +290,78 @@ reenvoyer:
 	}
 	sendbit(p);	// bit de parité
 	sendbit(1);	// bit stop
-	do; while (TCNT2<46);	// attendre fin du bit stop 
+	do; while (TCNT2<etu);	// attendre fin du bit stop 
 	// commuter en mode entrée pour lire si le lecteur demande la réémission
 	DDRB&=~(1<<IOPIN);
 	PORTB&=~(1<<IOPIN);
-	do; while(TCNT2<93);	// attendre encore 1 etu
+	do; while(TCNT2<etu2);	// attendre encore 1 etu
 	// lire le signal d'erreur
 	if ((PINB&(1<<IOPIN))==0)
 	{ 	// si on lit 0
 		do; while ((PINB&(1<<IOPIN))==0);	// attendre la fin du signal d'erreur
-		TCNT2=22;	// positionner le compteur pour attendre encore 1/2 etu avant envoi
+		TCNT2=half;	// positionner le compteur pour attendre encore 1/2 etu avant envoi
 		b=b_save;	// restaurer l'octet à envoyer
+		io_tx_repeats++;
 		goto reenvoyer;
 	}
-	TCCR2B=0;	// arrête le compteur
+	rx_enable();	// le lecteur peut répondre
+	SREG=sreg;
 }
 
 
-// lecture d'un bit
-// rend 0 ou 0x80
-static uint8_t getbit()
+// remet un octet déjà lu, utilisé pour tester le PPSS après l'ATR
+void unrecbytet0(uint8_t b)
 {
-	uint8_t b;
-	// attendre la fin du bit précédent
-	do; while (TCNT2<46);
-	TCNT2=0;
-	TCNT2=0;	// réinitialise le compteur
-	// vote majoritaire sur lecture à trois instants
-	do; while (TCNT2<12);
-	b=(PINB&(1<<IOPIN));
-	do; while (TCNT2<23);
-	b+=(PINB&(1<<IOPIN));
-	do; while (TCNT2<34);
-	b+=(PINB&(1<<IOPIN));	// le bit reçu est en position IOPIN+1 si la somme des trois bits est >=2
-	// positionner le bit reçu en b7
-	return (b<<(6-IOPIN))&0x80;
+	pushback=b;
+	has_pushback=1;
+}
+
+// attente de n etu, sans toucher à TCNT2 qui cadence aussi la réception
+void waitetu(uint8_t n)
+{
+	uint8_t t;
+
+	while (n--)
+	{
+		t=TCNT2;
+		do; while ((uint8_t)(TCNT2-t)<etu);
+	}
 }
 
-// réception d'un octet
+// réception d'un octet, pris dans le tampon rempli par l'interruption
 uint8_t recbytet0()
 {
-	uint8_t i;	// compteur
 	uint8_t r;	// résultat
-	uint8_t p;	// parité
-	uint8_t b;	// bit reçu
-	
-	TCCR2B=2;	// démarre CNT2 sur CKEXT/8
-relire:
-	DDRB&=~(1<<IOPIN);		// mode entrée sur pb4
-	PORTB|=(1<<IOPIN);		// pull-up sur IOPIN
-	r=0;
-	// attendre le bit start
-	do; while ((PINB&(1<<IOPIN))!=0);
-	do; while ((PINB&(1<<IOPIN))!=0);	// anti rebond
-	TCNT2=0;	// initialisation double du compteur
-	TCNT2=0;
-	p=0;
-	for (i=0;i<8;i++)
-	{	// boucle de lecture des 8 bits d'un octet lsb first
-		b=getbit();
-		r=(r>>1)+b;
-		p^=b;
-	}
-	p^=getbit();	// p contient 0x80 si erreur de parité
-	// attendre la fin du bit de parité + 1 etu 
-	do; while (TCNT2<93);
-	// si erreur de parité, demander une réémission en mettant la ligne à 0 pendant environ 1.5 etu
-	if (p)
-	{
+#ifdef T1_PROTOCOL
+	uint8_t sreg;
+#endif
 
-		PORTB&=~(1<<IOPIN);	// signal 0
-		DDRB|=(1<<IOPIN);	// sortie
-		do; while (TCNT2<162);	// pendant 1.5 etu
-		goto relire;
-	}
-	else
+	if (has_pushback)
 	{
-		// sinon, attendre  1 etu du bit stop
-		do; while (TCNT2<139);
+		has_pushback=0;
+		return pushback;
 	}
-	TCCR2B=0;	// arrêter le compteur
+#ifdef T1_PROTOCOL
+	for (;;)
+	{	// attendre un octet, ou rendre un octet perdu tampon plein
+		if (rx_head!=rx_tail)
+		{
+			break;
+		}
+		sreg=SREG;
+		cli();
+		if (rx_missing)
+		{
+			rx_missing--;
+			SREG=sreg;
+			return 0;
+		}
+		SREG=sreg;
+	}
+#else
+	do; while (rx_head==rx_tail);	// attendre un octet
+#endif
+	r=rx_buffer[rx_tail];
+	rx_tail=(rx_tail+1)&(RX_BUFFER_SIZE-1);
 	return r;
 }
-
-
-
@@ -1,5 +1,7 @@
 ;========================================================================
 ; T=0 character I/O routines for 9600bps at 3.58 MHz
+; Fixed timing, not linked: the firmware uses io.c, whose etu can be
+; changed by PPS through set_etu().
 ;========================================================================
 
 
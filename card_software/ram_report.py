@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+# RAM report for the card firmware, run with "make ramreport".
+# Prints static RAM (.data + .bss) and the worst-case stack depth of every
+# APDU handler called from main(), including return addresses and the
+# deepest interrupt handler that can fire on top of it.
+# Frame sizes come from the gcc -fstack-usage .su files; functions without
+# one (assembly, avr-libc, libgcc) are measured from their disassembly.
+
+import glob
+import re
+import subprocess
+import sys
+
+RAM_SIZE = 2048
+RETURN_ADDRESS = 2
+
+FUNC_RE = re.compile(r'^[0-9a-f]+ <([^>]+)>:$')
+CALL_RE = re.compile(r'\s(r?call|r?jmp)\s.*<([^>+]+)>$')
+PUSH_RE = re.compile(r'\spush\s')
+# Stack frame set up with "in r28, 0x3d" followed by sbiw/subi on r28
+FRAME_RE = re.compile(r'\s(sbiw\s+r28, 0x|subi\s+r28, 0x)([0-9a-f]+)')
+
+
+def disassemble(elf):
+    out = subprocess.run(['avr-objdump', '-d', elf], check=True,
+                         capture_output=True, text=True).stdout
+    functions = {}
+    current = None
+    for line in out.splitlines():
+        m = FUNC_RE.match(line)
+        if m:
+            current = m.group(1)
+            functions[current] = {'calls': set(), 'pushes': 0, 'frame': 0}
+            continue
+        if current is None:
+            continue
+        f = functions[current]
+        m = CALL_RE.search(line)
+        if m and m.group(2) != current:
+            # jmp/rjmp to the start of another function is a tail call
+            f['calls'].add(m.group(2))
+        if PUSH_RE.search(line):
+            f['pushes'] += 1
+        m = FRAME_RE.search(line)
+        if m and f['frame'] == 0:
+            f['frame'] = int(m.group(2), 16)
+    return functions
+
+
+def stack_usage():
+    frames = {}
+    for path in glob.glob('*.su'):
+        with open(path) as su:
+            for line in su:
+                fields = line.split()
+                # file.c:line:col:function  size  static|dynamic[,bounded]
+                frames[fields[0].split(':')[-1]] = int(fields[1])
+    return frames
+
+
+def static_ram(elf):
+    out = subprocess.run(['avr-size', '-A', elf], check=True,
+                         capture_output=True, text=True).stdout
+    sizes = {}
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[0] in ('.data', '.bss', '.noinit'):
+            sizes[fields[0]] = int(fields[1])
+    return sizes
+
+
+def main():
+    elf = sys.argv[1] if len(sys.argv) > 1 else 'card.elf'
+    functions = disassemble(elf)
+    frames = stack_usage()
+    memo = {}
+
+    def frame(name):
+        if name in frames:
+            return frames[name]
+        f = functions.get(name)
+        return f['pushes'] + f['frame'] if f else 0
+
+    def depth(name, path=()):
+        if name in memo:
+            return memo[name]
+        if name in path:
+            print('warning: recursion through %s' % name)
+            return 0
+        deepest = 0
+        for callee in functions.get(name, {'calls': ()})['calls']:
+            if callee in functions:
+                deepest = max(deepest, RETURN_ADDRESS + depth(callee, path + (name,)))
+        memo[name] = frame(name) + deepest
+        return memo[name]
+
+    sizes = static_ram(elf)
+    static = sum(sizes.values())
+    print('Static RAM: %s = %d bytes' %
+          (' + '.join('%s %d' % kv for kv in sorted(sizes.items())), static))
+
+    isr = max([RETURN_ADDRESS + depth(n) for n in functions
+               if n.startswith('__vector_') and n != '__vector_default'] or [0])
+    print('Deepest interrupt handler: %d bytes' % isr)
+
+    base = RETURN_ADDRESS + frame('main')
+    handlers = sorted(c for c in functions['main']['calls'] if c in functions)
+    print('\nWorst-case stack per call from main() (main frame %d bytes):' % base)
+    worst = 0
+    worst_name = None
+    for name in sorted(handlers, key=lambda n: -depth(n)):
+        total = base + RETURN_ADDRESS + depth(name) + isr
+        print('  %-28s %4d bytes' % (name, total))
+        if total > worst:
+            worst, worst_name = total, name
+
+    print('\nWorst case: %s, %d bytes stack, %d bytes free of %d' %
+          (worst_name, worst, RAM_SIZE - static - worst, RAM_SIZE))
+
+
+if __name__ == '__main__':
+    main()
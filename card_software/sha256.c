@@ -15,6 +15,7 @@
 /*************************** HEADER FILES ***************************/
 #include <stdint.h>
 #include <string.h>
+#include <avr/pgmspace.h>
 #include "sha256.h"
 
 /****************************** MACROS ******************************/
@@ -29,7 +30,9 @@
 #define SIG1(x) (ROTRIGHT(x,17) ^ ROTRIGHT(x,19) ^ ((x) >> 10))
 
 /**************************** VARIABLES *****************************/
-static const WORD k[64] = {
+#ifndef SHA256_ASM
+// Round constants stay in flash, read with pgm_read_dword()
+static const WORD k[64] PROGMEM = {
 	0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
 	0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
 	0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
@@ -43,12 +46,12 @@ static const WORD k[64] = {
 /*********************** FUNCTION DEFINITIONS ***********************/
 void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
 {
-	WORD a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
+	WORD a, b, c, d, e, f, g, h, i, j, t1, t2, m[16];
 
+	// Message schedule is a rolling window: m[i & 15] holds w[i - 16]
+	// until round i replaces it with w[i]
 	for (i = 0, j = 0; i < 16; ++i, j += 4)
 		m[i] = ((WORD)data[j] << 24) | ((WORD)data[j + 1] << 16) | ((WORD)data[j + 2] << 8) | (WORD)data[j + 3];
-	for ( ; i < 64; ++i)
-		m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
 
 	a = ctx->state[0];
 	b = ctx->state[1];
@@ -60,7 +63,9 @@ void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
 	h = ctx->state[7];
 
 	for (i = 0; i < 64; ++i) {
-		t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
+		if (i >= 16)
+			m[i & 15] += SIG1(m[(i - 2) & 15]) + m[(i - 7) & 15] + SIG0(m[(i - 15) & 15]);
+		t1 = h + EP1(e) + CH(e,f,g) + pgm_read_dword(&k[i]) + m[i & 15];
 		t2 = EP0(a) + MAJ(a,b,c);
 		h = g;
 		g = f;
@@ -81,6 +86,7 @@ void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
 	ctx->state[6] += g;
 	ctx->state[7] += h;
 }
+#endif   // SHA256_ASM, see sha256_transform.s
 
 void sha256_init(SHA256_CTX *ctx)
 {
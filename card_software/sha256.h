@@ -11,13 +11,14 @@
 
 /*************************** HEADER FILES ***************************/
 #include <stddef.h>
+#include <stdint.h>
 
 /****************************** MACROS ******************************/
 #define SHA256_BLOCK_SIZE 32            // SHA256 outputs a 32 byte digest
 
 /**************************** DATA TYPES ****************************/
 typedef unsigned char BYTE;             // 8-bit byte
-typedef unsigned long WORD;             // 32-bit word (AVR is 16-bit arch, must use long)
+typedef uint32_t WORD;                  // 32-bit word (unsigned long on AVR, but not on the host build)
 
 typedef struct {
 	BYTE data[64];
@@ -28,6 +29,7 @@ typedef struct {
 
 /*********************** FUNCTION DECLARATIONS **********************/
 void sha256_init(SHA256_CTX *ctx);
+void sha256_transform(SHA256_CTX *ctx, const BYTE data[]);
 void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len);
 void sha256_final(SHA256_CTX *ctx, BYTE hash[]);
 
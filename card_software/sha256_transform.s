@@ -0,0 +1,475 @@
+;========================================================================
+; SHA-256 compression function for AVR (avr5)
+; void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
+;
+; Drop-in replacement for the C sha256_transform() of sha256.c, linked
+; when the firmware is built with SHA256_ASM=1. Words are kept little
+; endian like the C code, so ctx->state is shared unchanged.
+;
+; Byte rotations are register renames, only the remaining 1-3 bit
+; rotations are executed. The message schedule is a rolling window of
+; 16 words and the working variables a..h slide down a 16-word buffer,
+; so each round writes the new a and e instead of shifting all eight.
+;========================================================================
+
+CTX_STATE = 76			; offsetof(SHA256_CTX, state)
+FRAME = 128			; 16 W words + 16 working variable slots
+SPL = 0x3d
+SPH = 0x3e
+SREG = 0x3f
+
+	.text
+	.global	sha256_transform
+
+;========================================================================
+; 32-bit helpers on 4 registers, least significant byte first.
+; r1 is the zero register.
+
+.macro ROR32 a0, a1, a2, a3	; rotate right 1 - 6 cycles
+	bst	\a0, 0
+	lsr	\a3
+	ror	\a2
+	ror	\a1
+	ror	\a0
+	bld	\a3, 7
+.endm
+
+.macro ROL32 a0, a1, a2, a3	; rotate left 1 - 5 cycles
+	lsl	\a0
+	rol	\a1
+	rol	\a2
+	rol	\a3
+	adc	\a0, r1
+.endm
+
+.macro SHR32 a0, a1, a2, a3	; shift right 1 - 4 cycles
+	lsr	\a3
+	ror	\a2
+	ror	\a1
+	ror	\a0
+.endm
+
+.macro ADD32 d0, d1, d2, d3, s0, s1, s2, s3
+	add	\d0, \s0
+	adc	\d1, \s1
+	adc	\d2, \s2
+	adc	\d3, \s3
+.endm
+
+.macro LDY32 d0, d1, d2, d3, q	; load word at Y+q
+	ldd	\d0, Y+\q
+	ldd	\d1, Y+\q+1
+	ldd	\d2, Y+\q+2
+	ldd	\d3, Y+\q+3
+.endm
+
+.macro STY32 q, s0, s1, s2, s3	; store word at Y+q
+	std	Y+\q, \s0
+	std	Y+\q+1, \s1
+	std	Y+\q+2, \s2
+	std	Y+\q+3, \s3
+.endm
+
+;========================================================================
+; Register usage
+;   r2-r5	T	T1, then T1+T2
+;   r6-r9	S	sigma result
+;   r10-r13	x	sigma input (e, a, or a schedule word)
+;   r14-r17	t	rotation scratch
+;   r18-r21	u	Ch / Maj / d
+;   r22		scratch
+;   r23		round index
+;   r24:r25	F	frame base: W[16] at F+0, working variables at F+64
+;   X		W slot pointer
+;   Y		working variables: a at Y+0 ... h at Y+28
+;   Z		round constants in flash
+
+; X = F + 4 * ((i + k) & 15)
+.macro SLOT k
+	mov	r22, r23		; 1
+	subi	r22, lo8(-(\k))		; 1
+	andi	r22, 15			; 1
+	lsl	r22			; 1
+	lsl	r22			; 1
+	movw	r26, r24		; 1
+	add	r26, r22		; 1
+	adc	r27, r1			; 1
+.endm
+
+; x = W[(i + k) & 15]
+.macro LDSLOT k
+	SLOT	\k
+	ld	r10, X+			; 2
+	ld	r11, X+			; 2
+	ld	r12, X+			; 2
+	ld	r13, X+			; 2
+.endm
+
+; S = Σ1(x) = ROTR6 ^ ROTR11 ^ ROTR25
+.macro BSIG1
+	movw	r14, r10
+	movw	r16, r12
+	ROR32	r14, r15, r16, r17	; t = ROTR1(x)
+	mov	r6, r17			; S = ROTR24(t) = ROTR25(x)
+	mov	r7, r14
+	mov	r8, r15
+	mov	r9, r16
+	ROR32	r14, r15, r16, r17
+	ROR32	r14, r15, r16, r17	; t = ROTR3(x)
+	eor	r6, r15			; S ^= ROTR8(t) = ROTR11(x)
+	eor	r7, r16
+	eor	r8, r17
+	eor	r9, r14
+	movw	r14, r10
+	movw	r16, r12
+	ROL32	r14, r15, r16, r17
+	ROL32	r14, r15, r16, r17	; t = ROTL2(x)
+	eor	r6, r15			; S ^= ROTR8(t) = ROTR6(x)
+	eor	r7, r16
+	eor	r8, r17
+	eor	r9, r14
+.endm
+
+; S = Σ0(x) = ROTR2 ^ ROTR13 ^ ROTR22
+.macro BSIG0
+	movw	r14, r10
+	movw	r16, r12
+	ROR32	r14, r15, r16, r17
+	ROR32	r14, r15, r16, r17	; t = ROTR2(x)
+	movw	r6, r14			; S = ROTR2(x)
+	movw	r8, r16
+	movw	r14, r10
+	movw	r16, r12
+	ROL32	r14, r15, r16, r17
+	ROL32	r14, r15, r16, r17	; t = ROTL2(x)
+	eor	r6, r17			; S ^= ROTR24(t) = ROTR22(x)
+	eor	r7, r14
+	eor	r8, r15
+	eor	r9, r16
+	ROL32	r14, r15, r16, r17	; t = ROTL3(x)
+	eor	r6, r16			; S ^= ROTR16(t) = ROTR13(x)
+	eor	r7, r17
+	eor	r8, r14
+	eor	r9, r15
+.endm
+
+; S = σ0(x) = ROTR7 ^ ROTR18 ^ SHR3
+.macro SSIG0
+	movw	r14, r10
+	movw	r16, r12
+	ROL32	r14, r15, r16, r17	; t = ROTL1(x)
+	mov	r6, r15			; S = ROTR8(t) = ROTR7(x)
+	mov	r7, r16
+	mov	r8, r17
+	mov	r9, r14
+	movw	r14, r10
+	movw	r16, r12
+	ROR32	r14, r15, r16, r17
+	ROR32	r14, r15, r16, r17	; t = ROTR2(x)
+	eor	r6, r16			; S ^= ROTR16(t) = ROTR18(x)
+	eor	r7, r17
+	eor	r8, r14
+	eor	r9, r15
+	movw	r14, r10
+	movw	r16, r12
+	SHR32	r14, r15, r16, r17
+	SHR32	r14, r15, r16, r17
+	SHR32	r14, r15, r16, r17	; t = SHR3(x)
+	eor	r6, r14
+	eor	r7, r15
+	eor	r8, r16
+	eor	r9, r17
+.endm
+
+; S = σ1(x) = ROTR17 ^ ROTR19 ^ SHR10
+.macro SSIG1
+	movw	r14, r10
+	movw	r16, r12
+	ROR32	r14, r15, r16, r17	; t = ROTR1(x)
+	mov	r6, r16			; S = ROTR16(t) = ROTR17(x)
+	mov	r7, r17
+	mov	r8, r14
+	mov	r9, r15
+	ROR32	r14, r15, r16, r17
+	ROR32	r14, r15, r16, r17	; t = ROTR3(x)
+	eor	r6, r16			; S ^= ROTR16(t) = ROTR19(x)
+	eor	r7, r17
+	eor	r8, r14
+	eor	r9, r15
+	movw	r14, r10
+	movw	r16, r12
+	SHR32	r14, r15, r16, r17
+	SHR32	r14, r15, r16, r17	; t = SHR2(x)
+	eor	r6, r15			; S ^= SHR8(t) = SHR10(x)
+	eor	r7, r16
+	eor	r8, r17
+.endm
+
+;========================================================================
+sha256_transform:
+	push	r2
+	push	r3
+	push	r4
+	push	r5
+	push	r6
+	push	r7
+	push	r8
+	push	r9
+	push	r10
+	push	r11
+	push	r12
+	push	r13
+	push	r14
+	push	r15
+	push	r16
+	push	r17
+	push	r28
+	push	r29
+	push	r24			; ctx, read back at F+FRAME+1
+	push	r25			; at F+FRAME
+
+	; Allocate the frame
+	in	r28, SPL
+	in	r29, SPH
+	subi	r28, lo8(FRAME)
+	sbci	r29, hi8(FRAME)
+	in	r0, SREG
+	cli
+	out	SPH, r29
+	out	SREG, r0
+	out	SPL, r28
+	movw	r24, r28
+	adiw	r24, 1			; F = SP + 1
+
+	; W[0..15] = big endian message words
+	movw	r30, r22		; Z = data
+	movw	r26, r24		; X = W
+	ldi	r22, 16
+loadmsg:
+	ld	r17, Z+
+	ld	r16, Z+
+	ld	r15, Z+
+	ld	r14, Z+
+	st	X+, r14
+	st	X+, r15
+	st	X+, r16
+	st	X+, r17
+	dec	r22
+	brne	loadmsg
+
+	; a..h = ctx->state, at the top of the variable buffer
+	movw	r28, r24
+	subi	r28, lo8(-(64 + 32))
+	sbci	r29, hi8(-(64 + 32))
+	ldd	r30, Y+FRAME-96+1	; ctx
+	ldd	r31, Y+FRAME-96
+	subi	r30, lo8(-(CTX_STATE))
+	sbci	r31, hi8(-(CTX_STATE))
+	ldi	r22, 32
+loadstate:
+	ld	r0, Z+
+	st	Y+, r0
+	dec	r22
+	brne	loadstate
+	sbiw	r28, 32
+
+	ldi	r30, lo8(sha256_k)
+	ldi	r31, hi8(sha256_k)
+	clr	r23
+
+round:
+	cpi	r23, 16
+	brsh	schedule
+	SLOT	0
+	ld	r2, X+
+	ld	r3, X+
+	ld	r4, X+
+	ld	r5, X+
+	rjmp	wready
+
+schedule:
+	; W[i] = σ1(W[i-2]) + W[i-7] + σ0(W[i-15]) + W[i-16]
+	LDSLOT	0			; W[i-16] lives in slot i
+	movw	r2, r10
+	movw	r4, r12
+	LDSLOT	9			; W[i-7]
+	ADD32	r2, r3, r4, r5, r10, r11, r12, r13
+	LDSLOT	1			; W[i-15]
+	SSIG0
+	ADD32	r2, r3, r4, r5, r6, r7, r8, r9
+	LDSLOT	14			; W[i-2]
+	SSIG1
+	ADD32	r2, r3, r4, r5, r6, r7, r8, r9
+	SLOT	0
+	st	X+, r2
+	st	X+, r3
+	st	X+, r4
+	st	X+, r5
+
+wready:
+	; T1 = W[i] + K[i] + h + Σ1(e) + Ch(e,f,g)
+	lpm	r10, Z+
+	lpm	r11, Z+
+	lpm	r12, Z+
+	lpm	r13, Z+
+	ADD32	r2, r3, r4, r5, r10, r11, r12, r13
+	LDY32	r10, r11, r12, r13, 28	; h
+	ADD32	r2, r3, r4, r5, r10, r11, r12, r13
+	LDY32	r10, r11, r12, r13, 16	; e
+	BSIG1
+	ADD32	r2, r3, r4, r5, r6, r7, r8, r9
+
+	; Ch(e,f,g) = g ^ (e & (f ^ g))
+	ldd	r18, Y+20
+	ldd	r22, Y+24
+	eor	r18, r22
+	and	r18, r10
+	eor	r18, r22
+	ldd	r19, Y+21
+	ldd	r22, Y+25
+	eor	r19, r22
+	and	r19, r11
+	eor	r19, r22
+	ldd	r20, Y+22
+	ldd	r22, Y+26
+	eor	r20, r22
+	and	r20, r12
+	eor	r20, r22
+	ldd	r21, Y+23
+	ldd	r22, Y+27
+	eor	r21, r22
+	and	r21, r13
+	eor	r21, r22
+	ADD32	r2, r3, r4, r5, r18, r19, r20, r21
+
+	; d += T1, it becomes e once the window slides
+	LDY32	r18, r19, r20, r21, 12
+	ADD32	r18, r19, r20, r21, r2, r3, r4, r5
+	STY32	12, r18, r19, r20, r21
+
+	; T1 + T2, T2 = Σ0(a) + Maj(a,b,c)
+	LDY32	r10, r11, r12, r13, 0	; a
+	BSIG0
+	ADD32	r2, r3, r4, r5, r6, r7, r8, r9
+
+	; Maj(a,b,c) = (a & b) | (c & (a | b))
+	ldd	r18, Y+4
+	ldd	r22, Y+8
+	mov	r0, r18
+	or	r0, r10
+	and	r0, r22
+	and	r18, r10
+	or	r18, r0
+	ldd	r19, Y+5
+	ldd	r22, Y+9
+	mov	r0, r19
+	or	r0, r11
+	and	r0, r22
+	and	r19, r11
+	or	r19, r0
+	ldd	r20, Y+6
+	ldd	r22, Y+10
+	mov	r0, r20
+	or	r0, r12
+	and	r0, r22
+	and	r20, r12
+	or	r20, r0
+	ldd	r21, Y+7
+	ldd	r22, Y+11
+	mov	r0, r21
+	or	r0, r13
+	and	r0, r22
+	and	r21, r13
+	or	r21, r0
+	ADD32	r2, r3, r4, r5, r18, r19, r20, r21
+
+	; Slide the window: the new a goes one word below the old one
+	sbiw	r28, 4
+	STY32	0, r2, r3, r4, r5
+
+	inc	r23
+	mov	r22, r23
+	andi	r22, 7
+	brne	nextround
+
+	; Every 8 rounds the window reaches the bottom: move it back up
+	ldi	r22, 32
+rewind:
+	ldd	r0, Y+0
+	std	Y+32, r0
+	adiw	r28, 1
+	dec	r22
+	brne	rewind
+
+nextround:
+	cpi	r23, 64
+	breq	rounds_done
+	rjmp	round
+
+rounds_done:
+	; ctx->state[k] += a..h
+	ldd	r30, Y+FRAME-96+1
+	ldd	r31, Y+FRAME-96
+	subi	r30, lo8(-(CTX_STATE))
+	sbci	r31, hi8(-(CTX_STATE))
+	ldi	r23, 8
+addstate:
+	ld	r10, Y+
+	ld	r11, Y+
+	ld	r12, Y+
+	ld	r13, Y+
+	ldd	r2, Z+0
+	ldd	r3, Z+1
+	ldd	r4, Z+2
+	ldd	r5, Z+3
+	ADD32	r2, r3, r4, r5, r10, r11, r12, r13
+	st	Z+, r2
+	st	Z+, r3
+	st	Z+, r4
+	st	Z+, r5
+	dec	r23
+	brne	addstate
+
+	; Release the frame
+	movw	r28, r24
+	subi	r28, lo8(-(FRAME - 1))
+	sbci	r29, hi8(-(FRAME - 1))
+	in	r0, SREG
+	cli
+	out	SPH, r29
+	out	SREG, r0
+	out	SPL, r28
+
+	pop	r25
+	pop	r24
+	pop	r29
+	pop	r28
+	pop	r17
+	pop	r16
+	pop	r15
+	pop	r14
+	pop	r13
+	pop	r12
+	pop	r11
+	pop	r10
+	pop	r9
+	pop	r8
+	pop	r7
+	pop	r6
+	pop	r5
+	pop	r4
+	pop	r3
+	pop	r2
+	ret
+
+;========================================================================
+	.section .progmem.sha256_k,"a",@progbits
+sha256_k:
+	.long	0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5
+	.long	0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174
+	.long	0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da
+	.long	0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967
+	.long	0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85
+	.long	0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070
+	.long	0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3
+	.long	0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
@@ -0,0 +1,695 @@
+// Per-APDU cycle benchmark of card.elf on a simulated ATmega328p, run with
+// "make bench_apdu". The firmware runs unchanged under simavr (libsimavr)
+// while a T=0 reader model drives the I/O pin (PB4) bit by bit: the reader
+// clock feeds TCNT2 like on a real card, and the CPU runs at its own clock.
+//
+// A fresh card is reset, personalized and taken through every command of
+// the dispatcher. Each command is timed from the first header bit to the
+// end of its status word:
+//   cycles      total, what the terminal sees
+//   io_cycles   characters on the link (12 etu each, both directions)
+//   cpu_cycles  the rest, the reader waiting for the card
+//   background  EEPROM writes still running after the status word, until
+//               the EE_READY queue of ee.c is empty (the card is idle
+//               before the next command, so commands are measured alone)
+//
+// The reader model also checks the link timing: a card character starting
+// less than 16 etu after the start bit of the reader's last one stops the
+// run, as a real reader would take it for a framing or parity error.
+//
+// simavr completes EEPROM writes at once, so the EEPROM controller timing
+// is modelled here: a write is seen when the byte at EEAR changes, takes
+// 1.8 or 3.4 ms according to its mode, and EE_READY stays low meanwhile.
+//
+// Results go to a JSON file. With a baseline (a previous output), any
+// command whose cpu or background cycles grow by more than the tolerance
+// is reported and the exit status is 2.
+//
+// Usage: apdu_bench [-f cpu_hz] [-c reader_hz] [-d di] [-o out.json]
+//                   [-b baseline.json] [-t percent] card.elf
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_interrupts.h"
+#include "avr_ioport.h"
+#include "avr_eeprom.h"
+#include "avr_timer.h"
+
+// ATmega328p registers, data space addresses
+#define REG_DDRB 0x24
+#define REG_PORTB 0x25
+#define REG_EECR 0x3F
+#define REG_EEARL 0x41
+#define REG_EEARH 0x42
+#define EERIE 3
+#define EE_READY_VECTOR 22
+#define EEPROM_SIZE 1024
+
+#define IO_PIN 4
+#define CHAR_ETU 12             // start, 8 data, parity, 2 etu guard time
+// Least delay between the start bits of characters sent in opposite
+// directions (ISO 7816-3): the card must not answer sooner
+#define TURNAROUND_ETU 16
+#define ATR_IDLE_ETU 200        // end of the ATR
+#define MAX_COMMANDS 32
+
+// Programming times of the ATmega328p EEPROM
+#define EEPROM_ERASE_WRITE_US 3400
+#define EEPROM_HALF_US 1800     // erase only or write only
+
+#define SIZE_CARD_ID 24
+#define SIZE_PIN 4
+#define SIZE_PUK 4
+#define SIZE_CHALLENGE 32
+#define SIZE_SECRET_KEY 32
+#define SIZE_CARD_INFO (5 + SIZE_CARD_ID)
+#define MAX_BATCH 7
+
+typedef struct {
+    char name[64];
+    uint8_t cla;
+    uint8_t ins;
+    uint16_t sw;
+    unsigned long bytes;
+    double cycles;
+    double cpu_cycles;
+    double io_cycles;
+    double background_cycles;
+    unsigned long eeprom_writes;
+} RESULT;
+
+static avr_t *avr;
+static avr_irq_t *io_irq;
+static avr_int_vector_t *ee_ready;
+static uint8_t reader_level = 1;
+static double cpu_hz = 8000000;
+static double reader_hz = 3571200;     // 9600 bps at Di=1
+static double etu;                     // in CPU cycles
+
+// EEPROM controller model
+static uint8_t shadow[EEPROM_SIZE];
+static avr_cycle_count_t ee_busy_until = 0;
+static unsigned long ee_writes = 0;
+
+// Link accounting of the command being measured
+static double io_cycles;
+static double io_end;
+static unsigned long io_bytes;
+
+// Earliest start of the next reader character, 12 etu after the last one
+static double next_send = 0;
+// Start of the last reader character, -1 once the card has answered it
+static double reader_start = -1;
+
+static RESULT results[MAX_COMMANDS];
+static int result_count = 0;
+
+static double now(void)
+{
+    return (double)avr->cycle;
+}
+
+static void eeprom_watch(void)
+{
+    uint16_t addr = (avr->data[REG_EEARL] | (avr->data[REG_EEARH] << 8)) & (EEPROM_SIZE - 1);
+    uint8_t b;
+    avr_eeprom_desc_t desc = { .ee = &b, .offset = addr, .size = 1 };
+    unsigned long us;
+
+    avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &desc);
+    if (b != shadow[addr]) {
+        // Same mode choice as the hardware gets from ee.c
+        us = (b == 0xFF || (b & ~shadow[addr]) == 0) ? EEPROM_HALF_US : EEPROM_ERASE_WRITE_US;
+        ee_busy_until = avr->cycle + (avr_cycle_count_t)(us * cpu_hz / 1e6);
+        ee_writes++;
+        shadow[addr] = b;
+    }
+
+    // EE_READY is a level: high while EERIE is set and no write runs
+    if (avr->cycle < ee_busy_until) {
+        if (avr_is_interrupt_pending(avr, ee_ready)) {
+            avr_clear_interrupt(avr, ee_ready);
+        }
+    } else if ((avr->data[REG_EECR] & (1 << EERIE)) && !avr_is_interrupt_pending(avr, ee_ready)) {
+        avr_raise_interrupt(avr, ee_ready);
+    }
+}
+
+static void step(void)
+{
+    int state = avr_run(avr);
+
+    if (state == cpu_Done || state == cpu_Crashed) {
+        fprintf(stderr, "Error: the card stopped at cycle %llu (state %d)\n",
+                (unsigned long long)avr->cycle, state);
+        exit(1);
+    }
+    eeprom_watch();
+}
+
+static void run_until(double t)
+{
+    while (now() < t) {
+        step();
+    }
+}
+
+// Open drain line: low if the card or the reader pulls it low
+static int line(void)
+{
+    if ((avr->data[REG_DDRB] & (1 << IO_PIN)) && !(avr->data[REG_PORTB] & (1 << IO_PIN))) {
+        return 0;
+    }
+    return reader_level;
+}
+
+static void drive(uint8_t level)
+{
+    reader_level = level;
+    avr_raise_irq(io_irq, level);
+}
+
+// Counts a character starting at start as link time, overlaps excluded
+static void count_char(double start)
+{
+    double end = start + CHAR_ETU * etu;
+    double from = start > io_end ? start : io_end;
+
+    if (end > from) {
+        io_cycles += end - from;
+        io_end = end;
+    }
+    io_bytes++;
+}
+
+// Returns once the parity bit is sent: a card answering before the
+// turnaround time is then still seen, and refused, by receive_char()
+static void send_char(uint8_t b)
+{
+    double start;
+    uint8_t parity = 0;
+    int i;
+
+    run_until(next_send);
+    start = now();
+    drive(0);
+    run_until(start + etu);
+    for (i = 0; i < 8; i++) {
+        drive((b >> i) & 1);
+        parity ^= (b >> i) & 1;
+        run_until(start + (i + 2) * etu);
+    }
+    drive(parity);
+    run_until(start + 10 * etu);
+    drive(1);
+    count_char(start);
+    next_send = start + CHAR_ETU * etu;
+    reader_start = start;
+}
+
+// Returns the character, or -1 if none starts within timeout cycles
+static int receive_char(double timeout)
+{
+    double limit = now() + timeout;
+    double start;
+    uint8_t b = 0;
+    uint8_t parity = 0;
+    int bit;
+    int i;
+
+    while (line()) {
+        if (now() >= limit) {
+            return -1;
+        }
+        step();
+    }
+    start = now();
+
+    // A card sending this early collides with the parity bit or the error
+    // signal of the reader's character
+    if (reader_start >= 0 && start - reader_start < TURNAROUND_ETU * etu) {
+        fprintf(stderr, "Error: the card answered %.1f etu after the reader's character at cycle %llu (%d etu at least)\n",
+                (start - reader_start) / etu, (unsigned long long)avr->cycle, TURNAROUND_ETU);
+        exit(1);
+    }
+    reader_start = -1;
+
+    // Bits sampled in their middle, data lsb first, then parity
+    for (i = 0; i < 9; i++) {
+        run_until(start + (i + 1.5) * etu);
+        bit = line();
+        parity ^= bit;
+        if (i < 8) {
+            b |= bit << i;
+        }
+    }
+    if (parity) {
+        fprintf(stderr, "Error: parity error at cycle %llu\n", (unsigned long long)avr->cycle);
+        exit(1);
+    }
+
+    // No error signal: the card checks the line 11 etu after the start bit
+    count_char(start);
+    next_send = start + CHAR_ETU * etu;
+    run_until(start + 10.5 * etu);
+    return b;
+}
+
+static uint8_t receive(void)
+{
+    // Far longer than any command, the card is stuck
+    int b = receive_char(5 * cpu_hz);
+
+    if (b < 0) {
+        fprintf(stderr, "Error: no answer from the card\n");
+        exit(1);
+    }
+    return (uint8_t)b;
+}
+
+static void measure_start(void)
+{
+    io_cycles = 0;
+    io_end = now();
+    io_bytes = 0;
+}
+
+// Runs one command, checks its status word and records its timings
+static void command(const char *name, const uint8_t *apdu, size_t len, uint16_t expected_sw)
+{
+    RESULT *r = &results[result_count++];
+    double start;
+    unsigned long writes = ee_writes;
+    size_t sent = 5;
+    uint8_t b;
+    int i;
+
+    measure_start();
+    start = now();
+    for (i = 0; i < 5; i++) {
+        send_char(apdu[i]);
+    }
+
+    for (;;) {
+        b = receive();
+        if (b == 0x60) {
+            continue;
+        }
+        if (b == apdu[1]) {
+            // Procedure byte: data in if the command has any, out otherwise
+            if (len > 5) {
+                while (sent < len) {
+                    send_char(apdu[sent++]);
+                }
+            } else {
+                for (i = 0; i < apdu[4]; i++) {
+                    receive();
+                }
+            }
+            continue;
+        }
+        if ((b & 0xF0) == 0x60 || (b & 0xF0) == 0x90) {
+            r->sw = (uint16_t)(b << 8) | receive();
+            break;
+        }
+        fprintf(stderr, "Error: %s: unexpected procedure byte %02X\n", name, b);
+        exit(1);
+    }
+    run_until(io_end);
+
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->cla = apdu[0];
+    r->ins = apdu[1];
+    r->bytes = io_bytes;
+    r->cycles = now() - start;
+    r->io_cycles = io_cycles;
+    r->cpu_cycles = r->cycles - io_cycles;
+
+    // Background EEPROM writes, until ee.c has nothing queued
+    start = now();
+    while ((avr->data[REG_EECR] & (1 << EERIE)) || avr->cycle < ee_busy_until) {
+        step();
+    }
+    r->background_cycles = now() - start;
+    r->eeprom_writes = ee_writes - writes;
+
+    if (r->sw != expected_sw) {
+        fprintf(stderr, "Error: %s returned %04X instead of %04X\n", name, r->sw, expected_sw);
+        exit(1);
+    }
+}
+
+// Power-up and ATR, then PPS when di > 1. Returns the ATR time in cycles.
+static double reset_card(int di)
+{
+    uint8_t atr[33];
+    size_t atr_len = 0;
+    uint8_t pps[4] = {0xFF, 0x10, 0x10, 0};
+    int di_index = di == 4 ? 3 : di == 2 ? 2 : 1;
+    double atr_cycles;
+    int b;
+    int i;
+
+    measure_start();
+    while ((b = receive_char(ATR_IDLE_ETU * etu)) >= 0 && atr_len < sizeof(atr)) {
+        atr[atr_len++] = (uint8_t)b;
+    }
+    // TS T0 TA1 TB1 TC1 TD1: this reader only speaks T=0
+    if (atr_len < 6 || (atr[5] & 0x0F) != 0) {
+        fprintf(stderr, "Error: no T=0 ATR (card built with T1=1?)\n");
+        exit(1);
+    }
+    atr_cycles = io_end;
+
+    if (di > 1) {
+        pps[2] = 0x10 | di_index;
+        pps[3] = pps[0] ^ pps[1] ^ pps[2];
+        for (i = 0; i < 4; i++) {
+            send_char(pps[i]);
+        }
+        for (i = 0; i < 4; i++) {
+            if (receive() != pps[i]) {
+                fprintf(stderr, "Error: PPS to Di=%d refused\n", di);
+                exit(1);
+            }
+        }
+        run_until(io_end);
+        etu /= di;
+    }
+    return atr_cycles;
+}
+
+static void run_script(void)
+{
+    uint8_t id[SIZE_CARD_ID];
+    uint8_t pin[SIZE_PIN] = {1, 2, 3, 4};
+    uint8_t puk[SIZE_PUK] = {9, 9, 9, 9};
+    uint8_t apdu[5 + MAX_BATCH * SIZE_CHALLENGE + 1];
+    int i;
+
+    memcpy(id, "BENCHCARD000000000000001", SIZE_CARD_ID);
+
+#define HEADER(cla, ins, p3) (apdu[0] = (cla), apdu[1] = (ins), apdu[2] = 0, apdu[3] = 0, apdu[4] = (p3))
+
+    HEADER(0x80, 0x10, SIZE_CARD_INFO);
+    command("get_card_info_blank", apdu, 5, 0x9000);
+
+    HEADER(0x80, 0x01, SIZE_CARD_ID);
+    command("read_card_id", apdu, 5, 0x9000);
+
+    HEADER(0x80, 0x02, 1);
+    command("read_version", apdu, 5, 0x9000);
+
+    HEADER(0x80, 0x08, SIZE_CARD_ID + SIZE_PUK);
+    memcpy(apdu + 5, id, SIZE_CARD_ID);
+    memcpy(apdu + 5 + SIZE_CARD_ID, puk, SIZE_PUK);
+    command("assign_card", apdu, 5 + SIZE_CARD_ID + SIZE_PUK, 0x9000);
+
+    HEADER(0x80, 0x0A, 1 + SIZE_SECRET_KEY);
+    apdu[5] = 0;
+    for (i = 0; i < SIZE_SECRET_KEY; i++) {
+        apdu[6 + i] = i;
+    }
+    command("write_private_key_chunk", apdu, 6 + SIZE_SECRET_KEY, 0x9000);
+
+    HEADER(0x80, 0x03, SIZE_PIN + SIZE_PUK);
+    memcpy(apdu + 5, pin, SIZE_PIN);
+    memcpy(apdu + 5 + SIZE_PIN, puk, SIZE_PUK);
+    command("write_pin", apdu, 5 + SIZE_PIN + SIZE_PUK, 0x9000);
+
+    HEADER(0x80, 0x09, SIZE_PIN);
+    memcpy(apdu + 5, pin, SIZE_PIN);
+    command("write_pin_only", apdu, 5 + SIZE_PIN, 0x9000);
+
+    HEADER(0x80, 0x0E, 1);
+    command("is_pin_defined", apdu, 5, 0x9000);
+
+    HEADER(0x80, 0x0D, 2);
+    command("get_remaining_attempts", apdu, 5, 0x9000);
+
+    HEADER(0x80, 0x06, SIZE_PIN);
+    memcpy(apdu + 5, pin, SIZE_PIN);
+    command("verify_pin", apdu, 5 + SIZE_PIN, 0x9000);
+
+    HEADER(0x80, 0x06, SIZE_PIN);
+    memset(apdu + 5, 0, SIZE_PIN);
+    command("verify_pin_wrong", apdu, 5 + SIZE_PIN, 0x63C2);
+
+    HEADER(0x80, 0x07, SIZE_PUK + SIZE_PIN);
+    memcpy(apdu + 5, puk, SIZE_PUK);
+    memcpy(apdu + 5 + SIZE_PUK, pin, SIZE_PIN);
+    command("verify_puk", apdu, 5 + SIZE_PUK + SIZE_PIN, 0x9000);
+
+    HEADER(0x80, 0x0C, SIZE_CHALLENGE);
+    for (i = 0; i < SIZE_CHALLENGE; i++) {
+        apdu[5 + i] = 0xa0 + i;
+    }
+    command("set_challenge", apdu, 5 + SIZE_CHALLENGE, 0x9000);
+
+    HEADER(0x80, 0x0B, 32);
+    command("sign_challenge", apdu, 5, 0x9000);
+
+    HEADER(0x80, 0x0F, SIZE_PIN + SIZE_CHALLENGE);
+    memcpy(apdu + 5, pin, SIZE_PIN);
+    for (i = 0; i < SIZE_CHALLENGE; i++) {
+        apdu[5 + SIZE_PIN + i] = 0xa0 + i;
+    }
+    command("authenticate", apdu, 5 + SIZE_PIN + SIZE_CHALLENGE, 0x6120);
+
+    HEADER(0x00, 0xC0, 32);
+    command("get_response", apdu, 5, 0x9000);
+
+    HEADER(0x80, 0x10, SIZE_CARD_INFO);
+    command("get_card_info", apdu, 5, 0x9000);
+
+    // Same key, MAX_BATCH challenges in one command
+    HEADER(0x80, 0x18, MAX_BATCH * SIZE_CHALLENGE);
+    apdu[2] = MAX_BATCH;
+    for (i = 0; i < MAX_BATCH * SIZE_CHALLENGE; i++) {
+        apdu[5 + i] = 0xa0 + i;
+    }
+    command("sign_batch", apdu, 5 + MAX_BATCH * SIZE_CHALLENGE, 0x61E0);
+
+    HEADER(0x00, 0xC0, MAX_BATCH * 32);
+    command("get_response_batch", apdu, 5, 0x9000);
+
+#undef HEADER
+}
+
+static double to_us(double cycles)
+{
+    return cycles * 1e6 / cpu_hz;
+}
+
+static int write_json(const char *path, int di, double atr_cycles)
+{
+    FILE *f = fopen(path, "w");
+    RESULT *r;
+    int i;
+
+    if (!f) {
+        perror(path);
+        return 0;
+    }
+
+    fprintf(f, "{\n  \"cpu_hz\": %.0f,\n  \"reader_hz\": %.0f,\n  \"di\": %d,\n", cpu_hz, reader_hz, di);
+    fprintf(f, "  \"atr_cycles\": %.0f,\n  \"commands\": [\n", atr_cycles);
+    // One command per line, read back by read_baseline()
+    for (i = 0; i < result_count; i++) {
+        r = &results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"cla\": %u, \"ins\": %u, \"sw\": \"%04X\", \"bytes\": %lu, "
+                "\"cycles\": %.0f, \"cpu_cycles\": %.0f, \"io_cycles\": %.0f, \"background_cycles\": %.0f, "
+                "\"eeprom_writes\": %lu, \"us\": %.1f, \"cpu_us\": %.1f, \"io_us\": %.1f, \"background_us\": %.1f}%s\n",
+                r->name, r->cla, r->ins, r->sw, r->bytes,
+                r->cycles, r->cpu_cycles, r->io_cycles, r->background_cycles,
+                r->eeprom_writes, to_us(r->cycles), to_us(r->cpu_cycles), to_us(r->io_cycles),
+                to_us(r->background_cycles), i + 1 < result_count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+    return 1;
+}
+
+static double field(const char *line, const char *key)
+{
+    char pattern[64];
+    const char *p;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    p = strstr(line, pattern);
+    return p ? strtod(p + strlen(pattern), NULL) : -1;
+}
+
+// Compares with a previous output, returns the number of regressions
+static int check_baseline(const char *path, double tolerance)
+{
+    FILE *f = fopen(path, "r");
+    char line[1024];
+    char name[64];
+    const char *p;
+    double base_cpu;
+    double base_background;
+    double limit;
+    int regressions = 0;
+    int i;
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        p = strstr(line, "\"name\": \"");
+        if (!p || sscanf(p + 9, "%63[^\"]", name) != 1) {
+            continue;
+        }
+        base_cpu = field(line, "cpu_cycles");
+        base_background = field(line, "background_cycles");
+
+        for (i = 0; i < result_count && strcmp(results[i].name, name) != 0; i++);
+        if (i == result_count) {
+            printf("%-24s missing from this run\n", name);
+            continue;
+        }
+
+        // One etu of slack: a character can move by a bit period
+        limit = base_cpu * (1 + tolerance / 100) + etu;
+        if (results[i].cpu_cycles > limit) {
+            printf("%-24s REGRESSION cpu %.0f -> %.0f cycles\n", name, base_cpu, results[i].cpu_cycles);
+            regressions++;
+        }
+        limit = base_background * (1 + tolerance / 100) + etu;
+        if (results[i].background_cycles > limit) {
+            printf("%-24s REGRESSION background %.0f -> %.0f cycles\n", name, base_background,
+                   results[i].background_cycles);
+            regressions++;
+        }
+    }
+    fclose(f);
+    return regressions;
+}
+
+static avr_int_vector_t *find_vector(int number)
+{
+    int i;
+
+    for (i = 0; i < avr->interrupts.vector_count; i++) {
+        if (avr->interrupts.vector[i]->vector == number) {
+            return avr->interrupts.vector[i];
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *output = "bench_apdu.json";
+    const char *baseline = NULL;
+    double tolerance = 2;
+    elf_firmware_t firmware;
+    avr_eeprom_desc_t desc;
+    uint8_t virtual_clock = 1;
+    float timer_clock;
+    double atr_cycles;
+    RESULT *r;
+    int di = 1;
+    int regressions = 0;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "f:c:d:o:b:t:")) != -1) {
+        switch (opt) {
+        case 'f':
+            cpu_hz = atof(optarg);
+            break;
+        case 'c':
+            reader_hz = atof(optarg);
+            break;
+        case 'd':
+            di = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 't':
+            tolerance = atof(optarg);
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+    if (optind != argc - 1 || cpu_hz <= 0 || reader_hz <= 0 || (di != 1 && di != 2 && di != 4)) {
+        printf("Usage: %s [-f cpu_hz] [-c reader_hz] [-d 1|2|4] [-o out.json] [-b baseline.json] [-t percent] card.elf\n",
+               argv[0]);
+        return 1;
+    }
+
+    memset(&firmware, 0, sizeof(firmware));
+    if (elf_read_firmware(argv[optind], &firmware) != 0) {
+        fprintf(stderr, "Error: cannot read %s\n", argv[optind]);
+        return 1;
+    }
+    avr = avr_make_mcu_by_name("atmega328p");
+    if (!avr) {
+        return 1;
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, &firmware);
+
+    // TCNT2 counts the reader clock (ASSR = EXCLK | AS2). simavr refuses an
+    // asynchronous clock above F_CPU/4, the datasheet limit that the card
+    // exceeds, hence the frequency raised while the clock is set.
+    timer_clock = reader_hz;
+    avr->frequency = reader_hz * 4;
+    if (avr_ioctl(avr, AVR_IOCTL_TIMER_SET_VIRTCLK('2'), &virtual_clock) != 0 ||
+        avr_ioctl(avr, AVR_IOCTL_TIMER_SET_FREQCLK('2'), &timer_clock) != 0) {
+        fprintf(stderr, "Error: this simavr cannot clock timer 2 externally\n");
+        return 1;
+    }
+    avr->frequency = cpu_hz;
+    etu = 372 * cpu_hz / reader_hz;
+
+    io_irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), IO_PIN);
+    ee_ready = find_vector(EE_READY_VECTOR);
+    desc.ee = shadow;
+    desc.offset = 0;
+    desc.size = EEPROM_SIZE;
+    if (!io_irq || !ee_ready || avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &desc) != 0) {
+        fprintf(stderr, "Error: simavr has no I/O pin or EEPROM\n");
+        return 1;
+    }
+    drive(1);
+
+    atr_cycles = reset_card(di);
+    run_script();
+
+    printf("card clock %.0f Hz, reader clock %.0f Hz, Di=%d (etu %.0f cycles)\n", cpu_hz, reader_hz, di, etu);
+    printf("ATR: %.0f cycles, %.1f us\n", atr_cycles, to_us(atr_cycles));
+    printf("%-24s %10s %10s %10s %10s %6s %12s\n", "command", "cycles", "us", "cpu us", "io us", "ee wr", "background us");
+    for (i = 0; i < result_count; i++) {
+        r = &results[i];
+        printf("%-24s %10.0f %10.1f %10.1f %10.1f %6lu %12.1f\n", r->name, r->cycles, to_us(r->cycles),
+               to_us(r->cpu_cycles), to_us(r->io_cycles), r->eeprom_writes, to_us(r->background_cycles));
+    }
+
+    if (!write_json(output, di, atr_cycles)) {
+        return 1;
+    }
+    printf("results written to %s\n", output);
+
+    if (baseline) {
+        regressions = check_baseline(baseline, tolerance);
+        if (regressions < 0) {
+            return 1;
+        }
+        printf("%d regression(s) against %s (tolerance %.1f%%)\n", regressions, baseline, tolerance);
+    }
+    return regressions ? 2 : 0;
+}
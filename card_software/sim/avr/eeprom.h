@@ -0,0 +1,33 @@
+// Host stand-in for <avr/eeprom.h>, on the EEPROM image of the card
+// being run (see cardsim.c). Addresses are offsets cast to pointers,
+// as on the AVR.
+#ifndef CARDSIM_AVR_EEPROM_H
+#define CARDSIM_AVR_EEPROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+extern uint8_t *cardsim_eeprom;
+
+static inline uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+    return cardsim_eeprom[(uintptr_t)addr];
+}
+
+static inline void eeprom_update_byte(uint8_t *addr, uint8_t value)
+{
+    cardsim_eeprom[(uintptr_t)addr] = value;
+}
+
+static inline void eeprom_read_block(void *dst, const void *addr, size_t len)
+{
+    memcpy(dst, cardsim_eeprom + (uintptr_t)addr, len);
+}
+
+static inline void eeprom_update_block(const void *src, void *addr, size_t len)
+{
+    memcpy(cardsim_eeprom + (uintptr_t)addr, src, len);
+}
+
+#endif
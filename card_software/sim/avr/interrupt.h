@@ -0,0 +1,10 @@
+// Host stand-in for <avr/interrupt.h>. The simulated card only switches
+// at recbytet0(), so interrupts never preempt the firmware.
+#ifndef CARDSIM_AVR_INTERRUPT_H
+#define CARDSIM_AVR_INTERRUPT_H
+
+#define ISR(vector) void vector(void)
+#define sei()
+#define cli()
+
+#endif
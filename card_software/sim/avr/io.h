@@ -0,0 +1,37 @@
+// Host stand-in for <avr/io.h>: the registers the firmware touches, as
+// plain variables (sim/host_io.c). EECR and EEDR go through functions so the
+// EEPROM controller can be emulated.
+#ifndef CARDSIM_AVR_IO_H
+#define CARDSIM_AVR_IO_H
+
+#include <stdint.h>
+
+extern volatile uint8_t ACSR, PRR, PORTB, DDRB, PORTC, DDRC, PORTD, DDRD, ASSR;
+extern volatile uint16_t EEAR;
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+extern volatile uint16_t TCNT1;
+
+#define EXCLK 6
+#define AS2 5
+
+#define CS10 0
+#define CS11 1
+#define TOIE1 0
+#define TOV1 0
+
+// Last EEPROM address of the ATmega328p
+#define E2END 0x3FF
+
+#define EERE 0
+#define EEPE 1
+#define EEMPE 2
+#define EERIE 3
+#define EEPM0 4
+#define EEPM1 5
+
+volatile uint8_t *cardsim_eecr(void);
+volatile uint8_t *cardsim_eedr(void);
+#define EECR (*cardsim_eecr())
+#define EEDR (*cardsim_eedr())
+
+#endif
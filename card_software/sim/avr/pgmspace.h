@@ -0,0 +1,11 @@
+// Host stand-in for <avr/pgmspace.h>: flash is ordinary memory
+#ifndef CARDSIM_AVR_PGMSPACE_H
+#define CARDSIM_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+
+#endif
@@ -0,0 +1,300 @@
+// Card simulator: runs the host build of the firmware (sim/firmware.o) as
+// one coroutine per card. The reader side feeds bytes and runs the card
+// until it waits for the next one; the firmware globals of the card that
+// ran last stay in place and are swapped only when another card runs.
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "cardsim.h"
+#include "cardsim_card.h"
+#include "boot.h"
+
+#define CARDSIM_STACK_SIZE (32 * 1024)
+#define HEADER_SIZE 5
+
+struct cardsim {
+    ucontext_t context;             // firmware side
+    ucontext_t caller;              // reader side, resumed when the card waits
+    uint8_t *stack;
+    uint8_t *firmware;              // firmware globals while another card runs
+    uint8_t *eeprom;
+    uint8_t *flash;                 // staging area of the flash, in RAM only
+    int powered;
+    const uint8_t *in;              // bytes sent by the reader, not read yet
+    size_t in_len;
+    uint8_t out[CARDSIM_MAX_RESPONSE + 1];
+    size_t out_len;
+    int overflow;                   // the card sent more than out holds
+    CARDSIM_STATS stats;
+};
+
+// Bounds of the firmware writable data, from sim/firmware.ld
+extern uint8_t __cardsim_firmware_start[];
+extern uint8_t __cardsim_firmware_end[];
+
+extern int cardsim_main(void);
+
+uint8_t *cardsim_eeprom;
+
+static uint8_t *pristine = NULL;    // firmware globals before any card ran
+static CARDSIM *loaded = NULL;      // card whose globals are in place
+static CARDSIM *running = NULL;
+
+static size_t firmware_size(void)
+{
+    return __cardsim_firmware_end - __cardsim_firmware_start;
+}
+
+static void load(CARDSIM *card)
+{
+    if (loaded == card) {
+        return;
+    }
+    if (loaded) {
+        memcpy(loaded->firmware, __cardsim_firmware_start, firmware_size());
+    }
+    memcpy(__cardsim_firmware_start, card->firmware, firmware_size());
+    loaded = card;
+}
+
+// Runs the card until it waits for a byte the reader has not sent
+static void run(CARDSIM *card)
+{
+    load(card);
+    running = card;
+    cardsim_eeprom = card->eeprom;
+    swapcontext(&card->caller, &card->context);
+    running = NULL;
+}
+
+static void feed(CARDSIM *card, const uint8_t *bytes, size_t len)
+{
+    card->in = bytes;
+    card->in_len = len;
+    card->stats.bytes_in += len;
+    run(card);
+}
+
+int cardsim_card_input_empty(void)
+{
+    return running->in_len == 0;
+}
+
+uint8_t cardsim_card_receive(void)
+{
+    CARDSIM *card = running;
+
+    while (card->in_len == 0) {
+        swapcontext(&card->context, &card->caller);
+    }
+    card->in_len--;
+    return *card->in++;
+}
+
+void cardsim_card_send(uint8_t b)
+{
+    CARDSIM *card = running;
+
+    card->stats.bytes_out++;
+    if (card->out_len == sizeof(card->out)) {
+        card->overflow = 1;
+        return;
+    }
+    card->out[card->out_len++] = b;
+}
+
+void cardsim_card_eeprom_written(uint16_t us)
+{
+    running->stats.eeprom_writes++;
+    running->stats.eeprom_write_us += us;
+}
+
+uint8_t *cardsim_card_flash(void)
+{
+    return running->flash;
+}
+
+static void firmware_entry(void)
+{
+    cardsim_main();
+}
+
+static uint8_t *map_eeprom(const char *path)
+{
+    uint8_t *eeprom;
+    struct stat st;
+    int fd;
+
+    if (!path) {
+        eeprom = mmap(NULL, CARDSIM_EEPROM_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (eeprom == MAP_FAILED) {
+            return NULL;
+        }
+        memset(eeprom, 0xFF, CARDSIM_EEPROM_SIZE);
+        return eeprom;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || (st.st_size < CARDSIM_EEPROM_SIZE && ftruncate(fd, CARDSIM_EEPROM_SIZE) < 0)) {
+        close(fd);
+        return NULL;
+    }
+
+    eeprom = mmap(NULL, CARDSIM_EEPROM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (eeprom == MAP_FAILED) {
+        return NULL;
+    }
+
+    // A new image is an erased EEPROM
+    if (st.st_size < CARDSIM_EEPROM_SIZE) {
+        memset(eeprom + st.st_size, 0xFF, CARDSIM_EEPROM_SIZE - st.st_size);
+    }
+    return eeprom;
+}
+
+CARDSIM *cardsim_open(const char *eeprom_path)
+{
+    CARDSIM *card;
+
+    if (!pristine) {
+        pristine = malloc(firmware_size());
+        if (!pristine) {
+            return NULL;
+        }
+        memcpy(pristine, __cardsim_firmware_start, firmware_size());
+    }
+
+    card = calloc(1, sizeof(*card));
+    if (!card) {
+        return NULL;
+    }
+
+    card->stack = malloc(CARDSIM_STACK_SIZE);
+    card->firmware = malloc(firmware_size());
+    card->flash = malloc(BOOT_MAX_IMAGE);
+    card->eeprom = map_eeprom(eeprom_path);
+    if (!card->stack || !card->firmware || !card->flash || !card->eeprom) {
+        if (card->eeprom) {
+            munmap(card->eeprom, CARDSIM_EEPROM_SIZE);
+        }
+        free(card->flash);
+        free(card->firmware);
+        free(card->stack);
+        free(card);
+        return NULL;
+    }
+    memset(card->flash, 0xFF, BOOT_MAX_IMAGE);
+
+    return card;
+}
+
+void cardsim_close(CARDSIM *card)
+{
+    if (!card) {
+        return;
+    }
+    if (loaded == card) {
+        loaded = NULL;
+    }
+    munmap(card->eeprom, CARDSIM_EEPROM_SIZE);
+    free(card->flash);
+    free(card->firmware);
+    free(card->stack);
+    free(card);
+}
+
+int cardsim_reset(CARDSIM *card, uint8_t *atr, size_t *atr_len)
+{
+    // Globals back to their initial values, without saving the old ones
+    memcpy(card->firmware, pristine, firmware_size());
+    if (loaded == card) {
+        loaded = NULL;
+    }
+
+    if (getcontext(&card->context) < 0) {
+        return 0;
+    }
+    card->context.uc_stack.ss_sp = card->stack;
+    card->context.uc_stack.ss_size = CARDSIM_STACK_SIZE;
+    card->context.uc_link = &card->caller;
+    makecontext(&card->context, firmware_entry, 0);
+
+    card->in_len = 0;
+    card->out_len = 0;
+    card->overflow = 0;
+    run(card);
+    card->powered = 1;
+
+    if (card->out_len > CARDSIM_MAX_ATR) {
+        return 0;
+    }
+    if (atr) {
+        memcpy(atr, card->out, card->out_len);
+    }
+    if (atr_len) {
+        *atr_len = card->out_len;
+    }
+    return 1;
+}
+
+int cardsim_transmit(CARDSIM *card, const uint8_t *apdu, size_t apdu_len,
+                     uint8_t *response, size_t *response_len)
+{
+    size_t start;
+
+    if (apdu_len < HEADER_SIZE || (apdu_len > HEADER_SIZE && apdu_len != HEADER_SIZE + (size_t)apdu[4])) {
+        return 0;
+    }
+    if (!card->powered && !cardsim_reset(card, NULL, NULL)) {
+        return 0;
+    }
+
+    card->stats.apdus++;
+    card->out_len = 0;
+    card->overflow = 0;
+    feed(card, apdu, HEADER_SIZE);
+
+    // The procedure byte alone asks for the command data
+    if (card->out_len == 1 && card->out[0] == apdu[1]) {
+        if (apdu_len == HEADER_SIZE) {
+            cardsim_reset(card, NULL, NULL);
+            return 0;
+        }
+        feed(card, apdu + HEADER_SIZE, apdu_len - HEADER_SIZE);
+    }
+
+    if (card->overflow || card->out_len < 2) {
+        return 0;
+    }
+
+    start = card->out[0] == apdu[1] ? 1 : 0;
+    // After command data, only NULL procedure bytes (sent by long commands
+    // to keep the reader waiting) can come before the status word
+    if (apdu_len > HEADER_SIZE) {
+        while (card->out_len - start > 2 && card->out[start] == 0x60) {
+            start++;
+        }
+    }
+    if (card->out_len - start > *response_len) {
+        return 0;
+    }
+    memcpy(response, card->out + start, card->out_len - start);
+    *response_len = card->out_len - start;
+    return 1;
+}
+
+void cardsim_get_stats(const CARDSIM *card, CARDSIM_STATS *stats)
+{
+    *stats = card->stats;
+}
@@ -0,0 +1,52 @@
+#ifndef CARDSIM_H
+#define CARDSIM_H
+
+// In-process card simulator: the unchanged card.c firmware built for the
+// host, one coroutine per card, talking T=0 through a byte pipe.
+// Build with "make libcardsim", link with sim/libcardsim.a.
+//
+// Any number of cards can be open at once. Each has its own EEPROM image,
+// stack and copy of the firmware globals, swapped in when it runs. All
+// calls must come from the same thread.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CARDSIM_EEPROM_SIZE 1024
+#define CARDSIM_MAX_ATR 33
+// Largest response: 256 data bytes and the status word
+#define CARDSIM_MAX_RESPONSE 258
+
+typedef struct cardsim CARDSIM;
+
+typedef struct {
+    unsigned long apdus;
+    unsigned long bytes_in;         // from the reader, headers included
+    unsigned long bytes_out;        // from the card, procedure bytes included
+    unsigned long eeprom_writes;    // EEPROM bytes programmed
+    unsigned long eeprom_write_us;  // their programming time on the ATmega328p
+} CARDSIM_STATS;
+
+// eeprom_path is created (erased, all 0xFF) if missing and kept in sync
+// with the card EEPROM; NULL keeps the EEPROM in memory only.
+// Returns NULL on error.
+CARDSIM *cardsim_open(const char *eeprom_path);
+void cardsim_close(CARDSIM *card);
+
+// Power cycle: RAM is lost, the EEPROM is kept. The ATR is copied to atr
+// (CARDSIM_MAX_ATR bytes) unless atr is NULL. Returns 1 on success.
+int cardsim_reset(CARDSIM *card, uint8_t *atr, size_t *atr_len);
+
+// Sends one T=0 command (CLA INS P1 P2 P3 and the P3 data bytes of an
+// incoming command) and returns the response data and status word, with
+// the procedure byte removed, like SCardTransmit(). *response_len is the
+// size of response on input. A card never yet reset is powered first.
+// Returns 1 on success, 0 if the command is malformed, the response does
+// not fit or the card waits for data the command does not have (the card
+// is then power cycled).
+int cardsim_transmit(CARDSIM *card, const uint8_t *apdu, size_t apdu_len,
+                     uint8_t *response, size_t *response_len);
+
+void cardsim_get_stats(const CARDSIM *card, CARDSIM_STATS *stats);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef CARDSIM_CARD_H
+#define CARDSIM_CARD_H
+
+// Calls from the simulated firmware (sim/host_io.c) into cardsim.c, on the card
+// that is running
+
+#include <stdint.h>
+
+int cardsim_card_input_empty(void);
+uint8_t cardsim_card_receive(void);
+void cardsim_card_send(uint8_t b);
+void cardsim_card_eeprom_written(uint16_t us);
+// Staging area of the flash (boot.h), BOOT_MAX_IMAGE bytes
+uint8_t *cardsim_card_flash(void);
+
+#endif
@@ -0,0 +1,180 @@
+// Load test on simulated cards, run with "make cardsim_load".
+// Personalizes N cards like the assignator and the ATM (ASSIGN_CARD,
+// secret key, PIN), then sends rounds of GET_CARD_INFO, AUTHENTICATE and
+// GET_RESPONSE to every card in turn, checking each signature.
+// Prints host throughput and latency, and what the same traffic costs on
+// the card link and EEPROM.
+//
+// Usage: cardsim_load [cards] [rounds]
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cardsim.h"
+#include "hmac_sha256.h"
+
+#define SIZE_CARD_ID 24
+#define SIZE_PIN 4
+#define SIZE_PUK 4
+#define SIZE_CHALLENGE 32
+#define SIZE_SECRET_KEY 32
+#define SIZE_CARD_INFO (5 + SIZE_CARD_ID)
+
+// Character time on the link at 9600 bps: 12 etu (with guard time) of 104 us
+#define BYTE_US 1250
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Sends an APDU, checks the status word and returns the data length
+static int transmit(CARDSIM *card, const uint8_t *apdu, size_t apdu_len,
+                    uint8_t *response, uint8_t sw1, uint8_t sw2)
+{
+    size_t response_len = CARDSIM_MAX_RESPONSE;
+
+    if (!cardsim_transmit(card, apdu, apdu_len, response, &response_len) || response_len < 2) {
+        return -1;
+    }
+    if (response[response_len - 2] != sw1 || response[response_len - 1] != sw2) {
+        return -1;
+    }
+    return (int)response_len - 2;
+}
+
+static void card_key(int n, uint8_t *key)
+{
+    int i;
+
+    for (i = 0; i < SIZE_SECRET_KEY; i++) {
+        key[i] = (uint8_t)(n * 31 + i);
+    }
+}
+
+static int personalize(CARDSIM *card, int n)
+{
+    uint8_t assign[5 + SIZE_CARD_ID + SIZE_PUK] = {0x80, 0x08, 0x00, 0x00, SIZE_CARD_ID + SIZE_PUK};
+    uint8_t key[6 + SIZE_SECRET_KEY] = {0x80, 0x0A, 0x00, 0x00, 1 + SIZE_SECRET_KEY, 0x00};
+    uint8_t pin[5 + SIZE_PIN] = {0x80, 0x09, 0x00, 0x00, SIZE_PIN, 1, 2, 3, 4};
+    uint8_t response[CARDSIM_MAX_RESPONSE];
+    char id[SIZE_CARD_ID + 1];
+
+    snprintf(id, sizeof(id), "SIMCARD%017d", n);
+    memcpy(assign + 5, id, SIZE_CARD_ID);
+    memset(assign + 5 + SIZE_CARD_ID, 9, SIZE_PUK);
+    card_key(n, key + 6);
+
+    return transmit(card, assign, sizeof(assign), response, 0x90, 0x00) == 0 &&
+           transmit(card, key, sizeof(key), response, 0x90, 0x00) == 0 &&
+           transmit(card, pin, sizeof(pin), response, 0x90, 0x00) == 0;
+}
+
+static int authenticate(CARDSIM *card, int n, int round)
+{
+    uint8_t info[5] = {0x80, 0x10, 0x00, 0x00, SIZE_CARD_INFO};
+    uint8_t auth[5 + SIZE_PIN + SIZE_CHALLENGE] = {0x80, 0x0F, 0x00, 0x00, SIZE_PIN + SIZE_CHALLENGE, 1, 2, 3, 4};
+    uint8_t get_response[5] = {0x00, 0xC0, 0x00, 0x00, HMAC_SHA256_DIGEST_SIZE};
+    uint8_t response[CARDSIM_MAX_RESPONSE];
+    uint8_t key[SIZE_SECRET_KEY];
+    uint8_t expected[HMAC_SHA256_DIGEST_SIZE];
+    int i;
+
+    for (i = 0; i < SIZE_CHALLENGE; i++) {
+        auth[5 + SIZE_PIN + i] = (uint8_t)(round + n + i);
+    }
+
+    if (transmit(card, info, sizeof(info), response, 0x90, 0x00) != SIZE_CARD_INFO ||
+        transmit(card, auth, sizeof(auth), response, 0x61, HMAC_SHA256_DIGEST_SIZE) != 0 ||
+        transmit(card, get_response, sizeof(get_response), response, 0x90, 0x00) != HMAC_SHA256_DIGEST_SIZE) {
+        return 0;
+    }
+
+    card_key(n, key);
+    hmac_sha256(key, SIZE_SECRET_KEY, auth + 5 + SIZE_PIN, SIZE_CHALLENGE, expected);
+    return memcmp(response, expected, HMAC_SHA256_DIGEST_SIZE) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int cards = argc > 1 ? atoi(argv[1]) : 1000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    CARDSIM **sims;
+    CARDSIM_STATS stats;
+    double *latency;
+    double start;
+    double elapsed;
+    double t;
+    unsigned long bytes = 0;
+    unsigned long eeprom_us = 0;
+    long n = 0;
+    int i;
+    int r;
+
+    if (cards < 1 || rounds < 1) {
+        printf("Usage: %s [cards] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    sims = calloc(cards, sizeof(*sims));
+    latency = malloc(sizeof(*latency) * cards * rounds);
+    if (!sims || !latency) {
+        return 1;
+    }
+
+    start = now_us();
+    for (i = 0; i < cards; i++) {
+        sims[i] = cardsim_open(NULL);
+        if (!sims[i] || !cardsim_reset(sims[i], NULL, NULL) || !personalize(sims[i], i)) {
+            printf("Error: personalization of card %d failed\n", i);
+            return 1;
+        }
+    }
+    elapsed = now_us() - start;
+    printf("%d cards personalized in %.1f ms (%.1f us per card)\n", cards, elapsed / 1000, elapsed / cards);
+
+    start = now_us();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < cards; i++) {
+            t = now_us();
+            if (!authenticate(sims[i], i, r)) {
+                printf("Error: authentication %d on card %d failed\n", r, i);
+                return 1;
+            }
+            latency[n++] = now_us() - t;
+        }
+    }
+    elapsed = now_us() - start;
+
+    for (i = 0; i < cards; i++) {
+        cardsim_get_stats(sims[i], &stats);
+        bytes += stats.bytes_in + stats.bytes_out;
+        eeprom_us += stats.eeprom_write_us;
+        cardsim_close(sims[i]);
+    }
+
+    qsort(latency, n, sizeof(*latency), compare_double);
+    printf("%ld authentications (3 APDUs each) in %.1f ms: %.0f per second\n",
+           n, elapsed / 1000, n / (elapsed / 1e6));
+    printf("latency per authentication: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           latency[n / 2], latency[n * 99 / 100], latency[n - 1]);
+    printf("on real cards: %.1f ms of link time and %.1f ms of EEPROM writes per card\n",
+           (double)bytes * BYTE_US / 1000 / cards, (double)eeprom_us / 1000 / cards);
+
+    free(latency);
+    free(sims);
+    return 0;
+}
@@ -0,0 +1,152 @@
+// Host replacement for io.c: the T=0 character functions on the byte pipe
+// of cardsim.c, the registers card.c writes at reset, and the EEPROM
+// controller driven by ee.c. Also replaces flash.c: the staging area is a
+// buffer of cardsim.c, and there is no boot section.
+//
+// Built into the firmware objects, so everything here is per card.
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include "boot.h"
+#include "flash.h"
+#include "cardsim_card.h"
+
+// Programming times of the ATmega328p EEPROM, by EEPM mode
+#define EEPROM_ERASE_WRITE_US 3400
+#define EEPROM_ERASE_ONLY_US 1800
+#define EEPROM_WRITE_ONLY_US 1800
+
+volatile uint8_t ACSR, PRR, PORTB, DDRB, PORTC, DDRC, PORTD, DDRD, ASSR;
+volatile uint16_t EEAR;
+// Timer1 stands still: the GET_STATS timings read 0
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint16_t TCNT1;
+
+// No parity errors on the byte pipe
+volatile uint16_t io_rx_parity_errors = 0;
+volatile uint16_t io_tx_repeats = 0;
+
+static volatile uint8_t eecr;
+static volatile uint8_t eedr;
+static uint8_t in_interrupt = 0;
+
+static uint8_t pushback;
+static uint8_t has_pushback = 0;
+
+extern void EE_READY_vect(void);
+
+// Completes the write started by the interrupt at once
+static void eeprom_program(void)
+{
+    uint8_t *cell = &cardsim_eeprom[EEAR];
+
+    if (!(eecr & (1 << EEPE))) {
+        return;
+    }
+
+    switch ((eecr >> EEPM0) & 3) {
+    case 0:
+        *cell = eedr;
+        cardsim_card_eeprom_written(EEPROM_ERASE_WRITE_US);
+        break;
+    case 1:
+        *cell = 0xFF;
+        cardsim_card_eeprom_written(EEPROM_ERASE_ONLY_US);
+        break;
+    default:
+        *cell &= eedr;
+        cardsim_card_eeprom_written(EEPROM_WRITE_ONLY_US);
+    }
+    eecr &= ~(1 << EEPE);
+}
+
+// Runs the EE_READY interrupt once if it is enabled, returns 0 otherwise
+static uint8_t eeprom_interrupt(void)
+{
+    eeprom_program();
+    if (!(eecr & (1 << EERIE))) {
+        return 0;
+    }
+
+    in_interrupt = 1;
+    EE_READY_vect();
+    in_interrupt = 0;
+    return 1;
+}
+
+// Every access from the firmware lets the interrupt run once, as it would
+// between two instructions
+volatile uint8_t *cardsim_eecr(void)
+{
+    if (!in_interrupt) {
+        eeprom_interrupt();
+    }
+    return &eecr;
+}
+
+volatile uint8_t *cardsim_eedr(void)
+{
+    if (eecr & (1 << EERE)) {
+        eedr = cardsim_eeprom[EEAR];
+        eecr &= ~(1 << EERE);
+    }
+    return &eedr;
+}
+
+// Runs first at reset, where the boot section would copy a pending
+// update: the simulator keeps its firmware, the update is dropped
+void io_init(void)
+{
+    cardsim_eeprom[BOOT_EE_MARK_ADDR] = 0xFF;
+}
+
+void flash_write_staging(uint16_t addr, const uint8_t *data)
+{
+    if (addr < BOOT_STAGING_ADDR || addr >= BOOT_START || (addr & (BOOT_PAGE_SIZE - 1))) {
+        return;
+    }
+    memcpy(cardsim_card_flash() + addr - BOOT_STAGING_ADDR, data, BOOT_PAGE_SIZE);
+}
+
+uint8_t flash_read_staging(uint16_t addr)
+{
+    return cardsim_card_flash()[addr - BOOT_STAGING_ADDR];
+}
+
+void set_etu(uint8_t di)
+{
+    (void)di;
+}
+
+void waitetu(uint8_t n)
+{
+    (void)n;
+}
+
+void sendbytet0(uint8_t b)
+{
+    cardsim_card_send(b);
+}
+
+void unrecbytet0(uint8_t b)
+{
+    pushback = b;
+    has_pushback = 1;
+}
+
+uint8_t recbytet0(void)
+{
+    if (has_pushback) {
+        has_pushback = 0;
+        return pushback;
+    }
+
+    // Queued EEPROM writes finish while the reader is silent
+    if (cardsim_card_input_empty()) {
+        while (eeprom_interrupt());
+    }
+
+    return cardsim_card_receive();
+}
@@ -0,0 +1,348 @@
+// pcsc-lite IFD handler backed by simulated cards (libcardsim), built with
+// "make ifd_cardsim". Each reader declared in reader.conf (see
+// sim/reader.conf.example) runs its own simulated card. DEVICENAME is
+//
+//     <EEPROM image>[:<us per byte>]
+//
+// The card is inserted while the image file exists: moving it away
+// removes the card, moving it (or another image) back inserts it. Every
+// byte on the link, ATR included, waits the given time, 1250 us by default:
+// 12 etu at 9600 bps, the real T=0 timing before PPS. 0 disables the
+// delay.
+//
+// pcscd calls the readers from one thread each. The simulator itself runs
+// one card at a time, under a lock, while the link delays run outside it
+// so that the readers still overlap.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <ifdhandler.h>
+#include "cardsim.h"
+
+#define MAX_READERS 32
+#define DEFAULT_BYTE_US 1250
+#define HEADER_SIZE 5
+
+typedef struct {
+    int used;
+    DWORD lun;
+    char path[256];
+    unsigned long byte_us;
+    CARDSIM *card;          // open while the image is present
+    dev_t dev;              // image the card was opened from
+    ino_t ino;
+    int powered;
+    UCHAR atr[CARDSIM_MAX_ATR];
+    DWORD atr_len;
+} READER;
+
+static READER readers[MAX_READERS];
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static READER *find_reader(DWORD lun)
+{
+    int i;
+
+    for (i = 0; i < MAX_READERS; i++) {
+        if (readers[i].used && readers[i].lun == lun) {
+            return &readers[i];
+        }
+    }
+    return NULL;
+}
+
+// Link time of n bytes, spent outside the simulator lock
+static void link_delay(const READER *reader, unsigned long n)
+{
+    unsigned long us = n * reader->byte_us;
+    struct timespec ts;
+
+    if (us == 0) {
+        return;
+    }
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0);
+}
+
+static void remove_card(READER *reader)
+{
+    cardsim_close(reader->card);
+    reader->card = NULL;
+    reader->powered = 0;
+    reader->atr_len = 0;
+}
+
+// Opens the card when its image appears, closes it when the image goes
+// away or is replaced. Called with sim_lock held.
+static int update_presence(READER *reader)
+{
+    struct stat st;
+
+    if (stat(reader->path, &st) != 0) {
+        if (reader->card) {
+            remove_card(reader);
+        }
+        return 0;
+    }
+
+    if (reader->card && (st.st_dev != reader->dev || st.st_ino != reader->ino)) {
+        remove_card(reader);
+    }
+
+    if (!reader->card) {
+        reader->card = cardsim_open(reader->path);
+        if (!reader->card) {
+            return 0;
+        }
+        reader->dev = st.st_dev;
+        reader->ino = st.st_ino;
+    }
+    return 1;
+}
+
+RESPONSECODE IFDHCreateChannelByName(DWORD Lun, LPSTR DeviceName)
+{
+    READER *reader = NULL;
+    char *latency;
+    int i;
+
+    pthread_mutex_lock(&sim_lock);
+    for (i = 0; i < MAX_READERS && !reader; i++) {
+        if (!readers[i].used) {
+            reader = &readers[i];
+        }
+    }
+    if (!reader || strlen(DeviceName) >= sizeof(reader->path)) {
+        pthread_mutex_unlock(&sim_lock);
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    memset(reader, 0, sizeof(*reader));
+    strcpy(reader->path, DeviceName);
+    reader->byte_us = DEFAULT_BYTE_US;
+    latency = strrchr(reader->path, ':');
+    if (latency) {
+        *latency = '\0';
+        reader->byte_us = strtoul(latency + 1, NULL, 10);
+    }
+    reader->lun = Lun;
+    reader->used = 1;
+    pthread_mutex_unlock(&sim_lock);
+
+    return IFD_SUCCESS;
+}
+
+RESPONSECODE IFDHCreateChannel(DWORD Lun, DWORD Channel)
+{
+    char name[64];
+
+    snprintf(name, sizeof(name), "/var/lib/cardsim/reader%lu.eep", (unsigned long)Channel);
+    return IFDHCreateChannelByName(Lun, name);
+}
+
+RESPONSECODE IFDHCloseChannel(DWORD Lun)
+{
+    READER *reader;
+
+    pthread_mutex_lock(&sim_lock);
+    reader = find_reader(Lun);
+    if (reader) {
+        remove_card(reader);
+        reader->used = 0;
+    }
+    pthread_mutex_unlock(&sim_lock);
+
+    return reader ? IFD_SUCCESS : IFD_COMMUNICATION_ERROR;
+}
+
+RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
+{
+    RESPONSECODE rv = IFD_SUCCESS;
+    READER *reader;
+
+    pthread_mutex_lock(&sim_lock);
+    reader = find_reader(Lun);
+    if (!reader) {
+        pthread_mutex_unlock(&sim_lock);
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    switch (Tag) {
+    case TAG_IFD_ATR:
+    case SCARD_ATTR_ATR_STRING:
+        if (*Length < reader->atr_len) {
+            rv = IFD_ERROR_INSUFFICIENT_BUFFER;
+            break;
+        }
+        memcpy(Value, reader->atr, reader->atr_len);
+        *Length = reader->atr_len;
+        break;
+    case TAG_IFD_SIMULTANEOUS_ACCESS:
+        *Length = 1;
+        *Value = MAX_READERS;
+        break;
+    case TAG_IFD_SLOTS_NUMBER:
+        *Length = 1;
+        *Value = 1;
+        break;
+    case TAG_IFD_THREAD_SAFE:
+        // Readers of this driver may be called at the same time
+        *Length = 1;
+        *Value = 1;
+        break;
+    case TAG_IFD_SLOT_THREAD_SAFE:
+        *Length = 1;
+        *Value = 0;
+        break;
+    default:
+        rv = IFD_ERROR_TAG;
+    }
+    pthread_mutex_unlock(&sim_lock);
+
+    return rv;
+}
+
+RESPONSECODE IFDHSetCapabilities(DWORD Lun, DWORD Tag, DWORD Length, PUCHAR Value)
+{
+    (void)Lun;
+    (void)Tag;
+    (void)Length;
+    (void)Value;
+    return IFD_NOT_SUPPORTED;
+}
+
+// Only T=0, and the link keeps its 9600 bps timing whatever PPS is asked
+RESPONSECODE IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol, UCHAR Flags,
+                                       UCHAR PTS1, UCHAR PTS2, UCHAR PTS3)
+{
+    (void)Lun;
+    (void)Flags;
+    (void)PTS1;
+    (void)PTS2;
+    (void)PTS3;
+    return Protocol == SCARD_PROTOCOL_T0 ? IFD_SUCCESS : IFD_PROTOCOL_NOT_SUPPORTED;
+}
+
+RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
+{
+    READER *reader;
+    uint8_t atr[CARDSIM_MAX_ATR];
+    size_t atr_len;
+
+    pthread_mutex_lock(&sim_lock);
+    reader = find_reader(Lun);
+    if (!reader) {
+        pthread_mutex_unlock(&sim_lock);
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    if (Action == IFD_POWER_DOWN) {
+        reader->powered = 0;
+        reader->atr_len = 0;
+        pthread_mutex_unlock(&sim_lock);
+        return IFD_SUCCESS;
+    }
+
+    if (Action != IFD_POWER_UP && Action != IFD_RESET) {
+        pthread_mutex_unlock(&sim_lock);
+        return IFD_NOT_SUPPORTED;
+    }
+
+    if (!update_presence(reader) || !cardsim_reset(reader->card, atr, &atr_len)) {
+        pthread_mutex_unlock(&sim_lock);
+        *AtrLength = 0;
+        return IFD_ERROR_POWER_ACTION;
+    }
+
+    memcpy(reader->atr, atr, atr_len);
+    reader->atr_len = atr_len;
+    reader->powered = 1;
+    memcpy(Atr, atr, atr_len);
+    *AtrLength = atr_len;
+    pthread_mutex_unlock(&sim_lock);
+
+    link_delay(reader, atr_len);
+    return IFD_SUCCESS;
+}
+
+RESPONSECODE IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci,
+                               PUCHAR TxBuffer, DWORD TxLength,
+                               PUCHAR RxBuffer, PDWORD RxLength,
+                               PSCARD_IO_HEADER RecvPci)
+{
+    READER *reader;
+    CARDSIM_STATS before;
+    CARDSIM_STATS after;
+    size_t response_len = *RxLength;
+    int ok;
+
+    (void)SendPci;
+
+    pthread_mutex_lock(&sim_lock);
+    reader = find_reader(Lun);
+    if (!reader || !reader->powered || !update_presence(reader)) {
+        pthread_mutex_unlock(&sim_lock);
+        *RxLength = 0;
+        return reader ? IFD_ICC_NOT_PRESENT : IFD_COMMUNICATION_ERROR;
+    }
+
+    // Case 4 command: T=0 sends it without Le, the status word then tells
+    // the application to fetch the data with GET RESPONSE
+    if (TxLength > HEADER_SIZE && TxLength == HEADER_SIZE + TxBuffer[4] + 1) {
+        TxLength--;
+    }
+
+    cardsim_get_stats(reader->card, &before);
+    ok = cardsim_transmit(reader->card, TxBuffer, TxLength, RxBuffer, &response_len);
+    cardsim_get_stats(reader->card, &after);
+    pthread_mutex_unlock(&sim_lock);
+
+    link_delay(reader, (after.bytes_in + after.bytes_out) - (before.bytes_in + before.bytes_out));
+
+    if (!ok) {
+        *RxLength = 0;
+        return IFD_COMMUNICATION_ERROR;
+    }
+    *RxLength = response_len;
+    if (RecvPci) {
+        RecvPci->Protocol = SCARD_PROTOCOL_T0;
+        RecvPci->Length = 0;
+    }
+    return IFD_SUCCESS;
+}
+
+RESPONSECODE IFDHICCPresence(DWORD Lun)
+{
+    READER *reader;
+    int present;
+
+    pthread_mutex_lock(&sim_lock);
+    reader = find_reader(Lun);
+    present = reader && update_presence(reader);
+    pthread_mutex_unlock(&sim_lock);
+
+    if (!reader) {
+        return IFD_COMMUNICATION_ERROR;
+    }
+    return present ? IFD_ICC_PRESENT : IFD_ICC_NOT_PRESENT;
+}
+
+RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode, PUCHAR TxBuffer,
+                         DWORD TxLength, PUCHAR RxBuffer, DWORD RxLength,
+                         LPDWORD pdwBytesReturned)
+{
+    (void)Lun;
+    (void)dwControlCode;
+    (void)TxBuffer;
+    (void)TxLength;
+    (void)RxBuffer;
+    (void)RxLength;
+    *pdwBytesReturned = 0;
+    return IFD_ERROR_NOT_SUPPORTED;
+}
@@ -0,0 +1,9 @@
+// Host stand-in for <util/atomic.h>. Nothing preempts the simulated card
+// (see avr/interrupt.h), so the block simply runs once.
+#ifndef CARDSIM_UTIL_ATOMIC_H
+#define CARDSIM_UTIL_ATOMIC_H
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type) for (int cardsim_atomic_ = 1; cardsim_atomic_; cardsim_atomic_ = 0)
+
+#endif
@@ -0,0 +1,300 @@
+// T=1 block transport (ISO 7816-3), built with "make T1=1".
+// Command bytes are read straight from the received I-blocks and response
+// bytes are written into the transmit block, so the card.c handlers run
+// unchanged: the T=0 procedure byte they send first is dropped, and the
+// status word closes the response. Chaining is supported both ways.
+
+#include <stdint.h>
+#include "t1.h"
+
+extern void sendbytet0(uint8_t b);
+extern uint8_t recbytet0(void);
+extern void waitetu(uint8_t n);
+extern uint8_t io_parity_error;
+
+#define T1_PROLOGUE 3
+#define T1_BLOCK_SIZE (T1_PROLOGUE + T1_IFSC + 1)
+#define T1_DEFAULT_IFSD 32
+// Block guard time, in etu, before the card starts sending a block
+#define T1_BGT 22
+
+#define PCB_TYPE_MASK 0xC0
+#define PCB_R_BLOCK 0x80
+#define PCB_S_BLOCK 0xC0
+#define PCB_I_NS 0x40
+#define PCB_I_MORE 0x20
+#define PCB_R_NR 0x10
+#define PCB_R_EDC_ERROR 0x01
+#define PCB_R_OTHER_ERROR 0x02
+#define PCB_S_RESPONSE 0x20
+#define PCB_S_TYPE_MASK 0x1F
+#define S_RESYNCH 0x00
+#define S_IFS 0x01
+#define S_ABORT 0x02
+
+static uint8_t rx[T1_BLOCK_SIZE];          // last block received
+static uint8_t tx[T1_BLOCK_SIZE];          // response being built, then last I-block sent
+static uint8_t ctl[T1_PROLOGUE + 1 + 1];   // R-blocks and S-blocks sent by the card
+
+static uint8_t rx_pos = 0;          // next INF byte of rx to read
+static uint8_t tx_len = 0;          // INF bytes in tx
+static uint8_t tx_sent = 0;         // tx holds a sent block, resent on request
+static uint8_t ns = 0;              // N(S) of the next I-block sent by the card
+static uint8_t nr = 0;              // N(S) expected in the next I-block from the reader
+static uint8_t ifsd = T1_DEFAULT_IFSD;
+static uint8_t in_command = 0;      // between the first command byte and the status word
+static uint8_t reading = 0;         // command blocks may still be waiting
+static uint8_t drop_procedure = 0;  // next t1_sendbyte() is the T=0 procedure byte
+static uint8_t resynched = 0;       // S(RESYNCH) during the command being handled
+
+static void send_block(uint8_t *block)
+{
+    uint8_t i;
+    uint8_t len = T1_PROLOGUE + block[2];
+    uint8_t lrc = 0;
+
+    waitetu(T1_BGT);
+    for (i = 0; i < len; i++) {
+        lrc ^= block[i];
+        sendbytet0(block[i]);
+    }
+    sendbytet0(lrc);
+}
+
+static void send_control(uint8_t pcb, uint8_t inf_len, uint8_t inf)
+{
+    ctl[0] = 0;
+    ctl[1] = pcb;
+    ctl[2] = inf_len;
+    ctl[3] = inf;
+    send_block(ctl);
+}
+
+// R-block asking for the I-block numbered nr (acknowledges the previous one)
+static void send_r_block(uint8_t error)
+{
+    send_control(PCB_R_BLOCK | (nr ? PCB_R_NR : 0) | error, 0, 0);
+}
+
+// Reads one block into rx, returns 0 on parity, LRC or length error
+static uint8_t receive_block(void)
+{
+    uint8_t i;
+    uint8_t b;
+    uint8_t lrc;
+
+    io_parity_error = 0;
+    for (i = 0; i < T1_PROLOGUE; i++) {
+        rx[i] = recbytet0();
+    }
+    lrc = rx[0] ^ rx[1] ^ rx[2];
+
+    // An oversized block is still read to the end to stay in step
+    for (i = 0; i < rx[2]; i++) {
+        b = recbytet0();
+        lrc ^= b;
+        if (i < T1_IFSC) {
+            rx[T1_PROLOGUE + i] = b;
+        }
+    }
+    lrc ^= recbytet0();
+
+    return lrc == 0 && !io_parity_error && rx[2] <= T1_IFSC;
+}
+
+static void handle_s_block(void)
+{
+    if (rx[1] & PCB_S_RESPONSE) {
+        // The card never sends S requests
+        send_r_block(PCB_R_OTHER_ERROR);
+        return;
+    }
+
+    switch (rx[1] & PCB_S_TYPE_MASK) {
+    case S_IFS:
+        if (rx[2] == 1 && rx[3] != 0 && rx[3] != 0xFF) {
+            ifsd = rx[3];
+        }
+        send_control(PCB_S_BLOCK | PCB_S_RESPONSE | S_IFS, 1, rx[3]);
+        break;
+    case S_RESYNCH:
+        ns = 0;
+        nr = 0;
+        tx_sent = 0;
+        tx_len = 0;
+        reading = 0;
+        // The command being read or answered is abandoned with the link
+        // state: its handler reads zeros to the end and its response is
+        // dropped, the reader's next I-block starts a new command
+        if (in_command) {
+            resynched = 1;
+        }
+        ifsd = T1_DEFAULT_IFSD;
+        send_control(PCB_S_BLOCK | PCB_S_RESPONSE | S_RESYNCH, 0, 0);
+        break;
+    case S_ABORT:
+        send_control(PCB_S_BLOCK | PCB_S_RESPONSE | S_ABORT, 0, 0);
+        break;
+    default:
+        send_r_block(PCB_R_OTHER_ERROR);
+    }
+}
+
+// Waits for the next I-block from the reader. An R-block from the reader
+// repeats the card's last block: the acknowledgement while a command chain
+// is read, otherwise the last response block.
+static void receive_iblock(uint8_t chaining)
+{
+    for (;;) {
+        if (!receive_block()) {
+            send_r_block(PCB_R_EDC_ERROR);
+            continue;
+        }
+
+        switch (rx[1] & PCB_TYPE_MASK) {
+        case PCB_S_BLOCK:
+            handle_s_block();
+            if (resynched) {
+                return;
+            }
+            break;
+        case PCB_R_BLOCK:
+            if (chaining) {
+                send_r_block(0);
+            } else if (tx_sent) {
+                send_block(tx);
+            } else {
+                send_r_block(PCB_R_OTHER_ERROR);
+            }
+            break;
+        default:
+            if (((rx[1] & PCB_I_NS) ? 1 : 0) != nr) {
+                send_r_block(PCB_R_OTHER_ERROR);
+                break;
+            }
+            nr ^= 1;
+            rx_pos = 0;
+            return;
+        }
+    }
+}
+
+static void next_command_block(void)
+{
+    send_r_block(0);
+    receive_iblock(1);
+}
+
+// Acknowledges and skips command blocks the handler did not read
+static void finish_command(void)
+{
+    while (!resynched && (rx[1] & PCB_I_MORE)) {
+        next_command_block();
+    }
+    reading = 0;
+}
+
+// Sends tx as a chained block and waits until the reader acknowledges it
+static void send_chained_block(void)
+{
+    tx[0] = 0;
+    tx[1] = (ns ? PCB_I_NS : 0) | PCB_I_MORE;
+    tx[2] = tx_len;
+    send_block(tx);
+
+    for (;;) {
+        if (!receive_block()) {
+            send_r_block(PCB_R_EDC_ERROR);
+            continue;
+        }
+
+        switch (rx[1] & PCB_TYPE_MASK) {
+        case PCB_R_BLOCK:
+            if (((rx[1] & PCB_R_NR) ? 1 : 0) != ns) {
+                ns ^= 1;
+                tx_len = 0;
+                return;
+            }
+            send_block(tx);
+            break;
+        case PCB_S_BLOCK:
+            handle_s_block();
+            if (resynched) {
+                tx_len = 0;
+                return;
+            }
+            break;
+        default:
+            send_r_block(PCB_R_OTHER_ERROR);
+        }
+    }
+}
+
+uint8_t t1_recbyte(void)
+{
+    if (!in_command) {
+        receive_iblock(0);
+        // The reader got the last response, a new one starts
+        tx_sent = 0;
+        tx_len = 0;
+        in_command = 1;
+        reading = 1;
+        drop_procedure = 1;
+    }
+
+    while (!resynched && rx_pos == rx[2]) {
+        // Past the end of the command: reads as 0, like a missing P3
+        if (!reading || !(rx[1] & PCB_I_MORE)) {
+            return 0;
+        }
+        next_command_block();
+    }
+
+    // rx holds the S-block after a resynchronization
+    return resynched ? 0 : rx[T1_PROLOGUE + rx_pos++];
+}
+
+void t1_sendbyte(uint8_t b)
+{
+    uint8_t max_len = ifsd < T1_IFSC ? ifsd : T1_IFSC;
+
+    if (resynched) {
+        return;
+    }
+
+    if (drop_procedure) {
+        drop_procedure = 0;
+        return;
+    }
+
+    if (reading) {
+        finish_command();
+    }
+
+    if (tx_len == max_len) {
+        send_chained_block();
+    }
+    tx[T1_PROLOGUE + tx_len++] = b;
+}
+
+void t1_send_status(uint8_t sw1, uint8_t sw2)
+{
+    if (resynched) {
+        resynched = 0;
+        drop_procedure = 0;
+        in_command = 0;
+        return;
+    }
+
+    drop_procedure = 0;
+    t1_sendbyte(sw1);
+    t1_sendbyte(sw2);
+
+    tx[0] = 0;
+    tx[1] = ns ? PCB_I_NS : 0;
+    tx[2] = tx_len;
+    send_block(tx);
+    ns ^= 1;
+    tx_sent = 1;
+    in_command = 0;
+}
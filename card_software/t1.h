@@ -0,0 +1,16 @@
+#ifndef T1_H
+#define T1_H
+
+#include <stdint.h>
+
+// Card information field size, advertised in TA3. Every command up to
+// APPEND_HISTORY (5 header + 56 data bytes) fits in one block; the larger
+// ones, LOAD_FIRMWARE (5 + 128) and SIGN_BATCH (5 + up to 224), come
+// chained and are read block by block, so rx and tx stay IFSC + 4 bytes.
+#define T1_IFSC 72
+
+uint8_t t1_recbyte(void);
+void t1_sendbyte(uint8_t b);
+void t1_send_status(uint8_t sw1, uint8_t sw2);
+
+#endif
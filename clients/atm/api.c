@@ -1,33 +1,125 @@
 #include "api.h"
+#include "json.h"
 #include <curl/curl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
-struct memory_struct {
-    char *memory;
+// Responses are parsed while they arrive (json.h) instead of being
+// buffered and searched: only their first bytes are kept, for the error
+// messages.
+#define API_EXCERPT_SIZE 256
+
+struct api_response {
+    JSON_PARSER parser;
+    char excerpt[API_EXCERPT_SIZE];
+    size_t excerpt_len;
+};
+
+// Member of the top-level object of a response: a string copied into
+// buffer (size bytes with the NUL), or a number read into number
+struct api_field {
+    const char *key;
+    char *buffer;
     size_t size;
+    long *number;
+    int found;
 };
 
+// Requests reuse the handles of a small pool instead of creating one each:
+// curl keeps their connections open between requests (HTTP keep-alive),
+// and the share gives every handle the DNS cache, TLS sessions and open
+// connections of the others. A card session then pays the TCP and TLS
+// handshakes once.
+#define API_POOL_SIZE 4
+#define API_KEEPALIVE_IDLE 30L
+
 static char api_base_url[256] = "";
+static CURLSH *share = NULL;
+static CURLM *multi = NULL;
+static CURL *pool[API_POOL_SIZE];
+static int pool_busy[API_POOL_SIZE];
+
+// api_login() also runs on the token refresh thread (token.c): the pool
+// and the share are locked, the rest is used by the main thread only
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
 
 static size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp)
 {
     size_t realsize = size * nmemb;
-    struct memory_struct *mem = (struct memory_struct *)userp;
+    struct api_response *response = (struct api_response *)userp;
+    size_t excerpt = API_EXCERPT_SIZE - 1 - response->excerpt_len;
 
-    char *ptr = realloc(mem->memory, mem->size + realsize + 1);
-    if (!ptr) {
-        return 0;
+    if (excerpt > realsize) {
+        excerpt = realsize;
     }
+    memcpy(response->excerpt + response->excerpt_len, contents, excerpt);
+    response->excerpt_len += excerpt;
+    response->excerpt[response->excerpt_len] = '\0';
 
-    mem->memory = ptr;
-    memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = 0;
+    // Invalid JSON stops the parser, not the transfer: the status code and
+    // the excerpt still tell what happened
+    json_feed(&response->parser, contents, realsize);
 
     return realsize;
 }
 
+static void response_init(struct api_response *response, JSON_CALLBACK callback, void *user)
+{
+    json_init(&response->parser, callback, user);
+    response->excerpt[0] = '\0';
+    response->excerpt_len = 0;
+}
+
+static int copy_string(char *buffer, size_t size, const char *value, size_t len)
+{
+    if (len >= size) {
+        return 0;
+    }
+    memcpy(buffer, value, len + 1);
+    return 1;
+}
+
+// Callback for an array of struct api_field, ended by a NULL key
+static void fields_callback(JSON_PARSER *parser, JSON_EVENT event, const char *value, size_t len)
+{
+    struct api_field *field;
+
+    if (parser->depth != 1) {
+        return;
+    }
+    for (field = parser->user; field->key; field++) {
+        if (strcmp(field->key, json_key(parser, 1)) != 0) {
+            continue;
+        }
+        if (event == JSON_STRING && field->buffer && !parser->truncated) {
+            if (copy_string(field->buffer, field->size, value, len)) {
+                field->found = 1;
+            }
+        } else if (event == JSON_NUMBER && field->number) {
+            *field->number = strtol(value, NULL, 10);
+            field->found = 1;
+        }
+    }
+}
+
+// Decodes the first size bytes of a hex string
+static int hex_decode(const char *hex, size_t len, unsigned char *out, size_t size)
+{
+    if (len < 2 * size) {
+        return 0;
+    }
+    for (size_t i = 0; i < size; i++) {
+        if (sscanf(hex + 2*i, "%2hhx", &out[i]) != 1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
 static void base64_encode(const unsigned char *input, size_t input_len, char *output, size_t output_size)
@@ -79,641 +171,689 @@ static void base64_encode(const unsigned char *input, size_t input_len, char *ou
     output[j] = '\0';
 }
 
-int api_init(const char *api_url)
+// Options every request starts from
+static void set_defaults(CURL *curl)
 {
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    strncpy(api_base_url, api_url, sizeof(api_base_url) - 1);
-    api_base_url[sizeof(api_base_url) - 1] = '\0';
-    return 1;
+    if (share) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    }
+    curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, API_KEEPALIVE_IDLE);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, API_KEEPALIVE_IDLE);
 }
 
-void api_cleanup()
+// Free pool handle with its options reset (its connections stay open), or
+// a handle of its own if the pool is busy. Give it back with api_release().
+static CURL *api_acquire(void)
 {
-    curl_global_cleanup();
+    CURL *curl = NULL;
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    for (i = 0; i < API_POOL_SIZE; i++) {
+        if (pool[i] && !pool_busy[i]) {
+            pool_busy[i] = 1;
+            curl = pool[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (curl) {
+        curl_easy_reset(curl);
+        set_defaults(curl);
+        return curl;
+    }
+
+    curl = curl_easy_init();
+    if (curl) {
+        set_defaults(curl);
+    }
+    return curl;
 }
 
-int api_login(const char *username, const char *password, char *token_buffer, size_t buffer_size)
+static void api_release(CURL *curl)
 {
-    CURL *curl;
-    CURLcode res;
-    char url[512];
-    char postdata[256];
-    struct memory_struct chunk;
-    int success = 0;
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    for (i = 0; i < API_POOL_SIZE; i++) {
+        if (pool[i] == curl) {
+            pool_busy[i] = 0;
+            pthread_mutex_unlock(&pool_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    curl_easy_cleanup(curl);
+}
 
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+    (void)handle;
+    (void)access;
+    (void)userptr;
+    pthread_mutex_lock(&share_locks[data]);
+}
 
-    snprintf(url, sizeof(url), "%s/auth/login", api_base_url);
-    snprintf(postdata, sizeof(postdata), "{\"username\":\"%s\",\"password\":\"%s\"}", username, password);
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+    (void)handle;
+    (void)userptr;
+    pthread_mutex_unlock(&share_locks[data]);
+}
 
-    curl = curl_easy_init();
-    if (curl) {
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postdata);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
-
-        res = curl_easy_perform(curl);
-
-        if (res == CURLE_OK) {
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-            if (response_code == 200) {
-                char *token_start = strstr(chunk.memory, "\"token\":\"");
-                if (token_start) {
-                    token_start += 9;
-                    char *token_end = strchr(token_start, '"');
-                    if (token_end) {
-                        size_t token_len = token_end - token_start;
-                        if (token_len < buffer_size) {
-                            strncpy(token_buffer, token_start, token_len);
-                            token_buffer[token_len] = '\0';
-                            success = 1;
-                        }
-                    }
-                }
-            }
+// Endpoints of the API: every request goes through api_request(), or
+// request_start() on the multi handle, with one of these
+enum api_endpoint_id {
+    API_LOGIN,
+    API_CHALLENGE,
+    API_CARD_AUTH,
+    API_CARD_AUTH_COUNTER,
+    API_VOUCHER,
+    API_HISTORY,
+    API_RECEIPTS,
+    API_CARD_LOGIN,
+    API_USER_BY_CARD,
+    API_CARD,
+    API_CARD_UPDATE,
+    API_TRANSACTIONS,
+    API_BALANCE
+};
+
+struct api_endpoint {
+    const char *method;
+    const char *path;       // format of the arguments given to api_request()
+    long timeout;
+    const char *name;       // for the error messages, NULL to fail silently
+};
+
+static const struct api_endpoint endpoints[] = {
+    [API_LOGIN]             = {"POST",  "/auth/login",                 5L,  NULL},
+    [API_CHALLENGE]         = {"GET",   "/auth/challenge?card_id=%s",  5L,  "Challenge request"},
+    [API_CARD_AUTH]         = {"POST",  "/auth/card",                  5L,  "Card auth"},
+    [API_CARD_AUTH_COUNTER] = {"POST",  "/auth/card/counter",          5L,  "Card auth"},
+    [API_VOUCHER]           = {"POST",  "/card/%s/voucher",            5L,  NULL},
+    [API_HISTORY]           = {"GET",   "/card/%s/history?after=%lu",  5L,  NULL},
+    [API_RECEIPTS]          = {"POST",  "/transactions/offline",       10L, "Receipt upload"},
+    [API_CARD_LOGIN]        = {"POST",  "/auth/card",                  5L,  "Card login"},
+    [API_USER_BY_CARD]      = {"GET",   "/user?card_id=%s",            5L,  NULL},
+    [API_CARD]              = {"GET",   "/card/%s",                    5L,  "Card status"},
+    [API_CARD_UPDATE]       = {"PATCH", "/card/%s",                    5L,  NULL},
+    [API_TRANSACTIONS]      = {"GET",   "/transactions",               5L,  NULL},
+    [API_BALANCE]           = {"GET",   "/user/%s/balance",            5L,  NULL},
+};
+
+// Header lists are built once per token and kept: curl only reads them,
+// so their nodes live here instead of being appended and freed for each
+// request. A card session uses two tokens (card and driver); a new token
+// takes the least recently used entry.
+#define API_HEADER_CACHE 4
+#define API_AUTH_HEADER_SIZE 600
+#define API_BEARER "Authorization: Bearer "
+
+struct api_headers {
+    char auth[API_AUTH_HEADER_SIZE];
+    struct curl_slist bearer;       // auth
+    struct curl_slist json;         // Content-Type, then auth
+    unsigned long used;
+};
+
+static char content_type[] = "Content-Type: application/json";
+static struct curl_slist json_headers = {content_type, NULL};
+static struct api_headers header_cache[API_HEADER_CACHE];
+static unsigned long header_clock = 0;
+
+static struct api_headers *cached_headers(const char *token)
+{
+    struct api_headers *entry = &header_cache[0];
+    int i;
+
+    for (i = 0; i < API_HEADER_CACHE; i++) {
+        if (header_cache[i].used && strcmp(header_cache[i].auth + sizeof(API_BEARER) - 1, token) == 0) {
+            header_cache[i].used = ++header_clock;
+            return &header_cache[i];
         }
+        if (header_cache[i].used < entry->used) {
+            entry = &header_cache[i];
+        }
+    }
+
+    snprintf(entry->auth, sizeof(entry->auth), API_BEARER "%s", token);
+    entry->bearer.data = entry->auth;
+    entry->bearer.next = NULL;
+    entry->json.data = content_type;
+    entry->json.next = &entry->bearer;
+    entry->used = ++header_clock;
+    return entry;
+}
+
+// Session arena for the request bodies too large for the stack (receipt
+// batches): allocated once by api_init(), emptied by the call using it
+#define API_ARENA_SIZE 32768
 
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
+static char *arena = NULL;
+static size_t arena_used = 0;
+
+static char *arena_alloc(size_t size)
+{
+    char *ptr;
+
+    if (!arena || size > API_ARENA_SIZE - arena_used) {
+        return NULL;
     }
+    ptr = arena + arena_used;
+    arena_used += size;
+    return ptr;
+}
 
-    free(chunk.memory);
-    return success;
+// Sets curl up for an endpoint: URL from its path and args, body (NULL for
+// a GET) and the cached header list of token (NULL for none). url must
+// stay valid until the request is done.
+static void api_setup(CURL *curl, int id, char *url, size_t url_size, const char *token, const char *body, struct api_response *response, va_list args)
+{
+    const struct api_endpoint *endpoint = &endpoints[id];
+    size_t len;
+
+    len = snprintf(url, url_size, "%s", api_base_url);
+    if (len < url_size) {
+        vsnprintf(url + len, url_size - len, endpoint->path, args);
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+
+    if (body) {
+        if (strcmp(endpoint->method, "POST") != 0) {
+            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, endpoint->method);
+        }
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, token ? &cached_headers(token)->json : &json_headers);
+    } else if (token) {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, &cached_headers(token)->bearer);
+    }
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)response);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, endpoint->timeout);
 }
 
-int api_get_challenge(const char *card_id, char *challenge_buffer, size_t buffer_size)
+static void api_report(int id, const char *url, CURLcode res, long status, const struct api_response *response)
+{
+    const struct api_endpoint *endpoint = &endpoints[id];
+
+    if (!endpoint->name) {
+        return;
+    }
+    if (res != CURLE_OK) {
+        fprintf(stderr, "%s CURL error: %s\n", endpoint->name, curl_easy_strerror(res));
+    } else if (status != 200) {
+        fprintf(stderr, "%s failed: %s %s returned HTTP %ld\n", endpoint->name, endpoint->method, url, status);
+        fprintf(stderr, "Response: %s\n", response->excerpt);
+    }
+}
+
+// Runs one request with the path arguments of the endpoint and returns
+// its HTTP status, 0 if there was no answer. response must be initialized.
+static long api_request(int id, const char *token, const char *body, struct api_response *response, ...)
 {
     CURL *curl;
     CURLcode res;
     char url[512];
-    struct memory_struct chunk;
-    int success = 0;
+    long status = 0;
+    va_list args;
 
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+    curl = api_acquire();
+    if (!curl) {
+        return 0;
+    }
 
-    snprintf(url, sizeof(url), "%s/auth/challenge?card_id=%s", api_base_url, card_id);
+    va_start(args, response);
+    api_setup(curl, id, url, sizeof(url), token, body, response, args);
+    va_end(args);
 
-    curl = curl_easy_init();
-    if (curl) {
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
-
-        res = curl_easy_perform(curl);
-
-        if (res == CURLE_OK) {
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-            if (response_code == 200) {
-                char *challenge_start = strstr(chunk.memory, "\"challenge\":\"");
-                if (challenge_start) {
-                    challenge_start += 13;
-                    char *challenge_end = strchr(challenge_start, '"');
-                    if (challenge_end) {
-                        size_t challenge_len = challenge_end - challenge_start;
-                        if (challenge_len < buffer_size) {
-                            strncpy(challenge_buffer, challenge_start, challenge_len);
-                            challenge_buffer[challenge_len] = '\0';
-                            success = 1;
-                        }
-                    }
-                }
-            } else {
-                fprintf(stderr, "Challenge request failed: GET %s returned HTTP %ld\n", url, response_code);
-                fprintf(stderr, "Response: %s\n", chunk.memory);
-            }
-        } else {
-            fprintf(stderr, "Challenge request CURL error: %s\n", curl_easy_strerror(res));
+    res = curl_easy_perform(curl);
+    if (res == CURLE_OK) {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    }
+    api_release(curl);
+
+    api_report(id, url, res, status, response);
+    return status;
+}
+
+int api_init(const char *api_url)
+{
+    int i;
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    strncpy(api_base_url, api_url, sizeof(api_base_url) - 1);
+    api_base_url[sizeof(api_base_url) - 1] = '\0';
+
+    // Without the share, each handle still keeps its own connection alive
+    share = curl_share_init();
+    if (share) {
+        for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+            pthread_mutex_init(&share_locks[i], NULL);
         }
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+    }
 
-        curl_easy_cleanup(curl);
+    for (i = 0; i < API_POOL_SIZE; i++) {
+        pool[i] = curl_easy_init();
+        pool_busy[i] = 0;
     }
+    multi = curl_multi_init();
+    arena = malloc(API_ARENA_SIZE);
+    arena_used = 0;
+    return 1;
+}
 
-    free(chunk.memory);
-    return success;
+void api_cleanup()
+{
+    int i;
+
+    for (i = 0; i < API_POOL_SIZE; i++) {
+        if (pool[i]) {
+            curl_easy_cleanup(pool[i]);
+            pool[i] = NULL;
+        }
+    }
+    if (multi) {
+        curl_multi_cleanup(multi);
+        multi = NULL;
+    }
+    if (share) {
+        curl_share_cleanup(share);
+        share = NULL;
+        for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+            pthread_mutex_destroy(&share_locks[i]);
+        }
+    }
+    free(arena);
+    arena = NULL;
+    curl_global_cleanup();
 }
 
-int api_card_auth_with_signature(const char *card_id, const char *challenge, const unsigned char *signature, size_t signature_len, char *token_buffer, size_t buffer_size)
+int api_login(const char *username, const char *password, char *token_buffer, size_t buffer_size)
 {
-    CURL *curl;
-    CURLcode res;
-    char url[512];
-    char postdata[2048];
-    struct memory_struct chunk;
-    int success = 0;
+    char postdata[256];
+    struct api_response response;
+    struct api_field fields[] = {{"token", token_buffer, buffer_size, NULL, 0}, {NULL}};
+
+    snprintf(postdata, sizeof(postdata), "{\"username\":\"%s\",\"password\":\"%s\"}", username, password);
+    response_init(&response, fields_callback, fields);
+
+    return api_request(API_LOGIN, NULL, postdata, &response) == 200 &&
+           json_finish(&response.parser) && fields[0].found;
+}
+
+int api_get_challenge(const char *card_id, char *challenge_buffer, size_t buffer_size)
+{
+    struct api_response response;
+    struct api_field fields[] = {{"challenge", challenge_buffer, buffer_size, NULL, 0}, {NULL}};
 
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+    response_init(&response, fields_callback, fields);
 
+    return api_request(API_CHALLENGE, NULL, NULL, &response, card_id) == 200 &&
+           json_finish(&response.parser) && fields[0].found;
+}
+
+int api_card_auth_with_signature(const char *card_id, const char *challenge, const unsigned char *signature, size_t signature_len, char *token_buffer, size_t buffer_size)
+{
+    char postdata[2048];
     char signature_b64[512];
-    base64_encode(signature, signature_len, signature_b64, sizeof(signature_b64));
+    struct api_response response;
+    struct api_field fields[] = {{"token", token_buffer, buffer_size, NULL, 0}, {NULL}};
 
-    snprintf(url, sizeof(url), "%s/auth/card", api_base_url);
+    base64_encode(signature, signature_len, signature_b64, sizeof(signature_b64));
     snprintf(postdata, sizeof(postdata), "{\"card_id\":\"%s\",\"challenge\":\"%s\",\"signature\":\"%s\"}", card_id, challenge, signature_b64);
+    response_init(&response, fields_callback, fields);
 
-    curl = curl_easy_init();
-    if (curl) {
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postdata);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
-
-        res = curl_easy_perform(curl);
-
-        if (res == CURLE_OK) {
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-            if (response_code == 200) {
-                char *token_start = strstr(chunk.memory, "\"token\":\"");
-                if (token_start) {
-                    token_start += 9;
-                    char *token_end = strchr(token_start, '"');
-                    if (token_end) {
-                        size_t token_len = token_end - token_start;
-                        if (token_len < buffer_size) {
-                            strncpy(token_buffer, token_start, token_len);
-                            token_buffer[token_len] = '\0';
-                            success = 1;
-                        }
-                    }
-                }
-            } else {
-                fprintf(stderr, "Card auth failed: POST %s returned HTTP %ld\n", url, response_code);
-                fprintf(stderr, "Response: %s\n", chunk.memory);
-            }
-        } else {
-            fprintf(stderr, "Card auth CURL error: %s\n", curl_easy_strerror(res));
-        }
+    return api_request(API_CARD_AUTH, NULL, postdata, &response) == 200 &&
+           json_finish(&response.parser) && fields[0].found;
+}
 
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
+int api_card_auth_with_counter(const char *card_id, unsigned long counter, const unsigned char *nonce, unsigned long timestamp, const unsigned char *signature, size_t signature_len, char *token_buffer, size_t buffer_size)
+{
+    char postdata[2048];
+    char signature_b64[512];
+    char nonce_hex[2 * API_NONCE_SIZE + 1];
+    struct api_response response;
+    struct api_field fields[] = {{"token", token_buffer, buffer_size, NULL, 0}, {NULL}};
+
+    base64_encode(signature, signature_len, signature_b64, sizeof(signature_b64));
+    for (size_t i = 0; i < API_NONCE_SIZE; i++) {
+        sprintf(nonce_hex + 2*i, "%02x", nonce[i]);
     }
+    snprintf(postdata, sizeof(postdata), "{\"card_id\":\"%s\",\"counter\":%lu,\"nonce\":\"%s\",\"timestamp\":%lu,\"signature\":\"%s\"}", card_id, counter, nonce_hex, timestamp, signature_b64);
+    response_init(&response, fields_callback, fields);
 
-    free(chunk.memory);
-    return success;
+    return api_request(API_CARD_AUTH_COUNTER, NULL, postdata, &response) == 200 &&
+           json_finish(&response.parser) && fields[0].found;
 }
 
-int api_card_login(const char *card_id, const char *pin, char *token_buffer, size_t buffer_size)
+// Offline voucher for the card (epoch, amount, HMAC), to load on the card
+// while its PIN is verified
+int api_get_voucher(const char *card_id, const char *card_token, unsigned char *voucher, size_t voucher_size)
 {
-    CURL *curl;
-    CURLcode res;
-    char url[512];
-    char postdata[256];
-    struct memory_struct chunk;
-    int success = 0;
+    char hex[256];
+    struct api_response response;
+    struct api_field fields[] = {{"voucher", hex, sizeof(hex), NULL, 0}, {NULL}};
 
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+    response_init(&response, fields_callback, fields);
 
-    snprintf(url, sizeof(url), "%s/auth/card", api_base_url);
-    snprintf(postdata, sizeof(postdata), "{\"card_id\":\"%s\",\"pin\":\"%s\"}", card_id, pin);
+    return api_request(API_VOUCHER, card_token, "{}", &response, card_id) == 200 &&
+           json_finish(&response.parser) && fields[0].found &&
+           hex_decode(hex, strlen(hex), voucher, voucher_size);
+}
 
-    curl = curl_easy_init();
-    if (curl) {
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postdata);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
-
-        res = curl_easy_perform(curl);
-
-        if (res == CURLE_OK) {
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-            if (response_code == 200) {
-                char *token_start = strstr(chunk.memory, "\"token\":\"");
-                if (token_start) {
-                    token_start += 9;
-                    char *token_end = strchr(token_start, '"');
-                    if (token_end) {
-                        size_t token_len = token_end - token_start;
-                        if (token_len < buffer_size) {
-                            strncpy(token_buffer, token_start, token_len);
-                            token_buffer[token_len] = '\0';
-                            success = 1;
-                        }
-                    }
-                }
-            } else {
-                fprintf(stderr, "Card login failed: POST %s returned HTTP %ld\n", url, response_code);
-                fprintf(stderr, "Response: %s\n", chunk.memory);
-            }
-        } else {
-            fprintf(stderr, "Card login CURL error: %s\n", curl_easy_strerror(res));
-        }
+// Entries of the "entries" array of a history response, decoded as they
+// arrive; a malformed one stops the decoding
+struct history_parse {
+    unsigned char *entries;
+    size_t entry_size;
+    int max_entries;
+    int *count;
+    int invalid;
+};
 
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
+static void history_callback(JSON_PARSER *parser, JSON_EVENT event, const char *value, size_t len)
+{
+    struct history_parse *history = parser->user;
+
+    if (event != JSON_STRING || parser->depth != 3 ||
+        strcmp(json_key(parser, 1), "entries") != 0 || strcmp(json_key(parser, 3), "entry") != 0) {
+        return;
+    }
+    if (history->invalid || *history->count >= history->max_entries) {
+        return;
     }
+    if (!hex_decode(value, len, history->entries + *history->count * history->entry_size, history->entry_size)) {
+        history->invalid = 1;
+        return;
+    }
+    (*history->count)++;
+}
+
+// Signed history entries newer than index after, oldest first, each
+// entry_size bytes (entry then HMAC) into entries
+int api_fetch_history(const char *card_id, const char *card_token, unsigned long after, unsigned char *entries, size_t entry_size, int max_entries, int *count)
+{
+    struct history_parse history = {entries, entry_size, max_entries, count, 0};
+    struct api_response response;
 
-    free(chunk.memory);
-    return success;
+    *count = 0;
+    response_init(&response, history_callback, &history);
+
+    return api_request(API_HISTORY, card_token, NULL, &response, card_id, after) == 200 &&
+           json_finish(&response.parser) && !history.invalid;
 }
 
-int fetch_user_by_card(const char *card_id, const char *driver_token, char *name_buffer, size_t buffer_size)
+// Uploads count offline receipts (hex) of one card in one request. Returns
+// 1 once the API has answered for all of them, settled or refused.
+int api_upload_receipts(const char *card_id, const char *token, char **receipts, int count)
 {
-    CURL *curl;
-    CURLcode res;
-    char url[512];
-    char auth_header[600];
-    struct memory_struct chunk;
-    int success = 0;
+    struct api_response response;
+    char *postdata;
+    size_t size = 64 + strlen(card_id);
+    size_t len;
+    int ok;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        size += strlen(receipts[i]) + 3;
+    }
+    postdata = arena_alloc(size);
+    if (!postdata) {
+        fprintf(stderr, "Receipt upload: %d receipts do not fit in %d bytes\n", count, API_ARENA_SIZE);
+        return 0;
+    }
+    len = snprintf(postdata, size, "{\"card_id\":\"%s\",\"receipts\":[", card_id);
+    for (i = 0; i < count; i++) {
+        len += snprintf(postdata + len, size - len, "%s\"%s\"", i ? "," : "", receipts[i]);
+    }
+    snprintf(postdata + len, size - len, "]}");
 
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+    response_init(&response, NULL, NULL);
 
-    snprintf(url, sizeof(url), "%s/user?card_id=%s", api_base_url, card_id);
-    snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", driver_token);
+    ok = api_request(API_RECEIPTS, token, postdata, &response) == 200;
+    arena_used = 0;
+    return ok;
+}
 
-    curl = curl_easy_init();
-    if (curl) {
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, auth_header);
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
-
-        res = curl_easy_perform(curl);
-
-        if (res == CURLE_OK) {
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-            if (response_code == 200) {
-                char *name_start = strstr(chunk.memory, "\"name\":\"");
-                if (name_start) {
-                    name_start += 8;
-                    char *name_end = strchr(name_start, '"');
-                    if (name_end) {
-                        size_t name_len = name_end - name_start;
-                        if (name_len < buffer_size) {
-                            strncpy(name_buffer, name_start, name_len);
-                            name_buffer[name_len] = '\0';
-                            success = 1;
-                        }
-                    }
-                }
-            }
-        }
+int api_card_login(const char *card_id, const char *pin, char *token_buffer, size_t buffer_size)
+{
+    char postdata[256];
+    struct api_response response;
+    struct api_field fields[] = {{"token", token_buffer, buffer_size, NULL, 0}, {NULL}};
 
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
-    }
+    snprintf(postdata, sizeof(postdata), "{\"card_id\":\"%s\",\"pin\":\"%s\"}", card_id, pin);
+    response_init(&response, fields_callback, fields);
 
-    free(chunk.memory);
-    return success;
+    return api_request(API_CARD_LOGIN, NULL, postdata, &response) == 200 &&
+           json_finish(&response.parser) && fields[0].found;
 }
 
-int get_card_status(const char *card_id, const char *driver_token, char *status_buffer, size_t buffer_size)
+int fetch_user_by_card(const char *card_id, const char *driver_token, char *name_buffer, size_t buffer_size)
 {
-    CURL *curl;
-    CURLcode res;
-    char url[512];
-    char auth_header[600];
-    struct memory_struct chunk;
-    int success = 0;
+    struct api_response response;
+    struct api_field fields[] = {{"name", name_buffer, buffer_size, NULL, 0}, {NULL}};
 
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+    response_init(&response, fields_callback, fields);
 
-    snprintf(url, sizeof(url), "%s/card/%s", api_base_url, card_id);
-    snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", driver_token);
+    return api_request(API_USER_BY_CARD, driver_token, NULL, &response, card_id) == 200 &&
+           json_finish(&response.parser) && fields[0].found;
+}
 
-    curl = curl_easy_init();
-    if (curl) {
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, auth_header);
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
-
-        res = curl_easy_perform(curl);
-
-        if (res == CURLE_OK) {
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-            if (response_code == 200) {
-                char *status_start = strstr(chunk.memory, "\"status\":\"");
-                if (status_start) {
-                    status_start += 10;
-                    char *status_end = strchr(status_start, '"');
-                    if (status_end) {
-                        size_t status_len = status_end - status_start;
-                        if (status_len < buffer_size) {
-                            strncpy(status_buffer, status_start, status_len);
-                            status_buffer[status_len] = '\0';
-                            success = 1;
-                        }
-                    }
-                }
-            } else {
-                fprintf(stderr, "API Error: GET %s returned HTTP %ld\n", url, response_code);
-                fprintf(stderr, "Response: %s\n", chunk.memory);
-            }
-        } else {
-            fprintf(stderr, "CURL Error: %s\n", curl_easy_strerror(res));
-        }
+int get_card_status(const char *card_id, const char *driver_token, char *status_buffer, size_t buffer_size)
+{
+    struct api_response response;
+    struct api_field fields[] = {{"status", status_buffer, buffer_size, NULL, 0}, {NULL}};
 
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
-    }
+    response_init(&response, fields_callback, fields);
 
-    free(chunk.memory);
-    return success;
+    return api_request(API_CARD, driver_token, NULL, &response, card_id) == 200 &&
+           json_finish(&response.parser) && fields[0].found;
 }
 
 int update_card_status(const char *card_id, const char *admin_token, const char *status)
 {
-    CURL *curl;
-    CURLcode res;
-    char url[512];
     char postdata[128];
-    char auth_header[600];
-    struct memory_struct chunk;
-    int success = 0;
+    struct api_response response;
 
-    chunk.memory = malloc(1);
-    chunk.size = 0;
-
-    snprintf(url, sizeof(url), "%s/card/%s", api_base_url, card_id);
     snprintf(postdata, sizeof(postdata), "{\"status\":\"%s\"}", status);
-    snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", admin_token);
+    response_init(&response, NULL, NULL);
 
-    curl = curl_easy_init();
-    if (curl) {
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        headers = curl_slist_append(headers, auth_header);
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PATCH");
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postdata);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
-
-        res = curl_easy_perform(curl);
-
-        if (res == CURLE_OK) {
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-            if (response_code == 200) {
-                success = 1;
+    return api_request(API_CARD_UPDATE, admin_token, postdata, &response, card_id) == 200;
+}
+
+// Fills the Transaction entries from the "transactions" array as it
+// arrives: objects at depth 2, their members at 3, user names at 4
+struct transactions_parse {
+    Transaction *transactions;
+    int max_transactions;
+    int *count;
+    int found;
+    int has_operation;
+};
+
+static void transactions_callback(JSON_PARSER *parser, JSON_EVENT event, const char *value, size_t len)
+{
+    struct transactions_parse *tp = parser->user;
+    Transaction *t;
+
+    if (parser->depth < 1 || strcmp(json_key(parser, 1), "transactions") != 0) {
+        return;
+    }
+    if (parser->depth == 1) {
+        if (event == JSON_ARRAY_START) {
+            tp->found = 1;
+        }
+        return;
+    }
+    if (*tp->count >= tp->max_transactions) {
+        return;
+    }
+    t = &tp->transactions[*tp->count];
+
+    if (parser->depth == 2) {
+        if (event == JSON_OBJECT_START) {
+            memset(t, 0, sizeof(*t));
+            tp->has_operation = 0;
+        } else if (event == JSON_OBJECT_END && tp->has_operation) {
+            if (++*tp->count == tp->max_transactions) {
+                json_stop(parser);
             }
         }
-
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
+    } else if (parser->depth == 3) {
+        if (event == JSON_NUMBER && strcmp(json_key(parser, 3), "operation") == 0) {
+            t->operation = atoi(value);
+            tp->has_operation = 1;
+        } else if (event == JSON_STRING && strcmp(json_key(parser, 3), "date") == 0) {
+            copy_string(t->date, sizeof(t->date), value, len);
+        }
+    } else if (parser->depth == 4 && event == JSON_STRING && strcmp(json_key(parser, 4), "name") == 0) {
+        if (strcmp(json_key(parser, 3), "source_user") == 0) {
+            copy_string(t->source_user_name, sizeof(t->source_user_name), value, len);
+        } else if (strcmp(json_key(parser, 3), "destination_user") == 0) {
+            copy_string(t->destination_user_name, sizeof(t->destination_user_name), value, len);
+        }
     }
-
-    free(chunk.memory);
-    return success;
 }
 
-int fetch_transactions(const char *card_id, const char *card_token, const char *driver_token, int *balance, Transaction *transactions, int max_transactions, int *transaction_count)
-{
+// One GET of fetch_transactions(), run on the multi handle
+struct api_request {
     CURL *curl;
-    CURLcode res;
+    struct api_response response;
     char url[512];
-    char card_auth_header[512];
-    char driver_auth_header[512];
-    struct memory_struct chunk;
-    int success = 0;
-
-    chunk.memory = malloc(1);
-    chunk.size = 0;
-
-    snprintf(url, sizeof(url), "%s/transactions", api_base_url);
-    snprintf(card_auth_header, sizeof(card_auth_header), "Authorization: Bearer %s", card_token);
-    snprintf(driver_auth_header, sizeof(driver_auth_header), "Authorization: Bearer %s", driver_token);
+};
 
-    curl = curl_easy_init();
-    if (curl) {
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, card_auth_header);
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
-
-        res = curl_easy_perform(curl);
-
-        if (res == CURLE_OK) {
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-            if (response_code == 200) {
-                *transaction_count = 0;
-
-                char *trans_array = strstr(chunk.memory, "\"transactions\":");
-                if (trans_array) {
-                    trans_array += 15;
-                    while (*trans_array == ' ' || *trans_array == '\n' || *trans_array == '\r' || *trans_array == '\t') {
-                        trans_array++;
-                    }
-
-                    if (*trans_array == '[') {
-                        char *trans_start = trans_array + 1;
-
-                    while (*transaction_count < max_transactions) {
-                        char *obj_start = strchr(trans_start, '{');
-                        if (!obj_start) break;
-
-                        char *obj_end = obj_start + 1;
-                        int brace_count = 1;
-                        while (*obj_end && brace_count > 0) {
-                            if (*obj_end == '{') brace_count++;
-                            else if (*obj_end == '}') brace_count--;
-                            if (brace_count > 0) obj_end++;
-                        }
-                        if (brace_count != 0) break;
-
-                        char *operation_str = strstr(obj_start, "\"operation\":");
-                        char *source_user_str = strstr(obj_start, "\"source_user\":");
-                        char *dest_user_str = strstr(obj_start, "\"destination_user\":");
-
-                        if (operation_str && operation_str < obj_end) {
-                            int op = atoi(operation_str + 12);
-                            transactions[*transaction_count].operation = op;
-
-                            if (source_user_str && source_user_str < obj_end) {
-                                char *name_start = strstr(source_user_str, "\"name\":\"");
-                                if (name_start && name_start < obj_end) {
-                                    name_start += 8;
-                                    char *name_end = strchr(name_start, '"');
-                                    if (name_end) {
-                                        size_t len = name_end - name_start;
-                                        if (len < sizeof(transactions[*transaction_count].source_user_name)) {
-                                            strncpy(transactions[*transaction_count].source_user_name, name_start, len);
-                                            transactions[*transaction_count].source_user_name[len] = '\0';
-                                        }
-                                    }
-                                }
-                            }
-
-                            if (dest_user_str && dest_user_str < obj_end) {
-                                char *name_start = strstr(dest_user_str, "\"name\":\"");
-                                if (name_start && name_start < obj_end) {
-                                    name_start += 8;
-                                    char *name_end = strchr(name_start, '"');
-                                    if (name_end) {
-                                        size_t len = name_end - name_start;
-                                        if (len < sizeof(transactions[*transaction_count].destination_user_name)) {
-                                            strncpy(transactions[*transaction_count].destination_user_name, name_start, len);
-                                            transactions[*transaction_count].destination_user_name[len] = '\0';
-                                        }
-                                    }
-                                }
-                            }
-
-                            (*transaction_count)++;
-                        }
-
-                        trans_start = obj_end + 1;
-                    }
-
-                    success = 1;
-                    }
-                }
-            }
-        }
+static int request_start(struct api_request *req, int id, const char *token, JSON_CALLBACK callback, void *user, ...)
+{
+    va_list args;
 
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
+    response_init(&req->response, callback, user);
+    req->curl = api_acquire();
+    if (!req->curl) {
+        return 0;
     }
 
-    free(chunk.memory);
+    va_start(args, user);
+    api_setup(req->curl, id, req->url, sizeof(req->url), token, NULL, &req->response, args);
+    va_end(args);
+    curl_multi_add_handle(multi, req->curl);
+    return 1;
+}
 
-    if (!success) {
-        return 0;
+static void request_end(struct api_request *req)
+{
+    if (!req->curl) {
+        return;
     }
+    curl_multi_remove_handle(multi, req->curl);
+    api_release(req->curl);
+    req->curl = NULL;
+}
 
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+// HTTP status of a finished request, 0 if it failed before an answer
+static long request_status(CURL *curl, CURLcode result)
+{
+    long response_code = 0;
 
-    char user_id[128] = "";
+    if (result == CURLE_OK) {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    }
+    return response_code;
+}
 
-    snprintf(url, sizeof(url), "%s/user?card_id=%s", api_base_url, card_id);
+// Transactions (card token) and user lookup (driver token) run in
+// parallel on one multi handle, and the balance request starts as soon as
+// the lookup gives the user id: the screen waits for the slowest chain,
+// not for the three requests in a row. Fails only if the transactions
+// cannot be read; an unknown user or balance reads as 0.
+int fetch_transactions(const char *card_id, const char *card_token, const char *driver_token, int *balance, Transaction *transactions, int max_transactions, int *transaction_count)
+{
+    CURLMsg *msg;
+    struct api_request trans;
+    struct api_request user;
+    struct api_request bal;
+    char user_id[128];
+    long balance_value = 0;
+    struct transactions_parse tp = {transactions, max_transactions, transaction_count, 0, 0};
+    struct api_field user_fields[] = {{"_id", user_id, sizeof(user_id), NULL, 0}, {NULL}};
+    struct api_field balance_fields[] = {{"balance", NULL, 0, &balance_value, 0}, {NULL}};
+    int pending = 0;
+    int running;
+    int queued;
+    int success = 0;
+    int failed = 0;
+    long status;
 
-    curl = curl_easy_init();
-    if (curl) {
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, driver_auth_header);
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
-
-        res = curl_easy_perform(curl);
-
-        if (res == CURLE_OK) {
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-            if (response_code == 200) {
-                char *id_start = strstr(chunk.memory, "\"_id\":\"");
-                if (id_start) {
-                    id_start += 7;
-                    char *id_end = strchr(id_start, '"');
-                    if (id_end) {
-                        size_t len = id_end - id_start;
-                        if (len < sizeof(user_id)) {
-                            strncpy(user_id, id_start, len);
-                            user_id[len] = '\0';
-                        }
-                    }
-                }
-            }
-        }
+    *balance = 0;
+    *transaction_count = 0;
+    trans.curl = NULL;
+    user.curl = NULL;
+    bal.curl = NULL;
 
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
+    if (!multi || !request_start(&trans, API_TRANSACTIONS, card_token, transactions_callback, &tp)) {
+        return 0;
     }
+    pending++;
 
-    free(chunk.memory);
-
-    if (user_id[0] == '\0') {
-        *balance = 0;
-        return 1;
+    if (request_start(&user, API_USER_BY_CARD, driver_token, fields_callback, user_fields, card_id)) {
+        pending++;
     }
 
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+    while (pending > 0 && !failed) {
+        if (curl_multi_perform(multi, &running) != CURLM_OK) {
+            failed = 1;
+            break;
+        }
 
-    snprintf(url, sizeof(url), "%s/user/%s/balance", api_base_url, user_id);
+        while ((msg = curl_multi_info_read(multi, &queued))) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            pending--;
+            status = request_status(msg->easy_handle, msg->data.result);
 
-    curl = curl_easy_init();
-    if (curl) {
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, driver_auth_header);
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
-
-        res = curl_easy_perform(curl);
-
-        if (res == CURLE_OK) {
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-            if (response_code == 200) {
-                char *balance_start = strstr(chunk.memory, "\"balance\":");
-                if (balance_start) {
-                    *balance = atoi(balance_start + 10);
-                } else {
-                    *balance = 0;
+            if (msg->easy_handle == trans.curl) {
+                if (status == 200) {
+                    success = json_finish(&trans.response.parser) && tp.found;
+                }
+                // Nothing to show without the transactions
+                if (!success) {
+                    failed = 1;
+                }
+            } else if (msg->easy_handle == user.curl) {
+                if (status != 200 || !json_finish(&user.response.parser) || !user_fields[0].found) {
+                    continue;
+                }
+
+                if (request_start(&bal, API_BALANCE, driver_token, fields_callback, balance_fields, user_id)) {
+                    pending++;
+                }
+            } else if (msg->easy_handle == bal.curl) {
+                if (status == 200 && json_finish(&bal.response.parser) && balance_fields[0].found) {
+                    *balance = balance_value;
                 }
-            } else {
-                *balance = 0;
             }
-        } else {
-            *balance = 0;
         }
 
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
+        if (pending > 0 && !failed) {
+            curl_multi_wait(multi, NULL, 0, 1000, NULL);
+        }
     }
 
-    free(chunk.memory);
-    return 1;
+    request_end(&trans);
+    request_end(&user);
+    request_end(&bal);
+
+    return success && !failed;
 }
@@ -10,11 +10,19 @@ typedef struct {
     char date[64];
 } Transaction;
 
+// Terminal nonce signed by the card with its counter (SIZE_TERMINAL_NONCE)
+#define API_NONCE_SIZE 24
+
 int api_init(const char *api_url);
 void api_cleanup();
+// The only call safe to make from another thread than the others
 int api_login(const char *username, const char *password, char *token_buffer, size_t buffer_size);
 int api_get_challenge(const char *card_id, char *challenge_buffer, size_t buffer_size);
 int api_card_auth_with_signature(const char *card_id, const char *challenge, const unsigned char *signature, size_t signature_len, char *token_buffer, size_t buffer_size);
+int api_card_auth_with_counter(const char *card_id, unsigned long counter, const unsigned char *nonce, unsigned long timestamp, const unsigned char *signature, size_t signature_len, char *token_buffer, size_t buffer_size);
+int api_get_voucher(const char *card_id, const char *card_token, unsigned char *voucher, size_t voucher_size);
+int api_fetch_history(const char *card_id, const char *card_token, unsigned long after, unsigned char *entries, size_t entry_size, int max_entries, int *count);
+int api_upload_receipts(const char *card_id, const char *token, char **receipts, int count);
 int api_card_login(const char *card_id, const char *pin, char *token_buffer, size_t buffer_size);
 int fetch_user_by_card(const char *card_id, const char *driver_token, char *name_buffer, size_t buffer_size);
 int get_card_status(const char *card_id, const char *driver_token, char *status_buffer, size_t buffer_size);
@@ -1,4 +1,5 @@
 #include "card.h"
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -78,43 +79,6 @@ int reconnect_card()
     return (rv == SCARD_S_SUCCESS);
 }
 
-int read_data(BYTE *card_id, BYTE *version)
-{
-    LONG rv;
-    BYTE cmd_card_id[] = {0x80, 0x01, 0x00, 0x00, SIZE_CARD_ID};
-    BYTE cmd_version[] = {0x80, 0x02, 0x00, 0x00, 0x01};
-    BYTE response[258];
-    DWORD responseLen;
-    SCARD_IO_REQUEST pioSendPci;
-
-    pioSendPci.dwProtocol = dwActiveProtocol;
-    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
-
-    responseLen = sizeof(response);
-    rv = SCardTransmit(hCard, &pioSendPci, cmd_card_id, sizeof(cmd_card_id),
-                      NULL, response, &responseLen);
-    if (rv != SCARD_S_SUCCESS || responseLen < SIZE_CARD_ID + 2) {
-        return 0;
-    }
-    if (response[responseLen - 2] != 0x90 || response[responseLen - 1] != 0x00) {
-        return 0;
-    }
-    memcpy(card_id, response, SIZE_CARD_ID);
-
-    responseLen = sizeof(response);
-    rv = SCardTransmit(hCard, &pioSendPci, cmd_version, sizeof(cmd_version),
-                      NULL, response, &responseLen);
-    if (rv != SCARD_S_SUCCESS || responseLen < 3) {
-        return 0;
-    }
-    if (response[responseLen - 2] != 0x90 || response[responseLen - 1] != 0x00) {
-        return 0;
-    }
-    *version = response[0];
-
-    return 1;
-}
-
 int write_pin_to_card(const char *pin)
 {
     LONG rv;
@@ -322,6 +286,152 @@ int sign_challenge_on_card(const unsigned char *challenge, unsigned char *signat
     return 0;
 }
 
+// PIN check and challenge signature in a single AUTHENTICATE command.
+// Returns 1 with the signature, 0 on wrong PIN or blocked card (with
+// remaining_attempts set), -1 on any other error.
+int authenticate_on_card(const char *pin, const unsigned char *challenge, unsigned char *signature, size_t *signature_len, BYTE *remaining_attempts)
+{
+    LONG rv;
+    BYTE cmd_authenticate[5 + SIZE_PIN + SIZE_CHALLENGE] = {0x80, 0x0F, 0x00, 0x00, SIZE_PIN + SIZE_CHALLENGE};
+    BYTE cmd_get_response[5] = {0x00, 0xC0, 0x00, 0x00, 0x00};
+    BYTE response[258];
+    DWORD responseLen;
+    SCARD_IO_REQUEST pioSendPci;
+    int i;
+
+    pioSendPci.dwProtocol = dwActiveProtocol;
+    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
+
+    for (i = 0; i < SIZE_PIN; i++) {
+        cmd_authenticate[5 + i] = pin[i] - '0';
+    }
+    for (i = 0; i < SIZE_CHALLENGE; i++) {
+        cmd_authenticate[5 + SIZE_PIN + i] = challenge[i];
+    }
+
+    responseLen = sizeof(response);
+    rv = SCardTransmit(hCard, &pioSendPci, cmd_authenticate, sizeof(cmd_authenticate),
+                      NULL, response, &responseLen);
+
+    if (rv != SCARD_S_SUCCESS || responseLen < 2) {
+        return -1;
+    }
+
+    if (response[responseLen - 2] == 0x63 && (response[responseLen - 1] & 0xF0) == 0xC0) {
+        *remaining_attempts = response[responseLen - 1] & 0x0F;
+        return 0;
+    }
+
+    if (response[responseLen - 2] == 0x69 && response[responseLen - 1] == 0x83) {
+        *remaining_attempts = 0;
+        return 0;
+    }
+
+    // Signature waiting on the card, unless the reader fetched it already
+    if (response[responseLen - 2] == 0x61) {
+        cmd_get_response[4] = response[responseLen - 1];
+        responseLen = sizeof(response);
+        rv = SCardTransmit(hCard, &pioSendPci, cmd_get_response, sizeof(cmd_get_response),
+                          NULL, response, &responseLen);
+
+        if (rv != SCARD_S_SUCCESS || responseLen < 2) {
+            return -1;
+        }
+    }
+
+    if (response[responseLen - 2] != 0x90 || response[responseLen - 1] != 0x00) {
+        return -1;
+    }
+
+    if (responseLen - 2 != SIZE_SIGNATURE) {
+        return -1;
+    }
+
+    *remaining_attempts = 3;
+    memcpy(signature, response, SIZE_SIGNATURE);
+    *signature_len = SIZE_SIGNATURE;
+    return 1;
+}
+
+// PIN check and signature of the incremented card counter with the
+// terminal nonce and timestamp. Same results as authenticate_on_card(),
+// and -2 if the card does not support it (6D00).
+int counter_authenticate_on_card(const char *pin, const unsigned char *nonce, unsigned long timestamp, unsigned long *counter, unsigned char *signature, size_t *signature_len, BYTE *remaining_attempts)
+{
+    LONG rv;
+    BYTE cmd_authenticate[5 + SIZE_PIN + SIZE_TERMINAL_NONCE + SIZE_TIMESTAMP] = {0x80, 0x12, 0x00, 0x00, SIZE_PIN + SIZE_TERMINAL_NONCE + SIZE_TIMESTAMP};
+    BYTE cmd_get_response[5] = {0x00, 0xC0, 0x00, 0x00, 0x00};
+    BYTE response[258];
+    DWORD responseLen;
+    SCARD_IO_REQUEST pioSendPci;
+    BYTE *p;
+    int i;
+
+    pioSendPci.dwProtocol = dwActiveProtocol;
+    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
+
+    p = cmd_authenticate + 5;
+    for (i = 0; i < SIZE_PIN; i++) {
+        *p++ = pin[i] - '0';
+    }
+    memcpy(p, nonce, SIZE_TERMINAL_NONCE);
+    p += SIZE_TERMINAL_NONCE;
+    for (i = SIZE_TIMESTAMP - 1; i >= 0; i--) {
+        *p++ = (BYTE)(timestamp >> (8 * i));
+    }
+
+    responseLen = sizeof(response);
+    rv = SCardTransmit(hCard, &pioSendPci, cmd_authenticate, sizeof(cmd_authenticate),
+                      NULL, response, &responseLen);
+
+    if (rv != SCARD_S_SUCCESS || responseLen < 2) {
+        return -1;
+    }
+
+    if (response[responseLen - 2] == 0x6D && response[responseLen - 1] == 0x00) {
+        return -2;
+    }
+
+    if (response[responseLen - 2] == 0x63 && (response[responseLen - 1] & 0xF0) == 0xC0) {
+        *remaining_attempts = response[responseLen - 1] & 0x0F;
+        return 0;
+    }
+
+    if (response[responseLen - 2] == 0x69 && response[responseLen - 1] == 0x83) {
+        *remaining_attempts = 0;
+        return 0;
+    }
+
+    // Counter and signature waiting on the card, unless the reader fetched them already
+    if (response[responseLen - 2] == 0x61) {
+        cmd_get_response[4] = response[responseLen - 1];
+        responseLen = sizeof(response);
+        rv = SCardTransmit(hCard, &pioSendPci, cmd_get_response, sizeof(cmd_get_response),
+                          NULL, response, &responseLen);
+
+        if (rv != SCARD_S_SUCCESS || responseLen < 2) {
+            return -1;
+        }
+    }
+
+    if (response[responseLen - 2] != 0x90 || response[responseLen - 1] != 0x00) {
+        return -1;
+    }
+
+    if (responseLen - 2 != SIZE_AUTH_COUNTER + SIZE_SIGNATURE) {
+        return -1;
+    }
+
+    *counter = 0;
+    for (i = 0; i < SIZE_AUTH_COUNTER; i++) {
+        *counter = (*counter << 8) | response[i];
+    }
+    *remaining_attempts = 3;
+    memcpy(signature, response + SIZE_AUTH_COUNTER, SIZE_SIGNATURE);
+    *signature_len = SIZE_SIGNATURE;
+    return 1;
+}
+
 int get_remaining_attempts_from_card(BYTE *pin_attempts, BYTE *puk_attempts)
 {
     LONG rv;
@@ -343,6 +453,268 @@ int get_remaining_attempts_from_card(BYTE *pin_attempts, BYTE *puk_attempts)
     return 1;
 }
 
+int read_card_info(CARD_INFO *info)
+{
+    return card_info_read(hCard, dwActiveProtocol, info);
+}
+
+static unsigned int get_u16(const BYTE *p)
+{
+    return ((unsigned int)p[0] << 8) | p[1];
+}
+
+static unsigned long get_u32(const BYTE *p)
+{
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | p[3];
+}
+
+// Card diagnostics counters, 0 if the card has no GET_STATS
+int read_card_stats(CARD_STATS *stats)
+{
+    LONG rv;
+    BYTE cmd[] = {0x80, 0x11, 0x00, 0x00, SIZE_CARD_STATS};
+    BYTE response[258];
+    DWORD responseLen = sizeof(response);
+    SCARD_IO_REQUEST pioSendPci;
+    const BYTE *p;
+    unsigned int divider;
+    int i;
+
+    pioSendPci.dwProtocol = dwActiveProtocol;
+    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
+
+    rv = SCardTransmit(hCard, &pioSendPci, cmd, sizeof(cmd), NULL, response, &responseLen);
+    if (rv != SCARD_S_SUCCESS || responseLen != SIZE_CARD_STATS + 2) {
+        return 0;
+    }
+    if (response[responseLen - 2] != 0x90 || response[responseLen - 1] != 0x00) {
+        return 0;
+    }
+    // Another format has another layout, even at the same size
+    if (response[0] != CARD_STATS_FORMAT) {
+        return 0;
+    }
+
+    // Timings are in ticks of divider CPU cycles
+    divider = response[1];
+    p = response + 2;
+    for (i = 0; i < CARD_STATS_INS_SLOTS; i++, p += 2) {
+        stats->ins_count[i] = get_u16(p);
+    }
+    stats->rx_parity_errors = get_u16(p);
+    stats->tx_repeats = get_u16(p + 2);
+    stats->error_sw = get_u16(p + 4);
+    stats->hmac_cycles = get_u32(p + 6) * divider;
+    stats->eeprom_write_cycles = get_u32(p + 10) * divider;
+
+    return 1;
+}
+
+static void put_u32(BYTE *p, unsigned long v)
+{
+    p[0] = (BYTE)(v >> 24);
+    p[1] = (BYTE)(v >> 16);
+    p[2] = (BYTE)(v >> 8);
+    p[3] = (BYTE)v;
+}
+
+int read_offline_info(OFFLINE_INFO *info)
+{
+    LONG rv;
+    BYTE cmd[] = {0x80, 0x15, 0x00, 0x00, SIZE_OFFLINE_INFO};
+    BYTE response[258];
+    DWORD responseLen = sizeof(response);
+    SCARD_IO_REQUEST pioSendPci;
+
+    pioSendPci.dwProtocol = dwActiveProtocol;
+    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
+
+    rv = SCardTransmit(hCard, &pioSendPci, cmd, sizeof(cmd), NULL, response, &responseLen);
+    if (rv != SCARD_S_SUCCESS || responseLen != SIZE_OFFLINE_INFO + 2) {
+        return 0;
+    }
+    if (response[responseLen - 2] != 0x90 || response[responseLen - 1] != 0x00) {
+        return 0;
+    }
+
+    info->epoch = get_u32(response);
+    info->remaining = get_u32(response + 4);
+    info->sequence = get_u32(response + 8);
+    return 1;
+}
+
+// Voucher as returned by the API (epoch, amount, HMAC), needs the PIN
+// verified in this session. Returns 0 if the card refuses it (6988: bad
+// signature or not newer than the loaded one).
+int load_voucher_on_card(const unsigned char *voucher)
+{
+    LONG rv;
+    BYTE cmd[5 + SIZE_VOUCHER] = {0x80, 0x13, 0x00, 0x00, SIZE_VOUCHER};
+    BYTE response[258];
+    DWORD responseLen = sizeof(response);
+    SCARD_IO_REQUEST pioSendPci;
+
+    pioSendPci.dwProtocol = dwActiveProtocol;
+    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
+
+    memcpy(cmd + 5, voucher, SIZE_VOUCHER);
+
+    rv = SCardTransmit(hCard, &pioSendPci, cmd, sizeof(cmd), NULL, response, &responseLen);
+    if (rv != SCARD_S_SUCCESS || responseLen < 2) {
+        return -1;
+    }
+
+    return response[responseLen - 2] == 0x90 && response[responseLen - 1] == 0x00;
+}
+
+// PIN check and offline payment of amount to payee (user id, 12 bytes),
+// no network needed. The receipt (message then HMAC, SIZE_RECEIPT bytes)
+// is for the terminal to queue and upload. Same results as
+// authenticate_on_card(), and -2 if the offline budget is too low.
+int offline_debit_on_card(const char *pin, unsigned long amount, const unsigned char *payee, unsigned long timestamp, unsigned char *receipt, BYTE *remaining_attempts)
+{
+    LONG rv;
+    BYTE cmd_debit[5 + SIZE_PIN + 4 + SIZE_PAYEE + SIZE_TIMESTAMP] = {0x80, 0x14, 0x00, 0x00, SIZE_PIN + 4 + SIZE_PAYEE + SIZE_TIMESTAMP};
+    BYTE cmd_get_response[5] = {0x00, 0xC0, 0x00, 0x00, 0x00};
+    BYTE response[258];
+    DWORD responseLen;
+    SCARD_IO_REQUEST pioSendPci;
+    int i;
+
+    pioSendPci.dwProtocol = dwActiveProtocol;
+    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
+
+    for (i = 0; i < SIZE_PIN; i++) {
+        cmd_debit[5 + i] = pin[i] - '0';
+    }
+    put_u32(cmd_debit + 5 + SIZE_PIN, amount);
+    memcpy(cmd_debit + 9 + SIZE_PIN, payee, SIZE_PAYEE);
+    put_u32(cmd_debit + 9 + SIZE_PIN + SIZE_PAYEE, timestamp);
+
+    responseLen = sizeof(response);
+    rv = SCardTransmit(hCard, &pioSendPci, cmd_debit, sizeof(cmd_debit),
+                      NULL, response, &responseLen);
+
+    if (rv != SCARD_S_SUCCESS || responseLen < 2) {
+        return -1;
+    }
+
+    if (response[responseLen - 2] == 0x63 && (response[responseLen - 1] & 0xF0) == 0xC0) {
+        *remaining_attempts = response[responseLen - 1] & 0x0F;
+        return 0;
+    }
+
+    if (response[responseLen - 2] == 0x69 && response[responseLen - 1] == 0x83) {
+        *remaining_attempts = 0;
+        return 0;
+    }
+
+    if (response[responseLen - 2] == 0x69 && response[responseLen - 1] == 0x87) {
+        *remaining_attempts = 3;
+        return -2;
+    }
+
+    if (response[responseLen - 2] == 0x61) {
+        cmd_get_response[4] = response[responseLen - 1];
+        responseLen = sizeof(response);
+        rv = SCardTransmit(hCard, &pioSendPci, cmd_get_response, sizeof(cmd_get_response),
+                          NULL, response, &responseLen);
+
+        if (rv != SCARD_S_SUCCESS || responseLen < 2) {
+            return -1;
+        }
+    }
+
+    if (response[responseLen - 2] != 0x90 || response[responseLen - 1] != 0x00 ||
+        responseLen - 2 != SIZE_RECEIPT) {
+        return -1;
+    }
+
+    *remaining_attempts = 3;
+    memcpy(receipt, response, SIZE_RECEIPT);
+    return 1;
+}
+
+// History entries newest first, up to max_entries, in pages of
+// HISTORY_PAGE_ENTRIES. Needs the PIN verified in this session.
+int read_history_from_card(HISTORY_ENTRY *entries, int max_entries, int *count)
+{
+    LONG rv;
+    BYTE cmd[] = {0x80, 0x17, 0x00, 0x00, 0x00};
+    BYTE response[258];
+    DWORD responseLen;
+    SCARD_IO_REQUEST pioSendPci;
+    const BYTE *p;
+    int n;
+    int i;
+
+    pioSendPci.dwProtocol = dwActiveProtocol;
+    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
+
+    if (max_entries > HISTORY_ENTRIES) {
+        max_entries = HISTORY_ENTRIES;
+    }
+
+    *count = 0;
+    while (*count < max_entries) {
+        n = max_entries - *count;
+        if (n > HISTORY_PAGE_ENTRIES) {
+            n = HISTORY_PAGE_ENTRIES;
+        }
+        cmd[2] = (BYTE)*count;
+        cmd[4] = (BYTE)(n * SIZE_HISTORY_ENTRY);
+
+        responseLen = sizeof(response);
+        rv = SCardTransmit(hCard, &pioSendPci, cmd, sizeof(cmd), NULL, response, &responseLen);
+        if (rv != SCARD_S_SUCCESS || responseLen != (DWORD)n * SIZE_HISTORY_ENTRY + 2) {
+            return 0;
+        }
+        if (response[responseLen - 2] != 0x90 || response[responseLen - 1] != 0x00) {
+            return 0;
+        }
+
+        for (i = 0, p = response; i < n; i++, p += SIZE_HISTORY_ENTRY) {
+            HISTORY_ENTRY *entry = &entries[*count];
+
+            entry->index = get_u32(p);
+            // The ring ends at the first empty slot
+            if (entry->index == 0) {
+                return 1;
+            }
+            entry->amount = (long)(int32_t)get_u32(p + 4);
+            entry->date = get_u32(p + 8);
+            memcpy(entry->name, p + 12, SIZE_HISTORY_NAME);
+            entry->name[SIZE_HISTORY_NAME] = '\0';
+            (*count)++;
+        }
+    }
+
+    return 1;
+}
+
+// Entry from the API (entry then HMAC), refused by the card (0) if the
+// signature is wrong or the entry is not newer than the ones it holds
+int append_history_on_card(const unsigned char *entry)
+{
+    LONG rv;
+    BYTE cmd[5 + SIZE_HISTORY_APPEND] = {0x80, 0x16, 0x00, 0x00, SIZE_HISTORY_APPEND};
+    BYTE response[258];
+    DWORD responseLen = sizeof(response);
+    SCARD_IO_REQUEST pioSendPci;
+
+    pioSendPci.dwProtocol = dwActiveProtocol;
+    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
+
+    memcpy(cmd + 5, entry, SIZE_HISTORY_APPEND);
+
+    rv = SCardTransmit(hCard, &pioSendPci, cmd, sizeof(cmd), NULL, response, &responseLen);
+    if (rv != SCARD_S_SUCCESS || responseLen < 2) {
+        return -1;
+    }
+
+    return response[responseLen - 2] == 0x90 && response[responseLen - 1] == 0x00;
+}
+
 void disconnect_card()
 {
     if (hCard) {
@@ -9,22 +9,74 @@
 #include <winscard.h>
 #endif
 #include <stddef.h>
+#include "card_info.h"
 
-#define SIZE_CARD_ID 24
 #define SIZE_PIN 4
 #define SIZE_PUK 4
+#define SIZE_CHALLENGE 32
+#define SIZE_SIGNATURE 32
+// COUNTER_AUTHENTICATE: the card signs 'C' || counter (4) || nonce || timestamp (4)
+#define SIZE_AUTH_COUNTER 4
+#define SIZE_TERMINAL_NONCE 24
+#define SIZE_TIMESTAMP 4
+// Offline payments: voucher from the API, receipt message then its HMAC
+#define SIZE_VOUCHER (8 + SIZE_SIGNATURE)
+#define SIZE_PAYEE 12
+#define SIZE_RECEIPT (13 + SIZE_PAYEE + SIZE_TIMESTAMP + SIZE_SIGNATURE)
+#define SIZE_OFFLINE_INFO 12
+// Transaction history kept on the card, entries signed by the API
+#define HISTORY_ENTRIES 16
+#define HISTORY_PAGE_ENTRIES 8
+#define SIZE_HISTORY_NAME 12
+#define SIZE_HISTORY_ENTRY (12 + SIZE_HISTORY_NAME)
+#define SIZE_HISTORY_APPEND (SIZE_HISTORY_ENTRY + SIZE_SIGNATURE)
+
+// GET_STATS response (format 3): counters since the card was last reset
+#define CARD_STATS_FORMAT 3
+#define CARD_STATS_INS_SLOTS 0x20
+#define SIZE_CARD_STATS (2 + 2 * CARD_STATS_INS_SLOTS + 6 + 8)
+
+typedef struct {
+    unsigned int ins_count[CARD_STATS_INS_SLOTS];  // by INS, GET RESPONSE in slot 0
+    unsigned int rx_parity_errors;
+    unsigned int tx_repeats;
+    unsigned int error_sw;
+    unsigned long hmac_cycles;
+    unsigned long eeprom_write_cycles;
+} CARD_STATS;
+
+typedef struct {
+    unsigned long epoch;        // last voucher loaded, 0: none
+    unsigned long remaining;    // amount left to spend offline, in cents
+    unsigned long sequence;     // last receipt number
+} OFFLINE_INFO;
+
+typedef struct {
+    unsigned long index;        // grows with every transaction, 0: empty
+    long amount;                // cents, negative when paid
+    unsigned long date;         // Unix seconds
+    char name[SIZE_HISTORY_NAME + 1];  // counterparty
+} HISTORY_ENTRY;
 
 int init_reader();
 int connect_card();
 int reconnect_card();
 int is_card_present();
-int read_data(BYTE *card_id, BYTE *version);
+int read_card_info(CARD_INFO *info);
+int read_card_stats(CARD_STATS *stats);
+int read_offline_info(OFFLINE_INFO *info);
+int load_voucher_on_card(const unsigned char *voucher);
+int read_history_from_card(HISTORY_ENTRY *entries, int max_entries, int *count);
+int append_history_on_card(const unsigned char *entry);
+int offline_debit_on_card(const char *pin, unsigned long amount, const unsigned char *payee, unsigned long timestamp, unsigned char *receipt, BYTE *remaining_attempts);
 int write_pin_to_card(const char *pin);
 int write_pin_and_puk_to_card(const char *pin, const char *puk);
 int verify_pin_on_card(const char *pin, BYTE *remaining_attempts);
 int verify_puk_on_card(const char *puk, const char *new_pin, BYTE *remaining_attempts);
+int counter_authenticate_on_card(const char *pin, const unsigned char *nonce, unsigned long timestamp, unsigned long *counter, unsigned char *signature, size_t *signature_len, BYTE *remaining_attempts);
 int get_remaining_attempts_from_card(BYTE *pin_attempts, BYTE *puk_attempts);
 int sign_challenge_on_card(const unsigned char *challenge, unsigned char *signature, size_t *signature_len);
+int authenticate_on_card(const char *pin, const unsigned char *challenge, unsigned char *signature, size_t *signature_len, BYTE *remaining_attempts);
 void disconnect_card();
 void cleanup_card();
 
@@ -0,0 +1,97 @@
+#include "card_info.h"
+#include <string.h>
+
+// Sends cmd and checks for 9000 with len data bytes before it
+static int transmit(SCARDHANDLE card, DWORD protocol, const BYTE *cmd, DWORD cmd_len, BYTE *response, DWORD len)
+{
+    LONG rv;
+    DWORD responseLen = 258;
+    SCARD_IO_REQUEST pioSendPci;
+
+    pioSendPci.dwProtocol = protocol;
+    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
+
+    rv = SCardTransmit(card, &pioSendPci, cmd, cmd_len, NULL, response, &responseLen);
+    if (rv != SCARD_S_SUCCESS || responseLen != len + 2) {
+        return 0;
+    }
+    return response[len] == 0x90 && response[len + 1] == 0x00;
+}
+
+// Cards without GET_CARD_INFO: READ_CARD_ID, READ_VERSION and
+// GET_REMAINING_ATTEMPTS. Whether a PIN is defined is not readable.
+static int read_legacy(SCARDHANDLE card, DWORD protocol, CARD_INFO *info)
+{
+    BYTE cmd_card_id[] = {0x80, 0x01, 0x00, 0x00, SIZE_CARD_ID};
+    BYTE cmd_version[] = {0x80, 0x02, 0x00, 0x00, 0x01};
+    BYTE cmd_attempts[] = {0x80, 0x0D, 0x00, 0x00, 0x02};
+    BYTE response[258];
+    int i;
+
+    if (!transmit(card, protocol, cmd_card_id, sizeof(cmd_card_id), response, SIZE_CARD_ID)) {
+        return 0;
+    }
+    memcpy(info->card_id, response, SIZE_CARD_ID);
+
+    if (!transmit(card, protocol, cmd_version, sizeof(cmd_version), response, 1)) {
+        return 0;
+    }
+    info->version = response[0];
+
+    if (!transmit(card, protocol, cmd_attempts, sizeof(cmd_attempts), response, 2)) {
+        return 0;
+    }
+    info->pin_attempts = response[0];
+    info->puk_attempts = response[1];
+
+    info->assigned = 0;
+    for (i = 0; i < SIZE_CARD_ID; i++) {
+        if (info->card_id[i] != 0x00) {
+            info->assigned = 1;
+            break;
+        }
+    }
+    info->pin_defined = 0;
+
+    return 1;
+}
+
+// Everything in one GET_CARD_INFO. Cards without it (6D00) are read with
+// the older commands instead.
+int card_info_read(SCARDHANDLE card, DWORD protocol, CARD_INFO *info)
+{
+    LONG rv;
+    BYTE cmd[] = {0x80, 0x10, 0x00, 0x00, SIZE_CARD_INFO};
+    BYTE response[258];
+    DWORD responseLen = sizeof(response);
+    SCARD_IO_REQUEST pioSendPci;
+
+    pioSendPci.dwProtocol = protocol;
+    pioSendPci.cbPciLength = sizeof(SCARD_IO_REQUEST);
+
+    rv = SCardTransmit(card, &pioSendPci, cmd, sizeof(cmd), NULL, response, &responseLen);
+    if (rv != SCARD_S_SUCCESS || responseLen < 2) {
+        return 0;
+    }
+
+    if (response[responseLen - 2] == 0x6D && response[responseLen - 1] == 0x00) {
+        return read_legacy(card, protocol, info);
+    }
+
+    if (responseLen != SIZE_CARD_INFO + 2 || response[responseLen - 2] != 0x90 || response[responseLen - 1] != 0x00) {
+        return 0;
+    }
+
+    if (response[0] != CARD_INFO_FORMAT) {
+        return 0;
+    }
+
+    info->version = response[1];
+    info->assigned = (response[2] & CARD_INFO_ASSIGNED) != 0;
+    info->pin_defined = (response[2] & CARD_INFO_PIN_DEFINED) != 0;
+    info->pin_attempts = response[3];
+    info->puk_attempts = response[4];
+    memcpy(info->card_id, response + 5, SIZE_CARD_ID);
+
+    return 1;
+}
@@ -0,0 +1,36 @@
+#ifndef CARD_INFO_H
+#define CARD_INFO_H
+
+// GET_CARD_INFO, shared by the ATM and the assignator (assignator/makefile
+// builds card_info.c from here)
+
+#ifdef __APPLE__
+#include <PCSC/wintypes.h>
+#include <PCSC/winscard.h>
+#else
+#include <pcsclite.h>
+#include <winscard.h>
+#endif
+
+#define SIZE_CARD_ID 24
+
+// GET_CARD_INFO response (format 1)
+#define CARD_INFO_FORMAT 1
+#define SIZE_CARD_INFO (5 + SIZE_CARD_ID)
+#define CARD_INFO_ASSIGNED 0x01
+#define CARD_INFO_PIN_DEFINED 0x02
+
+typedef struct {
+    BYTE version;
+    BYTE assigned;
+    BYTE pin_defined;
+    BYTE pin_attempts;
+    BYTE puk_attempts;
+    BYTE card_id[SIZE_CARD_ID];
+} CARD_INFO;
+
+// Card ID, version, PIN state and attempt counters of the card connected
+// through card. Returns 0 on error.
+int card_info_read(SCARDHANDLE card, DWORD protocol, CARD_INFO *info);
+
+#endif
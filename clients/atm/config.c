@@ -32,6 +32,9 @@ int load_config(const char *config_path, Config *config) {
     config->password[0] = '\0';
     strncpy(config->api_url, "https://api.cashless.rvcs.fr/v1", sizeof(config->api_url) - 1);
     config->api_url[sizeof(config->api_url) - 1] = '\0';
+    config->stats_log[0] = '\0';
+    config->receipt_spool[0] = '\0';
+    config->payee_id[0] = '\0';
 
     file = fopen(config_path, "r");
     if (!file) {
@@ -66,6 +69,15 @@ int load_config(const char *config_path, Config *config) {
         } else if (strcmp(key, "api_url") == 0) {
             strncpy(config->api_url, value, sizeof(config->api_url) - 1);
             config->api_url[sizeof(config->api_url) - 1] = '\0';
+        } else if (strcmp(key, "stats_log") == 0) {
+            strncpy(config->stats_log, value, sizeof(config->stats_log) - 1);
+            config->stats_log[sizeof(config->stats_log) - 1] = '\0';
+        } else if (strcmp(key, "receipt_spool") == 0) {
+            strncpy(config->receipt_spool, value, sizeof(config->receipt_spool) - 1);
+            config->receipt_spool[sizeof(config->receipt_spool) - 1] = '\0';
+        } else if (strcmp(key, "payee_id") == 0) {
+            strncpy(config->payee_id, value, sizeof(config->payee_id) - 1);
+            config->payee_id[sizeof(config->payee_id) - 1] = '\0';
         }
     }
 
@@ -5,6 +5,9 @@ typedef struct {
     char username[128];
     char password[128];
     char api_url[256];
+    char stats_log[256];    // card diagnostics appended here after each session, empty: off
+    char receipt_spool[256];    // offline payment receipts to upload, empty: off
+    char payee_id[32];          // user paid by offline payments here, empty: off
 } Config;
 
 int load_config(const char *config_path, Config *config);
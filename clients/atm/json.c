@@ -0,0 +1,371 @@
+#include "json.h"
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    STATE_VALUE,
+    STATE_VALUE_OR_END,     // after '['
+    STATE_KEY_OR_END,       // after '{'
+    STATE_KEY,              // after ',' in an object
+    STATE_COLON,
+    STATE_AFTER_VALUE,
+    STATE_STRING,
+    STATE_ESCAPE,
+    STATE_UNICODE,
+    STATE_NUMBER,
+    STATE_LITERAL,
+    STATE_DONE
+};
+
+void json_init(JSON_PARSER *parser, JSON_CALLBACK callback, void *user)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->callback = callback;
+    parser->user = user;
+    parser->state = STATE_VALUE;
+}
+
+const char *json_key(const JSON_PARSER *parser, int level)
+{
+    if (level < 1 || level > parser->depth) {
+        return "";
+    }
+    return parser->keys[level];
+}
+
+static void emit(JSON_PARSER *parser, JSON_EVENT event, const char *value, size_t len)
+{
+    if (parser->callback) {
+        parser->callback(parser, event, value, len);
+    }
+}
+
+static void append(JSON_PARSER *parser, char c)
+{
+    if (parser->token_len < JSON_MAX_TOKEN - 1) {
+        parser->token[parser->token_len++] = c;
+    } else {
+        parser->truncated = 1;
+    }
+}
+
+static void append_run(JSON_PARSER *parser, const char *data, size_t len)
+{
+    size_t room = JSON_MAX_TOKEN - 1 - parser->token_len;
+
+    if (len > room) {
+        len = room;
+        parser->truncated = 1;
+    }
+    memcpy(parser->token + parser->token_len, data, len);
+    parser->token_len += len;
+}
+
+static void append_utf8(JSON_PARSER *parser, unsigned long code)
+{
+    if (code < 0x80) {
+        append(parser, code);
+    } else if (code < 0x800) {
+        append(parser, 0xC0 | (code >> 6));
+        append(parser, 0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        append(parser, 0xE0 | (code >> 12));
+        append(parser, 0x80 | ((code >> 6) & 0x3F));
+        append(parser, 0x80 | (code & 0x3F));
+    } else {
+        append(parser, 0xF0 | (code >> 18));
+        append(parser, 0x80 | ((code >> 12) & 0x3F));
+        append(parser, 0x80 | ((code >> 6) & 0x3F));
+        append(parser, 0x80 | (code & 0x3F));
+    }
+}
+
+// A high surrogate not followed by its low half becomes U+FFFD
+static void flush_surrogate(JSON_PARSER *parser)
+{
+    if (parser->high_surrogate) {
+        append_utf8(parser, 0xFFFD);
+        parser->high_surrogate = 0;
+    }
+}
+
+static void value_end(JSON_PARSER *parser)
+{
+    parser->state = parser->depth == 0 ? STATE_DONE : STATE_AFTER_VALUE;
+}
+
+static int open_container(JSON_PARSER *parser, char c)
+{
+    if (parser->depth == JSON_MAX_DEPTH) {
+        return 0;
+    }
+    emit(parser, c == '{' ? JSON_OBJECT_START : JSON_ARRAY_START, NULL, 0);
+    parser->depth++;
+    parser->stack[parser->depth] = c;
+    parser->keys[parser->depth][0] = '\0';
+    parser->state = c == '{' ? STATE_KEY_OR_END : STATE_VALUE_OR_END;
+    return 1;
+}
+
+static void close_container(JSON_PARSER *parser)
+{
+    char c = parser->stack[parser->depth];
+
+    parser->depth--;
+    emit(parser, c == '{' ? JSON_OBJECT_END : JSON_ARRAY_END, NULL, 0);
+    value_end(parser);
+}
+
+static void start_token(JSON_PARSER *parser, int state)
+{
+    parser->token_len = 0;
+    parser->truncated = 0;
+    parser->high_surrogate = 0;
+    parser->state = state;
+}
+
+static int end_number(JSON_PARSER *parser)
+{
+    char *end;
+
+    parser->token[parser->token_len] = '\0';
+    strtod(parser->token, &end);
+    if (parser->truncated || end == parser->token || *end != '\0') {
+        return 0;
+    }
+    emit(parser, JSON_NUMBER, parser->token, parser->token_len);
+    value_end(parser);
+    return 1;
+}
+
+static void end_string(JSON_PARSER *parser)
+{
+    flush_surrogate(parser);
+    parser->token[parser->token_len] = '\0';
+
+    if (parser->string_is_key) {
+        size_t len = parser->token_len < JSON_MAX_KEY - 1 ? parser->token_len : JSON_MAX_KEY - 1;
+
+        memcpy(parser->keys[parser->depth], parser->token, len);
+        parser->keys[parser->depth][len] = '\0';
+        parser->state = STATE_COLON;
+        return;
+    }
+    emit(parser, JSON_STRING, parser->token, parser->token_len);
+    value_end(parser);
+}
+
+static int is_space(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int start_value(JSON_PARSER *parser, char c)
+{
+    switch (c) {
+    case '{':
+    case '[':
+        return open_container(parser, c);
+    case '"':
+        parser->string_is_key = 0;
+        start_token(parser, STATE_STRING);
+        return 1;
+    case 't':
+        parser->literal = "true";
+        break;
+    case 'f':
+        parser->literal = "false";
+        break;
+    case 'n':
+        parser->literal = "null";
+        break;
+    default:
+        if (c == '-' || (c >= '0' && c <= '9')) {
+            start_token(parser, STATE_NUMBER);
+            append(parser, c);
+            return 1;
+        }
+        return 0;
+    }
+    parser->literal_pos = 1;
+    parser->state = STATE_LITERAL;
+    return 1;
+}
+
+static int step(JSON_PARSER *parser, char c)
+{
+    int digit;
+
+    switch (parser->state) {
+    case STATE_VALUE_OR_END:
+        if (c == ']') {
+            close_container(parser);
+            return 1;
+        }
+        // fall through
+    case STATE_VALUE:
+        return is_space(c) || start_value(parser, c);
+    case STATE_KEY_OR_END:
+        if (c == '}') {
+            close_container(parser);
+            return 1;
+        }
+        // fall through
+    case STATE_KEY:
+        if (is_space(c)) {
+            return 1;
+        }
+        if (c != '"') {
+            return 0;
+        }
+        parser->string_is_key = 1;
+        start_token(parser, STATE_STRING);
+        return 1;
+    case STATE_COLON:
+        if (c == ':') {
+            parser->state = STATE_VALUE;
+            return 1;
+        }
+        return is_space(c);
+    case STATE_AFTER_VALUE:
+        if (is_space(c)) {
+            return 1;
+        }
+        if (c == ',') {
+            parser->state = parser->stack[parser->depth] == '{' ? STATE_KEY : STATE_VALUE;
+            return 1;
+        }
+        if ((c == '}' && parser->stack[parser->depth] == '{') ||
+            (c == ']' && parser->stack[parser->depth] == '[')) {
+            close_container(parser);
+            return 1;
+        }
+        return 0;
+    case STATE_STRING:
+        if (c == '"') {
+            end_string(parser);
+        } else if (c == '\\') {
+            parser->state = STATE_ESCAPE;
+        } else if ((unsigned char)c < 0x20) {
+            return 0;
+        } else {
+            flush_surrogate(parser);
+            append(parser, c);
+        }
+        return 1;
+    case STATE_ESCAPE:
+        if (c == 'u') {
+            parser->unicode = 0;
+            parser->unicode_digits = 0;
+            parser->state = STATE_UNICODE;
+            return 1;
+        }
+        flush_surrogate(parser);
+        switch (c) {
+        case '"': case '\\': case '/': append(parser, c); break;
+        case 'b': append(parser, '\b'); break;
+        case 'f': append(parser, '\f'); break;
+        case 'n': append(parser, '\n'); break;
+        case 'r': append(parser, '\r'); break;
+        case 't': append(parser, '\t'); break;
+        default: return 0;
+        }
+        parser->state = STATE_STRING;
+        return 1;
+    case STATE_UNICODE:
+        digit = hex_value(c);
+        if (digit < 0) {
+            return 0;
+        }
+        parser->unicode = (parser->unicode << 4) | digit;
+        if (++parser->unicode_digits < 4) {
+            return 1;
+        }
+        parser->state = STATE_STRING;
+        if (parser->unicode >= 0xD800 && parser->unicode < 0xDC00) {
+            flush_surrogate(parser);
+            parser->high_surrogate = parser->unicode;
+        } else if (parser->unicode >= 0xDC00 && parser->unicode < 0xE000) {
+            if (parser->high_surrogate) {
+                append_utf8(parser, 0x10000 + ((parser->high_surrogate - 0xD800) << 10) + (parser->unicode - 0xDC00));
+                parser->high_surrogate = 0;
+            } else {
+                append_utf8(parser, 0xFFFD);
+            }
+        } else {
+            flush_surrogate(parser);
+            append_utf8(parser, parser->unicode);
+        }
+        return 1;
+    case STATE_NUMBER:
+        if ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-') {
+            append(parser, c);
+            return 1;
+        }
+        // The number ends with the next character, which is read again
+        return end_number(parser) && step(parser, c);
+    case STATE_LITERAL:
+        if (c != parser->literal[parser->literal_pos]) {
+            return 0;
+        }
+        if (parser->literal[++parser->literal_pos] == '\0') {
+            emit(parser, parser->literal[0] == 't' ? JSON_TRUE : parser->literal[0] == 'f' ? JSON_FALSE : JSON_NULL, NULL, 0);
+            value_end(parser);
+        }
+        return 1;
+    case STATE_DONE:
+        return is_space(c);
+    }
+    return 0;
+}
+
+int json_feed(JSON_PARSER *parser, const char *data, size_t len)
+{
+    size_t i = 0;
+    size_t run;
+
+    while (i < len && !parser->error && !parser->stopped) {
+        // Plain characters of a string are copied as a run, not one by one
+        if (parser->state == STATE_STRING && !parser->high_surrogate) {
+            for (run = i; run < len; run++) {
+                if (data[run] == '"' || data[run] == '\\' || (unsigned char)data[run] < 0x20) {
+                    break;
+                }
+            }
+            if (run > i) {
+                append_run(parser, data + i, run - i);
+                i = run;
+                continue;
+            }
+        }
+        if (!step(parser, data[i])) {
+            parser->error = 1;
+        }
+        i++;
+    }
+    return !parser->error;
+}
+
+void json_stop(JSON_PARSER *parser)
+{
+    parser->stopped = 1;
+}
+
+int json_finish(JSON_PARSER *parser)
+{
+    if (parser->stopped) {
+        return !parser->error;
+    }
+    if (!parser->error && parser->state == STATE_NUMBER && !end_number(parser)) {
+        parser->error = 1;
+    }
+    return !parser->error && parser->state == STATE_DONE;
+}
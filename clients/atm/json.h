@@ -0,0 +1,66 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stddef.h>
+
+// Incremental JSON tokenizer: json_feed() takes the response in the chunks
+// curl delivers and calls back for every value, with the member keys that
+// lead to it. Only the value being read is held (strings up to
+// JSON_MAX_TOKEN bytes, longer ones are cut and flagged), so responses are
+// never buffered whole.
+
+#define JSON_MAX_DEPTH 16
+#define JSON_MAX_KEY 32
+#define JSON_MAX_TOKEN 1024
+
+typedef enum {
+    JSON_OBJECT_START,
+    JSON_OBJECT_END,
+    JSON_ARRAY_START,
+    JSON_ARRAY_END,
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_TRUE,
+    JSON_FALSE,
+    JSON_NULL
+} JSON_EVENT;
+
+typedef struct JSON_PARSER JSON_PARSER;
+
+// value is the unescaped string (UTF-8) or the number text, NUL-terminated,
+// NULL for the other events. Container events come at the depth and key of
+// the container itself, like the other values.
+typedef void (*JSON_CALLBACK)(JSON_PARSER *parser, JSON_EVENT event, const char *value, size_t len);
+
+struct JSON_PARSER {
+    JSON_CALLBACK callback;
+    void *user;
+    int depth;                              // containers open around the value
+    int truncated;                          // the string value was cut
+    int error;
+    int stopped;
+    int state;
+    int string_is_key;
+    char stack[JSON_MAX_DEPTH + 1];         // '{' or '[' by depth, from 1
+    char keys[JSON_MAX_DEPTH + 1][JSON_MAX_KEY];
+    char token[JSON_MAX_TOKEN];
+    size_t token_len;
+    const char *literal;
+    int literal_pos;
+    unsigned long unicode;
+    int unicode_digits;
+    unsigned long high_surrogate;
+};
+
+void json_init(JSON_PARSER *parser, JSON_CALLBACK callback, void *user);
+// Returns 0 once the input is not valid JSON, the rest is then ignored
+int json_feed(JSON_PARSER *parser, const char *data, size_t len);
+// The callback has all it needs: the rest of the input is not parsed
+void json_stop(JSON_PARSER *parser);
+// Returns 1 if the input was one complete JSON value, or valid up to
+// json_stop()
+int json_finish(JSON_PARSER *parser);
+// Member key at depth level (1 = member of the outermost object), "" in arrays
+const char *json_key(const JSON_PARSER *parser, int level);
+
+#endif
@@ -0,0 +1,357 @@
+// Benchmark of the transactions page parsing, run with "make bench": the
+// streaming tokenizer of json.c against the extractor it replaced (the
+// whole body grown with realloc in the write callback, then searched with
+// strstr and brace counting, kept here as it was in api.c).
+//
+// A page of n transactions shaped like the API's answer (user objects,
+// null source for deposits, escaped names, pagination) is generated, then
+// delivered in chunks of CURL_MAX_WRITE_SIZE bytes like curl does. Both
+// parsers fill the same Transaction array; the results are compared before
+// anything is timed.
+//
+// Usage: json_bench [-n transactions] [-m max_kept] [-r rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "api.h"
+#include "json.h"
+
+#define CHUNK_SIZE 16384
+
+struct memory_struct {
+    char *memory;
+    size_t size;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *make_page(int n, size_t *len)
+{
+    size_t size = 256 + (size_t)n * 512;
+    char *page = malloc(size);
+    size_t pos;
+    int i;
+
+    if (!page) {
+        return NULL;
+    }
+    pos = snprintf(page, size, "{\"transactions\":[");
+    for (i = 0; i < n; i++) {
+        char source[160];
+
+        if (i % 5 == 0) {
+            snprintf(source, sizeof(source), "null");
+        } else {
+            snprintf(source, sizeof(source),
+                     "{\"id\":\"65f1c2a9e4b0%06d\",\"name\":\"User \\\"%d\\\" \\u00e9\",\"username\":\"user%d\"}",
+                     i, i, i);
+        }
+        pos += snprintf(page + pos, size - pos,
+                        "%s\n  {\"_id\":\"66a0b1c2d3e4%06d\",\"source_user\":%s,"
+                        "\"destination_user\":{\"id\":\"65f1c2a9e4b1%06d\",\"name\":\"Shop %d\",\"username\":\"shop%d\"},"
+                        "\"operation\":%d,\"date\":\"2026-03-%02dT12:%02d:00.000Z\",\"__v\":0}",
+                        i ? "," : "", i, source, i, i % 7, i % 7, (i * 37) % 5000 - 2500, 1 + i % 28, i % 60);
+    }
+    pos += snprintf(page + pos, size - pos, "\n],\"pagination\":{\"page\":1,\"limit\":%d,\"total\":%d}}", n, n);
+    *len = pos;
+    return page;
+}
+
+// The extractor api.c used before json.c
+
+static size_t legacy_write(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    struct memory_struct *mem = (struct memory_struct *)userp;
+
+    char *ptr = realloc(mem->memory, mem->size + realsize + 1);
+    if (!ptr) {
+        return 0;
+    }
+
+    mem->memory = ptr;
+    memcpy(&(mem->memory[mem->size]), contents, realsize);
+    mem->size += realsize;
+    mem->memory[mem->size] = 0;
+
+    return realsize;
+}
+
+static void legacy_copy_name(const char *field, const char *end, char *name, size_t name_size)
+{
+    const char *name_start = strstr(field, "\"name\":\"");
+    const char *name_end;
+
+    if (!name_start || name_start >= end) {
+        return;
+    }
+    name_start += 8;
+    name_end = strchr(name_start, '"');
+    if (name_end && (size_t)(name_end - name_start) < name_size) {
+        strncpy(name, name_start, name_end - name_start);
+        name[name_end - name_start] = '\0';
+    }
+}
+
+static int legacy_parse(const char *json, Transaction *transactions, int max_transactions, int *transaction_count)
+{
+    const char *trans_start;
+    const char *obj_start;
+    const char *obj_end;
+    const char *operation_str;
+    const char *source_user_str;
+    const char *dest_user_str;
+    int brace_count;
+
+    *transaction_count = 0;
+
+    trans_start = strstr(json, "\"transactions\":");
+    if (!trans_start) {
+        return 0;
+    }
+    trans_start += 15;
+    while (*trans_start == ' ' || *trans_start == '\n' || *trans_start == '\r' || *trans_start == '\t') {
+        trans_start++;
+    }
+    if (*trans_start != '[') {
+        return 0;
+    }
+    trans_start++;
+
+    while (*transaction_count < max_transactions) {
+        obj_start = strchr(trans_start, '{');
+        if (!obj_start) break;
+
+        obj_end = obj_start + 1;
+        brace_count = 1;
+        while (*obj_end && brace_count > 0) {
+            if (*obj_end == '{') brace_count++;
+            else if (*obj_end == '}') brace_count--;
+            if (brace_count > 0) obj_end++;
+        }
+        if (brace_count != 0) break;
+
+        operation_str = strstr(obj_start, "\"operation\":");
+        source_user_str = strstr(obj_start, "\"source_user\":");
+        dest_user_str = strstr(obj_start, "\"destination_user\":");
+
+        if (operation_str && operation_str < obj_end) {
+            Transaction *t = &transactions[*transaction_count];
+
+            memset(t, 0, sizeof(*t));
+            t->operation = atoi(operation_str + 12);
+            if (source_user_str && source_user_str < obj_end) {
+                legacy_copy_name(source_user_str, obj_end, t->source_user_name, sizeof(t->source_user_name));
+            }
+            if (dest_user_str && dest_user_str < obj_end) {
+                legacy_copy_name(dest_user_str, obj_end, t->destination_user_name, sizeof(t->destination_user_name));
+            }
+            (*transaction_count)++;
+        }
+
+        trans_start = obj_end + 1;
+    }
+
+    return 1;
+}
+
+static int run_legacy(const char *page, size_t len, Transaction *transactions, int max, int *count, size_t *memory)
+{
+    struct memory_struct chunk;
+    size_t pos;
+    size_t n;
+    int ok;
+
+    chunk.memory = malloc(1);
+    chunk.size = 0;
+    for (pos = 0; pos < len; pos += n) {
+        n = len - pos < CHUNK_SIZE ? len - pos : CHUNK_SIZE;
+        legacy_write((void *)(page + pos), 1, n, &chunk);
+    }
+    ok = legacy_parse(chunk.memory, transactions, max, count);
+    *memory = chunk.size + 1;
+    free(chunk.memory);
+    return ok;
+}
+
+// Same filling as transactions_callback() in api.c
+
+struct transactions_parse {
+    Transaction *transactions;
+    int max_transactions;
+    int *count;
+    int found;
+    int has_operation;
+};
+
+static void copy_value(char *buffer, size_t size, const char *value, size_t len)
+{
+    if (len < size) {
+        memcpy(buffer, value, len + 1);
+    }
+}
+
+static void transactions_callback(JSON_PARSER *parser, JSON_EVENT event, const char *value, size_t len)
+{
+    struct transactions_parse *tp = parser->user;
+    Transaction *t;
+
+    if (parser->depth < 1 || strcmp(json_key(parser, 1), "transactions") != 0) {
+        return;
+    }
+    if (parser->depth == 1) {
+        if (event == JSON_ARRAY_START) {
+            tp->found = 1;
+        }
+        return;
+    }
+    if (*tp->count >= tp->max_transactions) {
+        return;
+    }
+    t = &tp->transactions[*tp->count];
+
+    if (parser->depth == 2) {
+        if (event == JSON_OBJECT_START) {
+            memset(t, 0, sizeof(*t));
+            tp->has_operation = 0;
+        } else if (event == JSON_OBJECT_END && tp->has_operation) {
+            if (++*tp->count == tp->max_transactions) {
+                json_stop(parser);
+            }
+        }
+    } else if (parser->depth == 3) {
+        if (event == JSON_NUMBER && strcmp(json_key(parser, 3), "operation") == 0) {
+            t->operation = atoi(value);
+            tp->has_operation = 1;
+        } else if (event == JSON_STRING && strcmp(json_key(parser, 3), "date") == 0) {
+            copy_value(t->date, sizeof(t->date), value, len);
+        }
+    } else if (parser->depth == 4 && event == JSON_STRING && strcmp(json_key(parser, 4), "name") == 0) {
+        if (strcmp(json_key(parser, 3), "source_user") == 0) {
+            copy_value(t->source_user_name, sizeof(t->source_user_name), value, len);
+        } else if (strcmp(json_key(parser, 3), "destination_user") == 0) {
+            copy_value(t->destination_user_name, sizeof(t->destination_user_name), value, len);
+        }
+    }
+}
+
+static int run_stream(const char *page, size_t len, Transaction *transactions, int max, int *count, size_t *memory)
+{
+    JSON_PARSER parser;
+    struct transactions_parse tp = {transactions, max, count, 0, 0};
+    size_t pos;
+    size_t n;
+
+    *count = 0;
+    json_init(&parser, transactions_callback, &tp);
+    for (pos = 0; pos < len; pos += n) {
+        n = len - pos < CHUNK_SIZE ? len - pos : CHUNK_SIZE;
+        json_feed(&parser, page + pos, n);
+    }
+    *memory = sizeof(parser);
+    return json_finish(&parser) && tp.found;
+}
+
+typedef int (*RUN)(const char *, size_t, Transaction *, int, int *, size_t *);
+
+static double time_runs(RUN run, const char *page, size_t len, Transaction *transactions, int max, int rounds)
+{
+    double start = now();
+    size_t memory;
+    int count;
+    int i;
+
+    for (i = 0; i < rounds; i++) {
+        run(page, len, transactions, max, &count, &memory);
+    }
+    return (now() - start) / rounds;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = 5000;
+    int max = -1;
+    int rounds = 20;
+    int opt;
+    int i;
+    size_t len;
+    char *page;
+    Transaction *legacy;
+    Transaction *stream;
+    int legacy_count;
+    int stream_count;
+    size_t legacy_memory;
+    size_t stream_memory;
+    double legacy_time;
+    double stream_time;
+
+    while ((opt = getopt(argc, argv, "n:m:r:")) != -1) {
+        switch (opt) {
+        case 'n': n = atoi(optarg); break;
+        case 'm': max = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n transactions] [-m max_kept] [-r rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n < 1 || rounds < 1) {
+        fprintf(stderr, "Error: n and rounds must be positive\n");
+        return 1;
+    }
+    if (max < 0 || max > n) {
+        max = n;
+    }
+
+    page = make_page(n, &len);
+    legacy = calloc(n, sizeof(Transaction));
+    stream = calloc(n, sizeof(Transaction));
+    if (!page || !legacy || !stream) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    if (!run_legacy(page, len, legacy, max, &legacy_count, &legacy_memory) ||
+        !run_stream(page, len, stream, max, &stream_count, &stream_memory)) {
+        fprintf(stderr, "Error: page not parsed\n");
+        return 1;
+    }
+    // The old extractor did not read the date, kept escapes as they came
+    // and took the destination's name for a null source (every fifth one):
+    // only what it got right is compared
+    if (legacy_count != stream_count) {
+        fprintf(stderr, "Error: %d transactions against %d\n", legacy_count, stream_count);
+        return 1;
+    }
+    for (i = 0; i < stream_count; i++) {
+        if (legacy[i].operation != stream[i].operation ||
+            strcmp(legacy[i].destination_user_name, stream[i].destination_user_name) != 0 ||
+            (i % 5 != 0 && !strchr(legacy[i].source_user_name, '\\') &&
+             strcmp(legacy[i].source_user_name, stream[i].source_user_name) != 0)) {
+            fprintf(stderr, "Error: transaction %d differs\n", i);
+            return 1;
+        }
+    }
+
+    legacy_time = time_runs(run_legacy, page, len, legacy, max, rounds);
+    stream_time = time_runs(run_stream, page, len, stream, max, rounds);
+
+    printf("page: %d transactions, %zu bytes, %d kept, %d rounds\n", n, len, max, rounds);
+    printf("%-8s %10s %10s %12s\n", "parser", "ms", "MB/s", "memory");
+    printf("%-8s %10.3f %10.1f %12zu\n", "strstr", legacy_time * 1e3, len / legacy_time / 1e6, legacy_memory);
+    printf("%-8s %10.3f %10.1f %12zu\n", "stream", stream_time * 1e3, len / stream_time / 1e6, stream_memory);
+
+    free(page);
+    free(legacy);
+    free(stream);
+    return 0;
+}
@@ -1,16 +1,20 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/select.h>
 #include <termios.h>
+#include <time.h>
 #include "card.h"
 #include "api.h"
+#include "token.h"
 #include "ui.h"
 #include "config.h"
 
-// Read PIN with card presence checking
-// Returns: 1 if PIN read successfully, 0 if card removed
-int read_digits(char *buffer, int size)
+// Read up to size digits with card presence checking, Enter ends the input
+// once min_size digits are in
+// Returns: 1 if read successfully, 0 if card removed
+int read_number(char *buffer, int min_size, int size)
 {
     struct termios old_tio, new_tio;
     fd_set readfds;
@@ -37,7 +41,9 @@ int read_digits(char *buffer, int size)
         if (select(STDIN_FILENO + 1, &readfds, NULL, NULL, &tv) > 0) {
             char c;
             if (read(STDIN_FILENO, &c, 1) == 1) {
-                if (c >= '0' && c <= '9') {
+                if (c == '\n' && pos >= min_size) {
+                    break;
+                } else if (c >= '0' && c <= '9') {
                     buffer[pos++] = c;
                     printf("*");
                     fflush(stdout);
@@ -50,12 +56,17 @@ int read_digits(char *buffer, int size)
         }
     }
 
-    buffer[size] = '\0';
+    buffer[pos] = '\0';
     printf("\n");
     tcsetattr(STDIN_FILENO, TCSANOW, &old_tio);
     return 1;
 }
 
+int read_digits(char *buffer, int size)
+{
+    return read_number(buffer, size, size);
+}
+
 int read_pin(char *pin)
 {
     return read_digits(pin, SIZE_PIN);
@@ -66,14 +77,257 @@ int read_puk(char *puk)
     return read_digits(puk, SIZE_PUK);
 }
 
+int random_bytes(unsigned char *buffer, size_t size)
+{
+    FILE *file = fopen("/dev/urandom", "rb");
+    size_t n;
+
+    if (!file) {
+        return 0;
+    }
+    n = fread(buffer, 1, size, file);
+    fclose(file);
+    return n == size;
+}
+
+// Appends the card diagnostics to path, one line per session:
+// time, card ID, commands by INS (hex) and the error counters
+void log_card_stats(const char *path, const char *card_id)
+{
+    CARD_STATS stats;
+    FILE *file;
+    char date[32];
+    time_t now = time(NULL);
+    int i;
+
+    if (!read_card_stats(&stats)) {
+        return;
+    }
+
+    file = fopen(path, "a");
+    if (!file) {
+        return;
+    }
+
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+    fprintf(file, "%s card=%s cmds=", date, card_id[0] ? card_id : "-");
+    for (i = 0; i < CARD_STATS_INS_SLOTS; i++) {
+        if (stats.ins_count[i]) {
+            fprintf(file, "%02X:%u,", i == 0 ? 0xC0 : i, stats.ins_count[i]);
+        }
+    }
+    fprintf(file, " rx_parity=%u tx_repeats=%u error_sw=%u hmac_cycles=%lu eeprom_cycles=%lu\n",
+            stats.rx_parity_errors, stats.tx_repeats, stats.error_sw,
+            stats.hmac_cycles, stats.eeprom_write_cycles);
+    fclose(file);
+}
+
+// History screen painted from the card while the API is being asked
+void show_card_history(unsigned char version, const char *card_id, const char *user_name, const HISTORY_ENTRY *entries, int count)
+{
+    char display[1024];
+    char date[16];
+    int i;
+
+    strcpy(display, "Recent transactions:\n");
+    for (i = 0; i < count && i < 10; i++) {
+        char trans_line[128];
+        time_t t = (time_t)entries[i].date;
+
+        strftime(date, sizeof(date), "%d/%m %H:%M", localtime(&t));
+        snprintf(trans_line, sizeof(trans_line), "%s %+.2f€ %s\n",
+                 date, entries[i].amount / 100.0, entries[i].name);
+        strcat(display, trans_line);
+    }
+    strcat(display, "\nUpdating...");
+    print_ui(display, version, (char *)card_id, (char *)user_name);
+}
+
+#define SPOOL_MAX_LINES 1024
+#define UPLOAD_MAX_RECEIPTS 100
+
+// Uploads the offline payment receipts queued in path, one
+// "<card_id> <receipt hex>" line each, in one request per run of lines of
+// the same card. Lines the API answered for are dropped, the others stay
+// for the next attempt.
+void upload_receipt_spool(const char *path, const char *token)
+{
+    static char lines[SPOOL_MAX_LINES][SIZE_CARD_ID + 2 * SIZE_RECEIPT + 4];
+    char *receipts[UPLOAD_MAX_RECEIPTS];
+    int done[SPOOL_MAX_LINES] = {0};
+    char tmp_path[300];
+    FILE *file;
+    int count = 0;
+    int i;
+    int j;
+
+    file = fopen(path, "r");
+    if (!file) {
+        return;
+    }
+    while (count < SPOOL_MAX_LINES && fgets(lines[count], sizeof(lines[count]), file)) {
+        lines[count][strcspn(lines[count], "\r\n")] = '\0';
+        if (strchr(lines[count], ' ')) {
+            count++;
+        }
+    }
+    fclose(file);
+
+    if (count == 0) {
+        return;
+    }
+
+    for (i = 0; i < count; i = j) {
+        char *card_id = lines[i];
+        size_t id_len = strchr(card_id, ' ') - card_id;
+
+        for (j = i; j < count && j - i < UPLOAD_MAX_RECEIPTS &&
+             strncmp(lines[j], card_id, id_len + 1) == 0; j++) {
+            receipts[j - i] = lines[j] + id_len + 1;
+        }
+
+        card_id[id_len] = '\0';
+        if (api_upload_receipts(card_id, token, receipts, j - i)) {
+            memset(done + i, 1, (j - i) * sizeof(done[0]));
+        }
+        card_id[id_len] = ' ';
+    }
+
+    // Lines beyond SPOOL_MAX_LINES stay for the next run as well
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    file = fopen(tmp_path, "w");
+    if (!file) {
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        if (!done[i]) {
+            fprintf(file, "%s\n", lines[i]);
+        }
+    }
+    fclose(file);
+    rename(tmp_path, path);
+}
+
+// Queues one receipt for upload_receipt_spool(), on disk before the
+// payment is shown as done
+int append_receipt_spool(const char *path, const char *card_id, const unsigned char *receipt)
+{
+    FILE *file = fopen(path, "a");
+    int ok;
+    int i;
+
+    if (!file) {
+        return 0;
+    }
+    fprintf(file, "%s ", card_id);
+    for (i = 0; i < SIZE_RECEIPT; i++) {
+        fprintf(file, "%02x", receipt[i]);
+    }
+    fprintf(file, "\n");
+    ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    return fclose(file) == 0 && ok;
+}
+
+#define AMOUNT_DIGITS 6
+
+// Payment to payee (user id, 12 bytes) from the card's offline budget while
+// the API cannot be reached, the receipt queued in spool_path.
+// Returns 0 if the card was removed.
+int offline_payment(const char *spool_path, const unsigned char *payee, unsigned char version, const char *card_id, CARD_INFO *card_info)
+{
+    OFFLINE_INFO info;
+    char display[256];
+    char amount_text[AMOUNT_DIGITS + 1];
+    char pin[SIZE_PIN + 1];
+    unsigned char receipt[SIZE_RECEIPT];
+    BYTE remaining_attempts = card_info->pin_attempts;
+    unsigned long amount;
+    int result;
+
+    if (card_info->pin_attempts == 0) {
+        print_ui("Network unavailable\n\nCard is blocked.\n\nPlease remove your card.", version, card_id, NULL);
+        return 1;
+    }
+    if (!read_offline_info(&info) || info.epoch == 0 || info.remaining == 0) {
+        print_ui("Network unavailable\n\nNo offline budget on this card.\n\nPlease remove your card.", version, card_id, NULL);
+        return 1;
+    }
+
+    snprintf(display, sizeof(display), "Network unavailable\n\nOffline payment, up to %.2f€\n\nAmount in cents, then Enter:",
+             info.remaining / 100.0);
+    print_ui(display, version, card_id, NULL);
+    printf("Amount: ");
+    fflush(stdout);
+    if (!read_number(amount_text, 1, AMOUNT_DIGITS)) {
+        return 0;
+    }
+    amount = strtoul(amount_text, NULL, 10);
+    if (amount == 0 || amount > info.remaining) {
+        print_ui("Amount not available offline.\n\nPlease remove your card.", version, card_id, NULL);
+        return 1;
+    }
+
+    snprintf(display, sizeof(display), "Offline payment of %.2f€\n\nEnter your PIN:", amount / 100.0);
+    print_ui(display, version, card_id, NULL);
+    printf("PIN: ");
+    fflush(stdout);
+    if (!read_pin(pin)) {
+        return 0;
+    }
+
+    print_ui("Verifying PIN...", version, card_id, NULL);
+    if (!reconnect_card()) {
+        if (!connect_card()) {
+            return 0;
+        }
+        print_ui("Error: Failed to reconnect to card\n\nPlease remove your card.", version, card_id, NULL);
+        return 1;
+    }
+
+    result = offline_debit_on_card(pin, amount, payee, (unsigned long)time(NULL), receipt, &remaining_attempts);
+    if (result == 0) {
+        card_info->pin_attempts = remaining_attempts;
+        if (remaining_attempts == 0) {
+            print_ui("Invalid PIN!\n\nCard is blocked.\n\nPlease remove your card.", version, card_id, NULL);
+        } else {
+            snprintf(display, sizeof(display), "Invalid PIN!\n\n%d attempts remaining.\n\nPlease remove your card.", remaining_attempts);
+            print_ui(display, version, card_id, NULL);
+        }
+        return 1;
+    }
+    if (result < 0) {
+        print_ui(result == -2 ? "Amount not available offline.\n\nPlease remove your card." :
+                 "Error: Offline payment failed\n\nPlease remove your card.", version, card_id, NULL);
+        return 1;
+    }
+    card_info->pin_attempts = remaining_attempts;
+
+    // The card has paid: a receipt that cannot be queued must not be lost
+    if (!append_receipt_spool(spool_path, card_id, receipt)) {
+        fprintf(stderr, "Receipt not queued, card %s: ", card_id);
+        for (int i = 0; i < SIZE_RECEIPT; i++) {
+            fprintf(stderr, "%02x", receipt[i]);
+        }
+        fprintf(stderr, "\n");
+    }
+
+    snprintf(display, sizeof(display), "Paid %.2f€ offline.\n\nPlease remove your card.", amount / 100.0);
+    print_ui(display, version, card_id, NULL);
+    return 1;
+}
+
 int main(int argc, char *argv[])
 {
     unsigned char card_id[SIZE_CARD_ID + 1];
     unsigned char version;
+    CARD_INFO card_info;
     int card_present = 0;
+    int session_done = 0;
     Config config;
     char auth_token[512];
     const char *config_path;
+    unsigned char payee[SIZE_PAYEE];
+    int offline_payments = 0;
 
     if (argc != 2) {
         printf("Usage: %s <config_file>\n", argv[0]);
@@ -89,32 +343,65 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    // Offline payments need both the payee and the spool for the receipts
+    if (config.payee_id[0]) {
+        offline_payments = config.receipt_spool[0] && strlen(config.payee_id) == 2 * SIZE_PAYEE;
+        for (int i = 0; offline_payments && i < SIZE_PAYEE; i++) {
+            offline_payments = sscanf(config.payee_id + 2 * i, "%2hhx", &payee[i]) == 1;
+        }
+        if (!offline_payments) {
+            printf("Warning: offline payments off, payee_id needs 24 hex characters and receipt_spool\n");
+        }
+    }
+
     if (!api_init(config.api_url)) {
         printf("Error: Failed to initialize API client\n");
         return 1;
     }
 
     printf("Authenticating...\n");
-    if (!api_login(config.username, config.password, auth_token, sizeof(auth_token))) {
+    if (!token_init(config.username, config.password)) {
         printf("Error: Authentication failed\n");
         printf("Please check your username and password in driver.conf\n");
         api_cleanup();
         return 1;
     }
+    token_driver(auth_token, sizeof(auth_token));
 
     if (!init_reader()) {
         printf("Error: No reader detected\n");
+        token_cleanup();
         api_cleanup();
         return 1;
     }
 
+    if (config.receipt_spool[0]) {
+        upload_receipt_spool(config.receipt_spool, auth_token);
+    }
+
     print_ui("Waiting for a card", 0, NULL, NULL);
 
     while (1) {
+        // Refreshed in the background, see token.c
+        token_driver(auth_token, sizeof(auth_token));
+
         if (connect_card()) {
+            if (card_present && !session_done) {
+                // Session over, the card is still there until removed
+                if (config.stats_log[0]) {
+                    log_card_stats(config.stats_log, (char *)card_id);
+                }
+                if (config.receipt_spool[0]) {
+                    upload_receipt_spool(config.receipt_spool, auth_token);
+                }
+                session_done = 1;
+            }
             if (!card_present) {
-                if (read_data(card_id, &version)) {
+                session_done = 0;
+                if (read_card_info(&card_info)) {
+                    memcpy(card_id, card_info.card_id, SIZE_CARD_ID);
                     card_id[SIZE_CARD_ID] = '\0';
+                    version = card_info.version;
 
                     int is_zero = 1;
                     for (int i = 0; i < SIZE_CARD_ID; i++) {
@@ -132,7 +419,18 @@ int main(int argc, char *argv[])
 
                     char card_status[64];
                     if (!get_card_status((char *)card_id, auth_token, card_status, sizeof(card_status))) {
-                        print_ui("Error: Cannot retrieve card status\n\nPlease remove your card.", version, (char *)card_id, NULL);
+                        token_refresh_driver();
+                        // The card can still pay from its offline budget
+                        if (offline_payments) {
+                            if (!offline_payment(config.receipt_spool, payee, version, (char *)card_id, &card_info)) {
+                                disconnect_card();
+                                card_present = 0;
+                                print_ui("Waiting for a card", 0, NULL, NULL);
+                                continue;
+                            }
+                        } else {
+                            print_ui("Error: Cannot retrieve card status\n\nPlease remove your card.", version, (char *)card_id, NULL);
+                        }
                         card_present = 1;
                         continue;
                     }
@@ -211,26 +509,14 @@ int main(int argc, char *argv[])
                         card_present = 1;
 
                     } else if (strcmp(card_status, "active") == 0) {
-                        if (!reconnect_card()) {
-                            if (!connect_card()) {
-                                card_present = 0;
-                                continue;
-                            }
-                        }
-
-                        BYTE pin_attempts, puk_attempts;
-                        if (!get_remaining_attempts_from_card(&pin_attempts, &puk_attempts)) {
-                            print_ui("Error: Failed to query card\n\nPlease remove your card.", version, (char *)card_id, user_name);
-                            card_present = 1;
-                            continue;
-                        }
-
+                        // Counters were read with the card info at insertion,
+                        // card_info.pin_attempts follows every PIN check below
                         if (!connect_card()) {
                             card_present = 0;
                             continue;
                         }
 
-                        if (pin_attempts == 0) {
+                        if (card_info.pin_attempts == 0) {
                             print_ui("Card is blocked!\n\nEnter PUK to unblock:", version, (char *)card_id, user_name);
 
                             char puk[SIZE_PUK + 1];
@@ -310,6 +596,18 @@ int main(int argc, char *argv[])
 
                         print_ui("Verifying PIN...", version, (char *)card_id, user_name);
 
+                        char challenge[128] = "";
+                        char user_token[512];
+                        unsigned char nonce[SIZE_TERMINAL_NONCE];
+                        unsigned long timestamp = (unsigned long)time(NULL);
+                        unsigned long counter = 0;
+
+                        if (!random_bytes(nonce, sizeof(nonce))) {
+                            print_ui("Error: No random source\n\nPlease remove your card.", version, (char *)card_id, user_name);
+                            card_present = 1;
+                            continue;
+                        }
+
                         if (!reconnect_card()) {
                             if (!connect_card()) {
                                 card_present = 0;
@@ -320,53 +618,83 @@ int main(int argc, char *argv[])
                             continue;
                         }
 
-                        BYTE remaining_attempts;
-                        int verify_result = verify_pin_on_card(pin, &remaining_attempts);
+                        // PIN check and counter signature in one card exchange, no
+                        // challenge needed from the API. Every insertion is signed
+                        // by the card and checked by the API, the only one with
+                        // the key: a card token is never reused for another one.
+                        BYTE remaining_attempts = card_info.pin_attempts;
+                        unsigned char signature[256];
+                        size_t signature_len = 0;
+                        int auth_result = counter_authenticate_on_card(pin, nonce, timestamp, &counter, signature, &signature_len, &remaining_attempts);
+
+                        // Older cards: PIN check and challenge signature instead
+                        if (auth_result == -2) {
+                            if (!api_get_challenge((char *)card_id, challenge, sizeof(challenge))) {
+                                print_ui("Error: Failed to get challenge from API\n\nPlease remove your card.", version, (char *)card_id, user_name);
+                                card_present = 1;
+                                continue;
+                            }
+
+                            unsigned char challenge_bytes[SIZE_CHALLENGE];
+                            for (size_t i = 0; i < SIZE_CHALLENGE; i++) {
+                                sscanf(challenge + 2*i, "%2hhx", &challenge_bytes[i]);
+                            }
+
+                            auth_result = authenticate_on_card(pin, challenge_bytes, signature, &signature_len, &remaining_attempts);
+                        }
 
                         if (!connect_card()) {
                             card_present = 0;
                             continue;
                         }
 
-                        if (verify_result) {
-                            print_ui("Authentication successful!\n\nFetching transactions...", version, (char *)card_id, user_name);
+                        if (auth_result < 0) {
+                            print_ui("Error: Failed to sign challenge on card\n\nPlease remove your card.", version, (char *)card_id, user_name);
+                            card_present = 1;
+                            continue;
+                        }
+                        card_info.pin_attempts = remaining_attempts;
 
-                            char user_token[512];
-                            char challenge[128];
+                        if (auth_result) {
+                            // The card keeps the last transactions, shown
+                            // before the API calls below
+                            HISTORY_ENTRY history[HISTORY_ENTRIES];
+                            int history_count = 0;
 
-                            if (!api_get_challenge((char *)card_id, challenge, sizeof(challenge))) {
-                                print_ui("Error: Failed to get challenge from API\n\nPlease remove your card.", version, (char *)card_id, user_name);
-                                card_present = 1;
-                                continue;
+                            if (read_history_from_card(history, HISTORY_ENTRIES, &history_count) && history_count > 0) {
+                                show_card_history(version, (char *)card_id, user_name, history, history_count);
+                            } else {
+                                print_ui("Authentication successful!\n\nFetching transactions...", version, (char *)card_id, user_name);
                             }
 
-                            unsigned char challenge_bytes[32];
-                            for (size_t i = 0; i < 32; i++) {
-                                sscanf(challenge + 2*i, "%2hhx", &challenge_bytes[i]);
-                            }
+                            int api_ok;
 
-                            unsigned char signature[256];
-                            size_t signature_len = 0;
-                            if (!sign_challenge_on_card(challenge_bytes, signature, &signature_len)) {
-                                print_ui("Error: Failed to sign challenge on card\n\nPlease remove your card.", version, (char *)card_id, user_name);
-                                card_present = 1;
-                                continue;
+                            if (challenge[0]) {
+                                api_ok = api_card_auth_with_signature((char *)card_id, challenge, signature, signature_len, user_token, sizeof(user_token));
+                            } else {
+                                api_ok = api_card_auth_with_counter((char *)card_id, counter, nonce, timestamp, signature, signature_len, user_token, sizeof(user_token));
                             }
 
-                            if (!reconnect_card()) {
-                                if (!connect_card()) {
-                                    card_present = 0;
-                                    continue;
-                                }
-                                print_ui("Error: Failed to reconnect to card\n\nPlease remove your card.", version, (char *)card_id, user_name);
+                            if (!api_ok) {
+                                print_ui("Error: Failed to authenticate with API\n\nPlease remove your card.", version, (char *)card_id, user_name);
                                 card_present = 1;
                                 continue;
                             }
 
-                            if (!api_card_auth_with_signature((char *)card_id, challenge, signature, signature_len, user_token, sizeof(user_token))) {
-                                print_ui("Error: Failed to authenticate with API\n\nPlease remove your card.", version, (char *)card_id, user_name);
-                                card_present = 1;
-                                continue;
+                            // New offline budget while the PIN is verified,
+                            // for payments when the network is down. The API
+                            // sends the last voucher again until one of its
+                            // receipts is settled: the card already has it.
+                            unsigned char voucher[SIZE_VOUCHER];
+                            OFFLINE_INFO offline_info;
+                            if (api_get_voucher((char *)card_id, user_token, voucher, sizeof(voucher))) {
+                                unsigned long epoch = ((unsigned long)voucher[0] << 24) | ((unsigned long)voucher[1] << 16) |
+                                                      ((unsigned long)voucher[2] << 8) | voucher[3];
+
+                                if ((!read_offline_info(&offline_info) || epoch > offline_info.epoch) &&
+                                    load_voucher_on_card(voucher) != 1) {
+                                    fprintf(stderr, "Offline voucher refused by the card\n");
+                                }
                             }
 
                             int balance = 0;
@@ -393,14 +721,28 @@ int main(int argc, char *argv[])
 
                                 strcat(display, "\nPlease remove your card.");
                                 print_ui(display, version, (char *)card_id, user_name);
+
+                                // Bring the card history up to date for the next session
+                                unsigned char entries[HISTORY_ENTRIES][SIZE_HISTORY_APPEND];
+                                int entry_count = 0;
+                                unsigned long newest = history_count > 0 ? history[0].index : 0;
+
+                                if (api_fetch_history((char *)card_id, user_token, newest, &entries[0][0], SIZE_HISTORY_APPEND, HISTORY_ENTRIES, &entry_count)) {
+                                    for (int i = 0; i < entry_count; i++) {
+                                        append_history_on_card(entries[i]);
+                                    }
+                                }
                             } else {
                                 print_ui("Error: Failed to fetch account data\n\nPlease remove your card.", version, (char *)card_id, user_name);
                             }
 
+                            card_present = 1;
+                        } else if (card_info.pin_attempts == 0) {
+                            print_ui("Invalid PIN!\n\nCard is blocked, insert it again to unblock it with the PUK.", version, (char *)card_id, user_name);
                             card_present = 1;
                         } else {
                             char error_msg[128];
-                            sprintf(error_msg, "Invalid PIN!\n\n%d attempts remaining.\n\nPlease remove your card.", remaining_attempts);
+                            sprintf(error_msg, "Invalid PIN!\n\n%d attempts remaining.\n\nPlease remove your card.", card_info.pin_attempts);
                             print_ui(error_msg, version, (char *)card_id, user_name);
                             card_present = 1;
                         }
@@ -426,6 +768,7 @@ int main(int argc, char *argv[])
         usleep(500000);
     }
 
+    token_cleanup();
     api_cleanup();
     cleanup_card();
     return 0;
@@ -0,0 +1,209 @@
+#include "token.h"
+#include "api.h"
+#include "json.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The driver token (24h) is replaced by a background thread
+// TOKEN_REFRESH_MARGIN seconds before its exp claim, so card sessions never
+// wait for a login. While the API cannot be reached, the thread retries
+// every TOKEN_RETRY_DELAY seconds and the current token stays in use.
+#define TOKEN_SIZE 512
+#define TOKEN_REFRESH_MARGIN 600
+#define TOKEN_RETRY_DELAY 30
+// Refresh period of a token without exp claim
+#define TOKEN_UNKNOWN_LIFETIME 3600
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t refresher;
+static int refresher_running = 0;
+
+static char driver_username[128];
+static char driver_password[128];
+static char driver_token[TOKEN_SIZE];
+static long driver_exp = 0;
+static long refresh_at = 0;
+
+static int base64url_value(char c)
+{
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '-') return 62;
+    if (c == '_') return 63;
+    return -1;
+}
+
+// Decodes len characters (unpadded base64url) into out, returns the size
+static size_t base64url_decode(const char *in, size_t len, char *out, size_t out_size)
+{
+    unsigned long bits = 0;
+    int count = 0;
+    size_t size = 0;
+    int value;
+
+    for (size_t i = 0; i < len; i++) {
+        value = base64url_value(in[i]);
+        if (value < 0) {
+            break;
+        }
+        bits = ((bits << 6) | value) & 0xFFFF;
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            if (size == out_size) {
+                return 0;
+            }
+            out[size++] = (bits >> count) & 0xFF;
+        }
+    }
+    return size;
+}
+
+static void exp_callback(JSON_PARSER *parser, JSON_EVENT event, const char *value, size_t len)
+{
+    long *exp = parser->user;
+
+    (void)len;
+    if (event == JSON_NUMBER && parser->depth == 1 && strcmp(json_key(parser, 1), "exp") == 0) {
+        *exp = strtol(value, NULL, 10);
+    }
+}
+
+// exp claim of a JWT (Unix seconds), 0 if it has none
+static long token_expiry(const char *token)
+{
+    char payload[TOKEN_SIZE];
+    const char *start;
+    const char *end;
+    JSON_PARSER parser;
+    long exp = 0;
+    size_t len;
+
+    // header.payload.signature
+    start = strchr(token, '.');
+    if (!start) {
+        return 0;
+    }
+    start++;
+    end = strchr(start, '.');
+    if (!end) {
+        return 0;
+    }
+
+    len = base64url_decode(start, end - start, payload, sizeof(payload));
+    json_init(&parser, exp_callback, &exp);
+    json_feed(&parser, payload, len);
+    return json_finish(&parser) ? exp : 0;
+}
+
+// Takes a new driver token and schedules its refresh, with lock held
+static void set_driver_token(const char *token)
+{
+    long now = time(NULL);
+
+    strncpy(driver_token, token, sizeof(driver_token) - 1);
+    driver_token[sizeof(driver_token) - 1] = '\0';
+    driver_exp = token_expiry(token);
+
+    refresh_at = (driver_exp ? driver_exp : now + TOKEN_UNKNOWN_LIFETIME) - TOKEN_REFRESH_MARGIN;
+    if (refresh_at < now + TOKEN_RETRY_DELAY) {
+        refresh_at = now + TOKEN_RETRY_DELAY;
+    }
+}
+
+static void *refresh_loop(void *arg)
+{
+    char token[TOKEN_SIZE];
+    struct timespec until;
+    int ok;
+
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while (refresher_running) {
+        if (time(NULL) < refresh_at) {
+            until.tv_sec = refresh_at;
+            until.tv_nsec = 0;
+            pthread_cond_timedwait(&wake, &lock, &until);
+            continue;
+        }
+
+        // The API call runs unlocked: token_driver() keeps answering
+        pthread_mutex_unlock(&lock);
+        ok = api_login(driver_username, driver_password, token, sizeof(token));
+        pthread_mutex_lock(&lock);
+
+        if (ok) {
+            set_driver_token(token);
+        } else {
+            fprintf(stderr, "Driver token refresh failed, retrying in %d s\n", TOKEN_RETRY_DELAY);
+            refresh_at = time(NULL) + TOKEN_RETRY_DELAY;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int token_init(const char *username, const char *password)
+{
+    char token[TOKEN_SIZE];
+
+    strncpy(driver_username, username, sizeof(driver_username) - 1);
+    strncpy(driver_password, password, sizeof(driver_password) - 1);
+
+    if (!api_login(driver_username, driver_password, token, sizeof(token))) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&lock);
+    set_driver_token(token);
+    refresher_running = 1;
+    pthread_mutex_unlock(&lock);
+
+    // Without the thread the token still works until it expires
+    if (pthread_create(&refresher, NULL, refresh_loop, NULL) != 0) {
+        fprintf(stderr, "Warning: no driver token refresh\n");
+        refresher_running = 0;
+    }
+    return 1;
+}
+
+void token_cleanup()
+{
+    int running;
+
+    pthread_mutex_lock(&lock);
+    running = refresher_running;
+    refresher_running = 0;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+
+    if (running) {
+        pthread_join(refresher, NULL);
+    }
+}
+
+int token_driver(char *buffer, size_t buffer_size)
+{
+    int valid;
+
+    pthread_mutex_lock(&lock);
+    strncpy(buffer, driver_token, buffer_size - 1);
+    buffer[buffer_size - 1] = '\0';
+    valid = driver_token[0] && (!driver_exp || driver_exp > time(NULL));
+    pthread_mutex_unlock(&lock);
+
+    return valid;
+}
+
+void token_refresh_driver()
+{
+    pthread_mutex_lock(&lock);
+    refresh_at = 0;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+}
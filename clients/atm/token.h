@@ -0,0 +1,21 @@
+#ifndef TOKEN_H
+#define TOKEN_H
+
+#include <stddef.h>
+
+// Driver token only. Card tokens are not cached between insertions: the ATM
+// has no card key, so a token reused on a PIN check alone would let an
+// emulated card in. Every insertion is signed by the card and checked by
+// the API.
+
+// Logs the driver in (blocking, once) and starts the thread that keeps its
+// token fresh. Returns 0 if the first login fails.
+int token_init(const char *username, const char *password);
+void token_cleanup();
+// Copies the current driver token, never waits for a login. Returns 0 if
+// it is known to be expired (the refresher keeps trying meanwhile).
+int token_driver(char *buffer, size_t buffer_size);
+// The API refused the driver token: log in again now, in the background
+void token_refresh_driver();
+
+#endif
@@ -7,7 +7,7 @@ import threading
 import time
 import logging
 import sys
-from card_reader import wait_for_reader, check_card_present, read_card_id, read_version, is_card_still_present, verify_pin, sign_challenge, check_pin_defined, is_reader_connected
+from card_reader import wait_for_reader, check_card_present, read_card_id, read_version, is_card_still_present, authenticate, check_pin_defined, is_reader_connected
 import api
 from api import get_challenge, card_auth_with_signature, fetch_user_by_card, create_transaction
 import ssl
@@ -167,46 +167,36 @@ def handle_verify_pin(data):
         logger.warning(f"PIN non numérique reçu")
         return
     
-    logger.info(f"Vérification du PIN sur la carte...")
-    result = verify_pin(current_connection, pin)
+    logger.info(f"Récupération du challenge...")
+    challenge_result = get_challenge(current_card_id)
     
-    if result['success']:
-        logger.info(f"PIN correct - Challenge en cours...")
-        
-        challenge_result = get_challenge(current_card_id)
-        
-        if not challenge_result['success']:
-            error_msg = challenge_result.get('error', '')
-            logger.error(f"Erreur récupération challenge: {error_msg}")
-            
-            if 'not active' in error_msg.lower() or 'inactive' in error_msg.lower():
-                user_error = "Carte inactive ou bloquée. Veuillez contacter un administrateur."
-            else:
-                user_error = f"Erreur lors de la récupération du challenge: {error_msg}"
-            
-            emit('pin_verification_result', {
-                'success': False,
-                'error': user_error,
-                'attempts_remaining': None,
-                'blocked': False
-            })
-            return
+    if not challenge_result['success']:
+        error_msg = challenge_result.get('error', '')
+        logger.error(f"Erreur récupération challenge: {error_msg}")
         
-        challenge = challenge_result['challenge']
-        
-        sign_result = sign_challenge(current_connection, challenge)
+        if 'not active' in error_msg.lower() or 'inactive' in error_msg.lower():
+            user_error = "Carte inactive ou bloquée. Veuillez contacter un administrateur."
+        else:
+            user_error = f"Erreur lors de la récupération du challenge: {error_msg}"
         
-        if not sign_result['success']:
-            logger.error(f"Erreur signature challenge: {sign_result.get('error')}")
-            emit('pin_verification_result', {
-                'success': False,
-                'error': f"Erreur lors de la signature: {sign_result.get('error')}",
-                'attempts_remaining': None,
-                'blocked': False
-            })
-            return
+        emit('pin_verification_result', {
+            'success': False,
+            'error': user_error,
+            'attempts_remaining': None,
+            'blocked': False
+        })
+        return
+    
+    challenge = challenge_result['challenge']
+    
+    # PIN check and challenge signature in a single card exchange
+    logger.info(f"Vérification du PIN et signature du challenge sur la carte...")
+    result = authenticate(current_connection, pin, challenge)
+    
+    if result['success']:
+        logger.info(f"PIN correct - Challenge signé")
         
-        signature = sign_result['signature']
+        signature = result['signature']
         
         auth_result = card_auth_with_signature(current_card_id, challenge, signature)
         
@@ -18,6 +18,8 @@ CMD_VERIFY_PIN = [0x80, 0x06, 0x00, 0x00, SIZE_PIN]
 CMD_SET_CHALLENGE = [0x80, 0x0C, 0x00, 0x00, SIZE_CHALLENGE]
 CMD_SIGN_CHALLENGE = [0x80, 0x0B, 0x00, 0x00, SIZE_SIGNATURE]
 CMD_CHECK_PIN_DEFINED = [0x80, 0x0E, 0x00, 0x00, 0x01]
+CMD_AUTHENTICATE = [0x80, 0x0F, 0x00, 0x00, SIZE_PIN + SIZE_CHALLENGE]
+CMD_GET_RESPONSE = [0x00, 0xC0, 0x00, 0x00]
 
 
 def wait_for_reader():    
@@ -218,6 +220,76 @@ def sign_challenge(connection, challenge_hex):
         }
 
 
+def authenticate(connection, pin, challenge_hex):
+    """VERIFY_PIN + SET_CHALLENGE + SIGN_CHALLENGE in one AUTHENTICATE command."""
+    try:
+        if len(pin) != SIZE_PIN:
+            return {
+                'success': False,
+                'attempts_remaining': None,
+                'blocked': False,
+                'error': f'PIN must be {SIZE_PIN} digits'
+            }
+
+        if len(challenge_hex) != 64:
+            return {
+                'success': False,
+                'attempts_remaining': None,
+                'blocked': False,
+                'error': f'Challenge must be 64 hex characters (got {len(challenge_hex)})'
+            }
+
+        pin_bytes = [int(c) for c in pin]
+        challenge_bytes = bytes.fromhex(challenge_hex)
+
+        cmd = CMD_AUTHENTICATE + pin_bytes + list(challenge_bytes)
+
+        data, sw1, sw2 = connection.transmit(cmd)
+
+        # Signature waiting on the card, unless the reader fetched it already
+        if sw1 == 0x61:
+            data, sw1, sw2 = connection.transmit(CMD_GET_RESPONSE + [sw2])
+
+        if sw1 == 0x90 and sw2 == 0x00 and len(data) == SIZE_SIGNATURE:
+            return {
+                'success': True,
+                'attempts_remaining': MAX_PIN_ATTEMPTS,
+                'blocked': False,
+                'signature': bytes(data)
+            }
+
+        elif sw1 == 0x63 and (sw2 & 0xF0) == 0xC0:
+            attempts_remaining = sw2 & 0x0F
+            return {
+                'success': False,
+                'attempts_remaining': attempts_remaining,
+                'blocked': attempts_remaining == 0
+            }
+
+        elif sw1 == 0x69 and sw2 == 0x83:
+            return {
+                'success': False,
+                'attempts_remaining': 0,
+                'blocked': True
+            }
+
+        else:
+            return {
+                'success': False,
+                'attempts_remaining': None,
+                'blocked': False,
+                'error': f'AUTHENTICATE failed: SW1={hex(sw1)}, SW2={hex(sw2)}'
+            }
+
+    except Exception as e:
+        return {
+            'success': False,
+            'attempts_remaining': None,
+            'blocked': False,
+            'error': str(e)
+        }
+
+
 def check_pin_defined(connection):
     try:
         data, sw1, sw2 = connection.transmit(CMD_CHECK_PIN_DEFINED)